@@ -56,8 +56,11 @@ int main() {
     free(staticFilesPath);
   });
 
+  /* Starting another copy takes over from this one without dropping any */
+  app->server->pidFile = "server.pid";
+  app->server->handoffPath = "server.sock";
+
   app->listen(port, ^{
     printf("TodoMVC app listening at http://localhost:%d\n", port);
-    writePid("server.pid");
   });
 }
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <string/string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <tape/tape.h>
 #include <unistd.h>
 
@@ -224,6 +225,43 @@ static void sendData(char *data) {
   close(sock);
 }
 
+/* Sends each part separately, pausing in between like a slow client */
+static string_t *sendRequestParts(char **parts, int count) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in serv_addr;
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_port = htons(3032);
+  inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);
+  struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+  for (int i = 0; i < count; i++) {
+    if (i > 0)
+      usleep(50000);
+    send(sock, parts[i], strlen(parts[i]), 0);
+  }
+  shutdown(sock, SHUT_WR);
+  char *response = malloc(4096);
+  size_t responseLen = 0;
+  size_t responseSize = 4096;
+  ssize_t readBytes;
+  while ((readBytes = recv(sock, response + responseLen,
+                           responseSize - responseLen - 1, 0)) > 0) {
+    responseLen += readBytes;
+    if (responseSize - responseLen == 1) {
+      responseSize *= 2;
+      response = realloc(response, responseSize);
+    }
+  }
+  response[responseLen] = '\0';
+  close(sock);
+  string_t *responseString = string(response);
+  free(response);
+  return responseString;
+}
+
+static string_t *sendRequest(char *data) { return sendRequestParts(&data, 1); }
+
 static void randomString(char *str, size_t size) {
   const char charset[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJK=;:!@#$%^&*()_+-"
                          "=[]{}|/.,<>?0123456789";
@@ -396,6 +434,12 @@ testHandler testHandlerFactory(tape_t *root, int level, int ignore,
       return response;
     };
 
+    t->sendRequestParts = ^(char **parts, int count) {
+      string_t *response = sendRequestParts(parts, count);
+      t->trash(response->free);
+      return response;
+    };
+
     t->post = ^(char *url, char *data) {
       string_t *response = curlPost(url, data);
       t->trash(response->free);
@@ -430,6 +474,12 @@ testHandler testHandlerFactory(tape_t *root, int level, int ignore,
       return sendData(data);
     };
 
+    t->sendRequest = ^(char *data) {
+      string_t *response = sendRequest(data);
+      t->trash(response->free);
+      return response;
+    };
+
     t->fetch =
         ^(char *path, char *method, string_collection_t *headers, char *json) {
           char *baseUrl = "http://127.0.0.1:3032";
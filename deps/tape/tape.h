@@ -57,6 +57,8 @@ typedef struct tape_t {
   string_t * (^patch)(char *, char *);
   string_t * (^delete)(char *);
   void (^sendData)(char *);
+  string_t * (^sendRequest)(char *);
+  string_t * (^sendRequestParts)(char **, int);
   string_t * (^getHeaders)(char *);
   string_t * (^fetch)(char *path, char *method, string_collection_t *headers,
                       char *json);
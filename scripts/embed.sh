@@ -13,6 +13,36 @@ directories=("$@")
 # Clear or create the output file
 > "$output_file"
 
+# Compress text files once at build time, so expressStatic can send the
+# variant that Accept-Encoding allows. Siblings already on disk are embedded
+# as they are, and a variant no smaller than its file is left out.
+compressed=$(mktemp)
+trap 'rm -f "$compressed"' EXIT
+
+embed_compressed() {
+  local file=$1 suffix=$2 tool=$3
+  shift 2
+  case "$file" in
+    *.css|*.js|*.html|*.svg|*.json|*.txt|*.xml|*.map) ;;
+    *) return ;;
+  esac
+  if [ -f "$file.$suffix" ] || ! command -v "$tool" > /dev/null; then
+    return
+  fi
+  "$@" "$file" > "$compressed" || return
+  local length
+  length=$(wc -c < "$compressed" | tr -d ' ')
+  if [ "$length" -ge "$(wc -c < "$file" | tr -d ' ')" ]; then
+    return
+  fi
+  local name
+  name=$(echo "$file.$suffix" | sed 's/[^a-zA-Z0-9]/_/g')
+  echo "unsigned char $name[] = {" >> "$output_file"
+  xxd -i < "$compressed" >> "$output_file"
+  echo "};" >> "$output_file"
+  echo "unsigned int ${name}_len = $length;" >> "$output_file"
+}
+
 # Function to process files in directories
 process_directory() {
   local dir=$1
@@ -20,6 +50,8 @@ process_directory() {
     for file in "$dir"/*; do
       if [ -f "$file" ]; then
         xxd -i "$file" >> "$output_file"
+        embed_compressed "$file" gz gzip -9 -n -c
+        embed_compressed "$file" br brotli -q 11 -c
       fi
     done
   else
@@ -0,0 +1,812 @@
+#ifdef __linux__
+#include "express.h"
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+/*
+
+An io_uring implementation of the client handler.
+
+Every worker thread owns a ring with a multishot accept on the listening
+socket and a group of provided buffers that receives are served from, so no
+buffer is pinned to an idle connection. Responses are collected in the
+connection's output queue and sent from there, a segment per send, with the
+close linked behind the last one when the connection is done. Everything
+queued while handling a batch of completions is submitted with the next
+io_uring_enter().
+
+Timeouts are linked to each receive and send as absolute deadlines, so the
+kernel keeps the timers and a ring needs no timer wheel of its own.
+
+A drain is seen through a poll on the server's drainFd. The worker cancels
+its accept, then looks over its connections every tick, shutting the idle
+ones so that their receives complete, until none are left or the drain
+times out and the rest are shut too.
+
+*/
+
+#define IO_URING_ENTRIES 1024
+#define IO_URING_BUFFER_COUNT 128
+#define IO_URING_BUFFER_GROUP 1
+
+int serveClientRequest(client_t client, router_t *baseRouter);
+void clientOutputInit(client_output_t *output, int deferred,
+                      size_t highWaterMark);
+void clientOutputFree(client_output_t *output);
+ssize_t clientOutputPeek(client_output_t *output, const char **data,
+                         char *scratch, size_t scratchSize);
+void clientOutputConsume(client_output_t *output, size_t length);
+void clientPipelineInit(client_pipeline_t *pipeline, size_t maxBodySize,
+                        size_t spillThreshold);
+void clientPipelineFree(client_pipeline_t *pipeline);
+int clientPipelineAppend(client_pipeline_t *pipeline, const char *data,
+                         size_t length);
+pipeline_frame_t clientPipelineFrame(client_pipeline_t *pipeline);
+void clientPipelineContinue(client_pipeline_t *pipeline,
+                            client_output_t *output, int socket);
+int initReusePortSocket(server_t *server);
+void releaseInheritedSockets(server_t *server);
+void formatClientAddress(const struct sockaddr_storage *address,
+                         socklen_t length, char *text, size_t size);
+void pinThreadToCpu(int cpu);
+
+/* Stored in the low bits of user_data, next to the connection pointer */
+typedef enum uring_op_t {
+  URING_ACCEPT,
+  URING_RECV,
+  URING_TIMEOUT,
+  URING_SEND,
+  URING_CLOSE,
+  URING_PROVIDE_BUFFERS,
+  URING_DRAIN,
+  URING_CANCEL
+} uring_op_t;
+
+#define URING_OP_MASK 7
+
+typedef enum uring_read_phase_t {
+  URING_READ_IDLE,
+  URING_READ_HEADERS,
+  URING_READ_BODY
+} uring_read_phase_t;
+
+typedef struct uring_t {
+  int fd;
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned *sqArray;
+  unsigned sqMask;
+  unsigned sqEntries;
+  unsigned sqLocalTail;
+  unsigned toSubmit;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe *cqes;
+  char *ringMemory;
+  size_t ringMemorySize;
+} uring_t;
+
+typedef struct uring_connection_t {
+  struct uring_connection_t *prev;
+  struct uring_connection_t *next;
+  client_t client;
+  char ip[CLIENT_ADDRESS_LENGTH];
+  int requestCount;
+  int inflight;
+  int closing;
+  int closed;
+  int shutDown;
+  uring_read_phase_t readPhase;
+  client_pipeline_t pipeline;
+  client_buffer_t headerBuffer;
+  client_output_t output;
+  char *fileChunk;
+  struct __kernel_timespec readDeadline;
+  struct __kernel_timespec writeDeadline;
+} uring_connection_t;
+
+typedef struct uring_worker_t {
+  uring_t ring;
+  char *buffers;
+  int multishotAccept;
+  int accepting;
+  int draining;
+  struct __kernel_timespec drainTick;
+  uring_connection_t *connections;
+  int serverSocket;
+  int cpu;
+  server_t *server;
+  router_t *baseRouter;
+} uring_worker_t;
+
+static void uringFree(uring_t *ring) {
+  if (ring->sqes != NULL)
+    munmap(ring->sqes, ring->sqesSize);
+  if (ring->ringMemory != NULL)
+    munmap(ring->ringMemory, ring->ringMemorySize);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  ring->sqes = NULL;
+  ring->ringMemory = NULL;
+  ring->fd = -1;
+}
+
+static int uringSetup(uring_t *ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  memset(ring, 0, sizeof(uring_t));
+
+  ring->fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+  check(ring->fd >= 0, "io_uring_setup() failed");
+  check(params.features & IORING_FEAT_SINGLE_MMAP,
+        "io_uring does not support IORING_FEAT_SINGLE_MMAP");
+
+  size_t sqRingSize =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqRingSize =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ringMemorySize = max(sqRingSize, cqRingSize);
+
+  char *ringMemory = mmap(NULL, ring->ringMemorySize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+  check(ringMemory != MAP_FAILED, "mmap() failed");
+  ring->ringMemory = ringMemory;
+
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  struct io_uring_sqe *sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED, ring->fd, IORING_OFF_SQES);
+  check(sqes != MAP_FAILED, "mmap() failed");
+  ring->sqes = sqes;
+
+  ring->sqHead = (unsigned *)(ringMemory + params.sq_off.head);
+  ring->sqTail = (unsigned *)(ringMemory + params.sq_off.tail);
+  ring->sqArray = (unsigned *)(ringMemory + params.sq_off.array);
+  ring->sqMask = *(unsigned *)(ringMemory + params.sq_off.ring_mask);
+  ring->sqEntries = params.sq_entries;
+  ring->sqLocalTail = *ring->sqTail;
+
+  ring->cqHead = (unsigned *)(ringMemory + params.cq_off.head);
+  ring->cqTail = (unsigned *)(ringMemory + params.cq_off.tail);
+  ring->cqMask = *(unsigned *)(ringMemory + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(ringMemory + params.cq_off.cqes);
+
+  return 0;
+error:
+  uringFree(ring);
+  return -1;
+}
+
+/* Submits everything queued so far and waits for waitFor completions */
+static int uringEnter(uring_t *ring, unsigned waitFor) {
+  int submitted;
+  __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+  do {
+    submitted = (int)syscall(SYS_io_uring_enter, ring->fd, ring->toSubmit,
+                             waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0,
+                             NULL, 0);
+  } while (submitted < 0 && errno == EINTR);
+  if (submitted > 0)
+    ring->toSubmit -= submitted;
+  return submitted;
+}
+
+/* Linked entries must reach the kernel in the same submission */
+static int uringReserve(uring_t *ring, unsigned count) {
+  unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (ring->sqLocalTail - head + count <= ring->sqEntries)
+    return 0;
+  uringEnter(ring, 0);
+  head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (ring->sqLocalTail - head + count <= ring->sqEntries)
+    return 0;
+  log_err("io_uring submission queue is full");
+  return -1;
+}
+
+static struct io_uring_sqe *uringNextSqe(uring_t *ring,
+                                         uring_connection_t *conn,
+                                         uring_op_t op) {
+  unsigned index = ring->sqLocalTail & ring->sqMask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->user_data = (uintptr_t)conn | op;
+  ring->sqArray[index] = index;
+  ring->sqLocalTail++;
+  ring->toSubmit++;
+  if (conn != NULL)
+    conn->inflight++;
+  return sqe;
+}
+
+static void prepAccept(uring_worker_t *worker) {
+  if (uringReserve(&worker->ring, 1) < 0)
+    return;
+  struct io_uring_sqe *sqe = uringNextSqe(&worker->ring, NULL, URING_ACCEPT);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = worker->serverSocket;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  if (worker->multishotAccept)
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  worker->accepting = 1;
+}
+
+/* Completes once drainFd is written to, which is never read back */
+static void prepDrainPoll(uring_worker_t *worker) {
+  if (uringReserve(&worker->ring, 1) < 0)
+    return;
+  struct io_uring_sqe *sqe = uringNextSqe(&worker->ring, NULL, URING_DRAIN);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = worker->server->drainFd;
+  sqe->poll32_events = POLLIN;
+}
+
+static void prepDrainTick(uring_worker_t *worker) {
+  if (uringReserve(&worker->ring, 1) < 0)
+    return;
+  worker->drainTick.tv_sec = 0;
+  worker->drainTick.tv_nsec = TIMER_WHEEL_TICK_MS * 1000000L;
+  struct io_uring_sqe *sqe = uringNextSqe(&worker->ring, NULL, URING_DRAIN);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uintptr_t)&worker->drainTick;
+  sqe->len = 1;
+}
+
+/* Cancels whichever request was submitted with userData */
+static void prepCancel(uring_worker_t *worker, uint64_t userData) {
+  if (uringReserve(&worker->ring, 1) < 0)
+    return;
+  struct io_uring_sqe *sqe = uringNextSqe(&worker->ring, NULL, URING_CANCEL);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = userData;
+}
+
+static void provideBuffers(uring_worker_t *worker, int bufferId, int count) {
+  if (uringReserve(&worker->ring, 1) < 0)
+    return;
+  struct io_uring_sqe *sqe =
+      uringNextSqe(&worker->ring, NULL, URING_PROVIDE_BUFFERS);
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = count;
+  sqe->addr =
+      (uintptr_t)(worker->buffers + (size_t)bufferId * MAX_REQUEST_SIZE);
+  sqe->len = MAX_REQUEST_SIZE;
+  sqe->off = bufferId;
+  sqe->buf_group = IO_URING_BUFFER_GROUP;
+}
+
+static void closeConnection(uring_worker_t *worker, uring_connection_t *conn) {
+  conn->closing = 1;
+  if (uringReserve(&worker->ring, 1) < 0) {
+    close(conn->client.socket);
+    conn->closed = 1;
+    return;
+  }
+  struct io_uring_sqe *sqe = uringNextSqe(&worker->ring, conn, URING_CLOSE);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = conn->client.socket;
+}
+
+static void releaseConnection(uring_worker_t *worker,
+                              uring_connection_t *conn) {
+  if (!conn->closed || conn->inflight > 0)
+    return;
+  if (conn->prev != NULL)
+    conn->prev->next = conn->next;
+  else
+    worker->connections = conn->next;
+  if (conn->next != NULL)
+    conn->next->prev = conn->prev;
+  __atomic_sub_fetch(&worker->server->connections, 1, __ATOMIC_RELEASE);
+  free(conn->headerBuffer.data);
+  clientPipelineFree(&conn->pipeline);
+  clientOutputFree(&conn->output);
+  free(conn->fileChunk);
+  free(conn);
+}
+
+/* Deadlines are absolute so that a slow client cannot extend them */
+static void setDeadline(struct __kernel_timespec *deadline, int timeoutSecs) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  deadline->tv_sec = now.tv_sec + timeoutSecs;
+  deadline->tv_nsec = now.tv_nsec;
+}
+
+static struct io_uring_sqe *
+prepLinkTimeout(uring_worker_t *worker, uring_connection_t *conn,
+                struct __kernel_timespec *deadline) {
+  struct io_uring_sqe *sqe = uringNextSqe(&worker->ring, conn, URING_TIMEOUT);
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uintptr_t)deadline;
+  sqe->len = 1;
+  sqe->timeout_flags = IORING_TIMEOUT_ABS;
+  return sqe;
+}
+
+static int prepRecv(uring_worker_t *worker, uring_connection_t *conn) {
+  if (uringReserve(&worker->ring, 2) < 0)
+    return -1;
+
+  struct io_uring_sqe *sqe = uringNextSqe(&worker->ring, conn, URING_RECV);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->client.socket;
+  sqe->len = MAX_REQUEST_SIZE;
+  sqe->flags = IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+  sqe->buf_group = IO_URING_BUFFER_GROUP;
+
+  prepLinkTimeout(worker, conn, &conn->readDeadline);
+
+  return 0;
+}
+
+static int prepSend(uring_worker_t *worker, uring_connection_t *conn) {
+  /* Queued files are read a chunk at a time into a buffer of their own */
+  if (conn->output.head->fd >= 0 && conn->fileChunk == NULL) {
+    conn->fileChunk = malloc(OUTPUT_FILE_CHUNK_SIZE);
+    if (conn->fileChunk == NULL)
+      return -1;
+  }
+
+  const char *data;
+  ssize_t length = clientOutputPeek(&conn->output, &data, conn->fileChunk,
+                                    OUTPUT_FILE_CHUNK_SIZE);
+  if (length <= 0)
+    return -1;
+
+  if (uringReserve(&worker->ring, 2) < 0)
+    return -1;
+
+  setDeadline(&conn->writeDeadline, worker->server->writeTimeout);
+
+  struct io_uring_sqe *sqe = uringNextSqe(&worker->ring, conn, URING_SEND);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->client.socket;
+  sqe->addr = (uintptr_t)data;
+  sqe->len = length;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->flags = IOSQE_IO_LINK;
+
+  prepLinkTimeout(worker, conn, &conn->writeDeadline);
+
+  return 0;
+}
+
+static void serveConnection(uring_worker_t *worker, uring_connection_t *conn) {
+  server_t *server = worker->server;
+  int keepAlive = 1;
+  int pipelineDepth = 0;
+  pipeline_frame_t frame = FRAME_COMPLETE;
+
+  /* Serve the complete requests that are buffered, a bounded number at once */
+  while (keepAlive && !conn->output.failed && conn->pipeline.length > 0 &&
+         pipelineDepth < server->maxPipelineDepth &&
+         conn->output.length <= server->outputHighWaterMark) {
+    frame = clientPipelineFrame(&conn->pipeline);
+    if (frame == FRAME_ERROR)
+      keepAlive = 0;
+    if (frame == FRAME_BODY)
+      clientPipelineContinue(&conn->pipeline, &conn->output,
+                             conn->client.socket);
+    if (frame != FRAME_COMPLETE)
+      break;
+
+    conn->client.keepAlive =
+        server->keepAlive && !worker->draining &&
+        conn->requestCount + 1 < server->keepAliveMaxRequests;
+    keepAlive = serveClientRequest(conn->client, worker->baseRouter);
+
+    conn->requestCount++;
+    pipelineDepth++;
+  }
+
+  /* Output that could not be queued leaves nothing to send */
+  if (!keepAlive || conn->output.failed)
+    conn->closing = 1;
+
+  if (conn->output.length > 0) {
+    if (prepSend(worker, conn) < 0)
+      closeConnection(worker, conn);
+    return;
+  }
+
+  if (conn->closing) {
+    closeConnection(worker, conn);
+    return;
+  }
+
+  /* Each phase of reading a request gets its own deadline */
+  uring_read_phase_t readPhase = conn->pipeline.length == 0 ? URING_READ_IDLE
+                                 : frame == FRAME_HEAD      ? URING_READ_HEADERS
+                                 : frame == FRAME_BODY      ? URING_READ_BODY
+                                                            : URING_READ_IDLE;
+  if (readPhase != conn->readPhase || readPhase == URING_READ_IDLE) {
+    conn->readPhase = readPhase;
+    setDeadline(&conn->readDeadline,
+                readPhase == URING_READ_HEADERS ? server->headerTimeout
+                : readPhase == URING_READ_BODY  ? server->bodyTimeout
+                                                : server->keepAliveTimeout);
+  }
+
+  if (prepRecv(worker, conn) < 0)
+    closeConnection(worker, conn);
+}
+
+static void openConnection(uring_worker_t *worker, int clientSocket) {
+  uring_connection_t *conn = malloc(sizeof(uring_connection_t));
+  if (conn == NULL) {
+    log_err("Out of memory.");
+    close(clientSocket);
+    return;
+  }
+
+  conn->requestCount = 0;
+  conn->inflight = 0;
+  conn->closing = 0;
+  conn->closed = 0;
+  conn->shutDown = 0;
+  conn->readPhase = URING_READ_IDLE;
+  clientPipelineInit(&conn->pipeline, worker->server->maxBodySize,
+                     worker->server->bodySpillThreshold);
+  conn->headerBuffer = (client_buffer_t){.data = NULL, .length = 0, .size = 0};
+  clientOutputInit(&conn->output, 1,
+                   worker->server->outputHighWaterMark);
+  conn->fileChunk = NULL;
+
+  /* Multishot accept shares one completion for every peer address */
+  struct sockaddr_storage clientAddress;
+  socklen_t clientAddressLen = sizeof(clientAddress);
+  conn->ip[0] = '\0';
+  if (getpeername(clientSocket, (struct sockaddr *)&clientAddress,
+                  &clientAddressLen) == 0)
+    formatClientAddress(&clientAddress, clientAddressLen, conn->ip,
+                        sizeof(conn->ip));
+
+  conn->client = (client_t){.socket = clientSocket,
+                            .ip = conn->ip,
+                            .pipeline = &conn->pipeline,
+                            .headerBuffer = &conn->headerBuffer,
+                            .output = &conn->output};
+
+  setDeadline(&conn->readDeadline, worker->server->acceptTimeout);
+
+  if (prepRecv(worker, conn) < 0) {
+    close(clientSocket);
+    clientPipelineFree(&conn->pipeline);
+    clientOutputFree(&conn->output);
+    free(conn);
+    return;
+  }
+
+  conn->prev = NULL;
+  conn->next = worker->connections;
+  if (conn->next != NULL)
+    conn->next->prev = conn;
+  worker->connections = conn;
+  __atomic_add_fetch(&worker->server->connections, 1, __ATOMIC_RELEASE);
+}
+
+static void handleAccept(uring_worker_t *worker, int result, unsigned flags) {
+  /* Kernels before 5.19 reject multishot and take one connection per accept */
+  if (result == -EINVAL && worker->multishotAccept)
+    worker->multishotAccept = 0;
+  else if (result >= 0)
+    openConnection(worker, result);
+
+  if (flags & IORING_CQE_F_MORE)
+    return;
+  worker->accepting = 0;
+  if (!worker->draining)
+    prepAccept(worker);
+  else
+    __atomic_sub_fetch(&worker->server->accepting, 1, __ATOMIC_RELEASE);
+}
+
+/* Nothing is half read, half written or still being served */
+static int idleConnection(uring_connection_t *conn) {
+  return !conn->closing && conn->readPhase == URING_READ_IDLE &&
+         conn->pipeline.length == 0 && conn->output.length == 0;
+}
+
+/*
+  Shutting a socket completes whatever is out on it, and the completion
+  closes the connection as usual. A connection that is closing may already
+  have its descriptor closed, so only its send is cancelled.
+*/
+static void shutConnection(uring_worker_t *worker, uring_connection_t *conn) {
+  if (conn->shutDown)
+    return;
+  conn->shutDown = 1;
+  if (conn->closing)
+    prepCancel(worker, (uintptr_t)conn | URING_SEND);
+  else
+    shutdown(conn->client.socket, SHUT_RDWR);
+}
+
+/*
+  The first time, the accept is cancelled. After that, every tick, idle
+  connections are shut, and all of them once the drain has expired.
+*/
+static void handleDrain(uring_worker_t *worker) {
+  server_t *server = worker->server;
+  if (!worker->draining) {
+    worker->draining = 1;
+    if (worker->accepting)
+      prepCancel(worker, URING_ACCEPT);
+    else
+      __atomic_sub_fetch(&server->accepting, 1, __ATOMIC_RELEASE);
+  }
+
+  int expired = __atomic_load_n(&server->drainExpired, __ATOMIC_ACQUIRE);
+  for (uring_connection_t *conn = worker->connections; conn != NULL;
+       conn = conn->next) {
+    if (expired || idleConnection(conn))
+      shutConnection(worker, conn);
+  }
+  if (worker->connections != NULL)
+    prepDrainTick(worker);
+}
+
+static void handleRecv(uring_worker_t *worker, uring_connection_t *conn,
+                       int result, unsigned flags) {
+  if (flags & IORING_CQE_F_BUFFER) {
+    int bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buffer = worker->buffers + (size_t)bufferId * MAX_REQUEST_SIZE;
+    if (result > 0 &&
+        clientPipelineAppend(&conn->pipeline, buffer, result) < 0) {
+      log_err("Request is too long");
+      result = -EMSGSIZE;
+    }
+    provideBuffers(worker, bufferId, 1);
+  }
+
+  if (result == -ENOBUFS) {
+    /* Every buffer is taken, retry behind the ones being returned */
+    if (prepRecv(worker, conn) < 0)
+      closeConnection(worker, conn);
+    return;
+  }
+
+  if (result <= 0) {
+    if (result == -ECANCELED && conn->requestCount == 0)
+      log_err("timeout");
+    closeConnection(worker, conn);
+    return;
+  }
+
+  serveConnection(worker, conn);
+}
+
+/*
+  A short send is carried on from where it stopped. The connection is only
+  closed once everything queued has been sent, so no close can cut off the
+  end of a response.
+*/
+static void handleSend(uring_worker_t *worker, uring_connection_t *conn,
+                       int result) {
+  if (result <= 0) {
+    closeConnection(worker, conn);
+    return;
+  }
+
+  clientOutputConsume(&conn->output, result);
+
+  if (conn->output.length > 0) {
+    if (prepSend(worker, conn) < 0)
+      closeConnection(worker, conn);
+    return;
+  }
+
+  if (conn->closing)
+    closeConnection(worker, conn);
+  else
+    serveConnection(worker, conn);
+}
+
+static void handleCompletion(uring_worker_t *worker, uint64_t userData,
+                             int result, unsigned flags) {
+  uring_op_t op = userData & URING_OP_MASK;
+  uring_connection_t *conn =
+      (uring_connection_t *)(uintptr_t)(userData & ~(uint64_t)URING_OP_MASK);
+
+  if (op == URING_ACCEPT) {
+    handleAccept(worker, result, flags);
+    return;
+  }
+
+  if (op == URING_PROVIDE_BUFFERS) {
+    if (result < 0)
+      log_err("IORING_OP_PROVIDE_BUFFERS failed: %s", strerror(-result));
+    return;
+  }
+
+  if (op == URING_DRAIN) {
+    handleDrain(worker);
+    return;
+  }
+
+  if (op == URING_CANCEL)
+    return;
+
+  conn->inflight--;
+
+  switch (op) {
+  case URING_RECV:
+    handleRecv(worker, conn, result, flags);
+    break;
+  case URING_SEND:
+    handleSend(worker, conn, result);
+    break;
+  case URING_CLOSE:
+    if (result != -ECANCELED)
+      conn->closed = 1;
+    break;
+  default:
+    break;
+  }
+
+  releaseConnection(worker, conn);
+}
+
+void *clientIoUringEventHandler(void *args) {
+  uring_worker_t *worker = (uring_worker_t *)args;
+  uring_t *ring = &worker->ring;
+
+  if (worker->cpu >= 0)
+    pinThreadToCpu(worker->cpu);
+
+  prepAccept(worker);
+  prepDrainPoll(worker);
+
+  /* Until a drain has seen every connection out and the accept is over */
+  while (!worker->draining || worker->connections != NULL ||
+         worker->accepting) {
+    if (uringEnter(ring, 1) < 0)
+      log_err("io_uring_enter() failed");
+
+    unsigned head = *ring->cqHead;
+    while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+      uint64_t userData = cqe->user_data;
+      int result = cqe->res;
+      unsigned flags = cqe->flags;
+      __atomic_store_n(ring->cqHead, ++head, __ATOMIC_RELEASE);
+      handleCompletion(worker, userData, result, flags);
+    }
+  }
+
+  uringFree(ring);
+  free(worker->buffers);
+  __atomic_sub_fetch(&worker->server->workers, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static int initUringWorker(uring_worker_t *worker) {
+  uring_t *ring = &worker->ring;
+  worker->buffers = NULL;
+  worker->multishotAccept = 1;
+  worker->accepting = 0;
+  worker->draining = 0;
+  worker->connections = NULL;
+
+  check_silent(uringSetup(ring, IO_URING_ENTRIES) == 0,
+               "uringSetup() failed");
+
+  worker->buffers = malloc((size_t)IO_URING_BUFFER_COUNT * MAX_REQUEST_SIZE);
+  check_mem(worker->buffers);
+
+  /* Hand the whole buffer group to the kernel before accepting anything */
+  provideBuffers(worker, 0, IO_URING_BUFFER_COUNT);
+  while (*ring->cqHead == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+    check(uringEnter(ring, 1) >= 0, "io_uring_enter() failed");
+
+  int result = ring->cqes[*ring->cqHead & ring->cqMask].res;
+  __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+  check(result >= 0, "IORING_OP_PROVIDE_BUFFERS failed: %s", strerror(-result));
+
+  return 0;
+error:
+  free(worker->buffers);
+  worker->buffers = NULL;
+  uringFree(ring);
+  return -1;
+}
+
+/*
+  Returns -1 without starting any thread when io_uring cannot be used, so
+  the caller can fall back to epoll. Otherwise it runs the first worker on
+  the calling thread.
+*/
+int initClientIoUringEventHandler(server_t *server, router_t *baseRouter) {
+  /* Each worker has its accepts out on a single socket */
+  if (server->listenerCount > 1) {
+    log_warn("io_uring listens on a single address");
+    return -1;
+  }
+
+  long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpuCount < 1)
+    cpuCount = 1;
+
+  int workerCount = 0;
+  uring_worker_t *workers =
+      malloc(sizeof(uring_worker_t) * server->threadCount);
+  check_mem(workers);
+
+  /* Polled by every ring, and never read, so that it wakes them all */
+  server->drainFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  check(server->drainFd >= 0, "eventfd() failed");
+
+  if (server->reusePort) {
+    server->shardCount = 0;
+    server->shardSockets = malloc(sizeof(int) * server->threadCount);
+    check_mem(server->shardSockets);
+  }
+
+  for (int i = 0; i < server->threadCount; ++i) {
+    uring_worker_t *worker = &workers[i];
+    check_silent(initUringWorker(worker) == 0, "initUringWorker() failed");
+    workerCount++;
+
+    worker->server = server;
+    worker->baseRouter = baseRouter;
+    worker->serverSocket = server->socket;
+    worker->cpu = -1;
+
+    /* Sharded mode gives every ring its own SO_REUSEPORT listener */
+    if (server->reusePort) {
+      worker->cpu = i % min(cpuCount, 1024);
+      if (i > 0) {
+        worker->serverSocket = initReusePortSocket(server);
+        check(worker->serverSocket >= 0, "initReusePortSocket() failed");
+        server->shardSockets[server->shardCount++] = worker->serverSocket;
+      }
+    }
+  }
+
+  releaseInheritedSockets(server);
+
+  /* A drain waits for every worker to be done with its connections */
+  __atomic_store_n(&server->workers, server->threadCount, __ATOMIC_RELEASE);
+  __atomic_store_n(&server->accepting, server->threadCount, __ATOMIC_RELEASE);
+  for (int i = 1; i < server->threadCount; ++i) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, clientIoUringEventHandler,
+                       &workers[i]) != 0) {
+      log_err("pthread_create() failed");
+      __atomic_sub_fetch(&server->workers, 1, __ATOMIC_RELEASE);
+      __atomic_sub_fetch(&server->accepting, 1, __ATOMIC_RELEASE);
+    }
+    pthread_attr_destroy(&attr);
+  }
+
+  clientIoUringEventHandler(&workers[0]);
+
+  return 0;
+error:
+  for (int i = 0; i < workerCount; ++i) {
+    free(workers[i].buffers);
+    uringFree(&workers[i].ring);
+  }
+  for (int i = 0; i < server->shardCount; ++i)
+    close(server->shardSockets[i]);
+  server->shardCount = 0;
+  free(server->shardSockets);
+  server->shardSockets = NULL;
+  if (server->drainFd >= 0)
+    close(server->drainFd);
+  server->drainFd = -1;
+  free(workers);
+  return -1;
+}
+#endif
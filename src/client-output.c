@@ -0,0 +1,277 @@
+#include "express.h"
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+/*
+
+A queue of the response bytes a connection's socket has not taken yet.
+
+While the queue is empty responses are sent straight from the caller's
+buffers, and only what the socket does not take is copied in. File bodies
+are queued by descriptor and sent with sendfile() as the socket drains, so a
+file is never copied through user space, let alone loaded into memory.
+
+A deferred queue is never written to the socket here, it only collects the
+output for a caller that sends it itself.
+
+A queue that fails, on a reset socket or when memory runs out, drops what it
+holds and takes nothing more, as a response with bytes missing from its
+middle is worse than none. Its connection is closed by whoever serves it.
+
+*/
+
+#define OUTPUT_SEGMENT_SIZE 16384
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+void clientOutputInit(client_output_t *output, int deferred,
+                      size_t highWaterMark) {
+  output->head = NULL;
+  output->tail = NULL;
+  output->length = 0;
+  output->highWaterMark = highWaterMark;
+  output->deferred = deferred;
+  output->failed = 0;
+}
+
+static void pushSegment(client_output_t *output, output_segment_t *segment) {
+  segment->next = NULL;
+  if (output->tail != NULL)
+    output->tail->next = segment;
+  else
+    output->head = segment;
+  output->tail = segment;
+  output->length += segment->length;
+}
+
+static void freeSegment(output_segment_t *segment) {
+  if (segment->fd >= 0)
+    close(segment->fd);
+  free(segment);
+}
+
+void clientOutputFree(client_output_t *output) {
+  while (output->head != NULL) {
+    output_segment_t *next = output->head->next;
+    freeSegment(output->head);
+    output->head = next;
+  }
+  output->tail = NULL;
+  output->length = 0;
+}
+
+static void failOutput(client_output_t *output) {
+  output->failed = 1;
+  clientOutputFree(output);
+}
+
+/* Copies into the last segment for as long as it has room */
+void clientOutputAppend(client_output_t *output, const char *data,
+                        size_t length) {
+  if (output->failed)
+    return;
+  output_segment_t *tail = output->tail;
+  if (tail != NULL && tail->fd < 0) {
+    size_t room = tail->size - (tail->offset + tail->length);
+    size_t copied = min(room, length);
+    memcpy(tail->data + tail->offset + tail->length, data, copied);
+    tail->length += copied;
+    output->length += copied;
+    data += copied;
+    length -= copied;
+  }
+
+  if (length == 0)
+    return;
+
+  size_t size = max(length, (size_t)OUTPUT_SEGMENT_SIZE);
+  output_segment_t *segment = malloc(sizeof(output_segment_t) + size);
+  check_mem(segment);
+  segment->fd = -1;
+  segment->offset = 0;
+  segment->length = length;
+  segment->size = size;
+  memcpy(segment->data, data, length);
+  pushSegment(output, segment);
+  return;
+error:
+  failOutput(output);
+}
+
+/* The queue owns fd from here on and closes it once it has been sent */
+void clientOutputAppendFile(client_output_t *output, int fd, off_t offset,
+                            size_t length) {
+  output_segment_t *segment = NULL;
+  check_silent(!output->failed && length > 0, "Nothing to queue");
+  segment = malloc(sizeof(output_segment_t));
+  if (segment == NULL)
+    failOutput(output);
+  check_mem(segment);
+  segment->fd = fd;
+  segment->offset = offset;
+  segment->length = length;
+  segment->size = 0;
+  pushSegment(output, segment);
+  return;
+error:
+  close(fd);
+}
+
+/*
+  Points data at the next bytes to send, reading them into scratch when they
+  are in a file. Returns how many there are, 0 once the queue is empty.
+*/
+ssize_t clientOutputPeek(client_output_t *output, const char **data,
+                         char *scratch, size_t scratchSize) {
+  output_segment_t *head = output->head;
+  if (head == NULL)
+    return 0;
+
+  if (head->fd < 0) {
+    *data = head->data + head->offset;
+    return head->length;
+  }
+
+  ssize_t readBytes =
+      pread(head->fd, scratch, min(head->length, scratchSize), head->offset);
+  check(readBytes > 0, "Could not read queued file");
+  *data = scratch;
+  return readBytes;
+error:
+  return -1;
+}
+
+void clientOutputConsume(client_output_t *output, size_t length) {
+  while (length > 0 && output->head != NULL) {
+    output_segment_t *head = output->head;
+    size_t consumed = min(length, head->length);
+    head->offset += consumed;
+    head->length -= consumed;
+    output->length -= consumed;
+    length -= consumed;
+    if (head->length == 0) {
+      output->head = head->next;
+      if (output->head == NULL)
+        output->tail = NULL;
+      freeSegment(head);
+    }
+  }
+}
+
+/*
+  sendfile() has no MSG_NOSIGNAL, so the workers block SIGPIPE for
+  themselves rather than the process ignoring it, and see a reset peer as
+  EPIPE. The signal left pending on the worker is taken back off it.
+*/
+void clientOutputBlockSigpipe() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+    log_err("pthread_sigmask() failed");
+}
+
+#ifdef __linux__
+static void discardSigpipe() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  struct timespec now = {0, 0};
+  while (sigtimedwait(&set, NULL, &now) == SIGPIPE)
+    ;
+}
+#endif
+
+/* Sends what the head segment holds, a file straight from the page cache */
+static ssize_t sendHead(client_output_t *output, int socket) {
+  output_segment_t *head = output->head;
+#ifdef __linux__
+  if (head->fd >= 0) {
+    off_t offset = head->offset;
+    ssize_t sent = sendfile(socket, head->fd, &offset, head->length);
+    if (sent < 0 && errno == EPIPE)
+      discardSigpipe();
+    if (sent == 0) {
+      log_err("Queued file is shorter than its length");
+      errno = EIO;
+      return -1;
+    }
+    return sent;
+  }
+#else
+  if (head->fd >= 0) {
+    char scratch[OUTPUT_FILE_CHUNK_SIZE];
+    const char *data;
+    ssize_t length = clientOutputPeek(output, &data, scratch, sizeof(scratch));
+    if (length < 0) {
+      errno = EIO;
+      return -1;
+    }
+    return send(socket, data, length, MSG_NOSIGNAL);
+  }
+#endif
+  return send(socket, head->data + head->offset, head->length, MSG_NOSIGNAL);
+}
+
+/*
+  Returns 1 once the queue is empty, 0 when the socket is full and -1 once
+  it has failed
+*/
+int clientOutputFlush(client_output_t *output, int socket) {
+  while (output->length > 0) {
+    ssize_t sent = sendHead(output, socket);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent < 0) {
+      failOutput(output);
+      return -1;
+    }
+    clientOutputConsume(output, sent);
+  }
+  return output->failed ? -1 : 1;
+}
+
+/* Nothing is sent ahead of bytes that are already queued */
+void clientOutputWrite(client_output_t *output, int socket, struct iovec *iov,
+                       int count) {
+  size_t sent = 0;
+  if (output->length > 0 && !output->deferred)
+    clientOutputFlush(output, socket);
+  if (output->failed)
+    return;
+  if (output->length == 0 && !output->deferred) {
+    struct msghdr message = {.msg_iov = iov, .msg_iovlen = count};
+    ssize_t result;
+    do {
+      result = sendmsg(socket, &message, MSG_NOSIGNAL);
+    } while (result < 0 && errno == EINTR);
+    if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      failOutput(output);
+      return;
+    }
+    if (result > 0)
+      sent = result;
+  }
+
+  for (int i = 0; i < count && !output->failed; i++) {
+    if (sent >= iov[i].iov_len) {
+      sent -= iov[i].iov_len;
+      continue;
+    }
+    clientOutputAppend(output, (const char *)iov[i].iov_base + sent,
+                       iov[i].iov_len - sent);
+    sent = 0;
+  }
+}
+
+void clientOutputWriteFile(client_output_t *output, int socket, int fd,
+                           off_t offset, size_t length) {
+  clientOutputAppendFile(output, fd, offset, length);
+  if (!output->deferred)
+    clientOutputFlush(output, socket);
+}
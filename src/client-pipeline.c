@@ -0,0 +1,393 @@
+#include "express.h"
+#include <sys/mman.h>
+
+/*
+
+Framing of the requests read from a connection.
+
+The pipeline grows to hold the request being read plus a head's worth of the
+one behind it, so a pipelining client cannot make it grow without bound. A
+body over the spill threshold skips the pipeline and is read straight into
+an mmap of an unlinked temp file, which the kernel can write back to disk
+rather than keep in memory.
+
+A chunked body is decoded in place as each read lands, so the chunk framing
+never takes up more than a read's worth of the pipeline, and one that grows
+past the maximum body size is turned away before the rest of it is read.
+Its length is only known at the last chunk, so once it is over the spill
+threshold what has been decoded is written out to the temp file as it
+comes, and the file is mapped at the end.
+
+A built request takes the pipeline's buffer with it rather than a copy.
+
+*/
+
+ssize_t parseRequestHead(const char *buf, size_t len, size_t lastLen,
+                         long long *contentLength, int *expectContinue,
+                         int *chunked);
+void clientOutputWrite(client_output_t *output, int socket, struct iovec *iov,
+                       int count);
+
+void clientPipelineInit(client_pipeline_t *pipeline, size_t maxBodySize,
+                        size_t spillThreshold) {
+  pipeline->data = NULL;
+  pipeline->length = 0;
+  pipeline->size = 0;
+  pipeline->parsedLength = 0;
+  pipeline->headLength = 0;
+  pipeline->bodyLength = 0;
+  pipeline->expectContinue = 0;
+  pipeline->chunked = CHUNKED_NONE;
+  memset(&pipeline->decoder, 0, sizeof(pipeline->decoder));
+  pipeline->spill = NULL;
+  pipeline->spillLength = 0;
+  pipeline->spillFd = -1;
+  pipeline->maxBodySize = maxBodySize;
+  pipeline->spillThreshold = spillThreshold;
+  pipeline->frameLength = 0;
+}
+
+void clientPipelineFree(client_pipeline_t *pipeline) {
+  free(pipeline->data);
+  if (pipeline->spill != NULL)
+    munmap(pipeline->spill, pipeline->bodyLength + 1);
+  if (pipeline->spillFd >= 0)
+    close(pipeline->spillFd);
+  pipeline->data = NULL;
+  pipeline->length = 0;
+  pipeline->size = 0;
+  pipeline->spill = NULL;
+  pipeline->spillFd = -1;
+}
+
+static int spilling(client_pipeline_t *pipeline) {
+  return pipeline->spill != NULL &&
+         pipeline->spillLength < pipeline->bodyLength;
+}
+
+static size_t pipelineLimit(client_pipeline_t *pipeline) {
+  size_t requestLength = pipeline->headLength + pipeline->frameLength;
+  /* Room for a chunked body to double in size before it is decoded further */
+  if (pipeline->chunked == CHUNKED_DECODING && pipeline->spillFd >= 0)
+    requestLength += pipeline->spillThreshold;
+  else if (pipeline->chunked == CHUNKED_DECODING)
+    requestLength += min(pipeline->bodyLength * 2, pipeline->maxBodySize);
+  else if (pipeline->spill == NULL)
+    requestLength += pipeline->bodyLength;
+  return max(requestLength, (size_t)MAX_REQUEST_SIZE) + MAX_REQUEST_SIZE;
+}
+
+/* Grows data towards room for length more bytes, returns the room there is */
+static size_t reservePipeline(client_pipeline_t *pipeline, size_t length) {
+  size_t limit = pipelineLimit(pipeline);
+  size_t size = min(pipeline->length + length, limit);
+  size_t doubled = min(pipeline->size * 2, limit);
+  if (size > pipeline->size) {
+    size = max(size, doubled);
+    char *data = realloc(pipeline->data, size);
+    check_mem(data);
+    pipeline->data = data;
+    pipeline->size = size;
+  }
+error:
+  return pipeline->size - pipeline->length;
+}
+
+/* An unlinked temp file, gone with its last descriptor or mapping */
+static int openSpill() {
+  const char *tmpDir = getenv("TMPDIR");
+  char path[256];
+  snprintf(path, sizeof(path), "%s/express-body-XXXXXX",
+           tmpDir != NULL ? tmpDir : "/tmp");
+
+  int fd = mkstemp(path);
+  check(fd >= 0, "mkstemp() failed");
+  unlink(path);
+  return fd;
+error:
+  return -1;
+}
+
+/* Maps the whole body from fd, which is closed either way */
+static int mapSpill(client_pipeline_t *pipeline, int fd) {
+  /* A byte longer than the body, so it is NUL terminated like one in memory */
+  size_t spillSize = pipeline->bodyLength + 1;
+  check(ftruncate(fd, spillSize) == 0, "ftruncate() failed");
+  char *spill =
+      mmap(NULL, spillSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  check(spill != MAP_FAILED, "mmap() failed");
+  close(fd);
+  pipeline->spill = spill;
+  return 0;
+error:
+  close(fd);
+  return -1;
+}
+
+/*
+  Writes what has been decoded of a chunked body past the spill threshold
+  out to the temp file, then maps it once the last chunk is in.
+*/
+static int spillChunks(client_pipeline_t *pipeline) {
+  if (pipeline->spillFd < 0 &&
+      (pipeline->spillThreshold == 0 ||
+       pipeline->bodyLength <= pipeline->spillThreshold))
+    return 0;
+  if (pipeline->spillFd < 0)
+    pipeline->spillFd = openSpill();
+  check_silent(pipeline->spillFd >= 0, "openSpill() failed");
+
+  char *body = pipeline->data + pipeline->headLength;
+  size_t buffered = pipeline->bodyLength - pipeline->spillLength;
+  for (size_t written = 0; written < buffered;) {
+    ssize_t result =
+        write(pipeline->spillFd, body + written, buffered - written);
+    check(result > 0 || (result < 0 && errno == EINTR), "write() failed");
+    if (result > 0)
+      written += result;
+  }
+  memmove(body, body + buffered,
+          pipeline->length - pipeline->headLength - buffered);
+  pipeline->length -= buffered;
+  pipeline->spillLength = pipeline->bodyLength;
+
+  if (pipeline->chunked == CHUNKED_COMPLETE) {
+    int fd = pipeline->spillFd;
+    pipeline->spillFd = -1;
+    check_silent(mapSpill(pipeline, fd) == 0, "mapSpill() failed");
+  }
+  return 0;
+error:
+  return -1;
+}
+
+/*
+  Decodes the chunks read since the last call, moving the data up against what
+  was decoded before. Whatever follows the last chunk is the next request.
+*/
+static void decodeChunks(client_pipeline_t *pipeline) {
+  if (pipeline->chunked != CHUNKED_DECODING)
+    return;
+  size_t decodedLength =
+      pipeline->headLength + pipeline->bodyLength - pipeline->spillLength;
+  size_t length = pipeline->length - decodedLength;
+  if (length == 0)
+    return;
+
+  ssize_t leftover = phr_decode_chunked(
+      &pipeline->decoder, pipeline->data + decodedLength, &length);
+  check(leftover != -1, "Invalid chunked body");
+  pipeline->bodyLength += length;
+  check(pipeline->bodyLength <= pipeline->maxBodySize,
+        "Request body too large");
+
+  pipeline->length = decodedLength + length;
+  if (leftover >= 0) {
+    pipeline->length += leftover;
+    pipeline->chunked = CHUNKED_COMPLETE;
+  }
+  check(spillChunks(pipeline) == 0, "Could not spill the request body");
+  return;
+error:
+  pipeline->chunked = CHUNKED_ERROR;
+}
+
+/*
+  Reads whatever the socket has without blocking, until the request being
+  read has all it needs. Returns -1 once the peer has closed or the read
+  failed.
+*/
+int clientPipelineRead(client_pipeline_t *pipeline, int socket) {
+  while (1) {
+    int toSpill = spilling(pipeline);
+    size_t room = toSpill ? pipeline->bodyLength - pipeline->spillLength
+                          : reservePipeline(pipeline, MAX_REQUEST_SIZE);
+    char *buffer = toSpill ? pipeline->spill + pipeline->spillLength
+                           : pipeline->data + pipeline->length;
+    if (room == 0)
+      return 0;
+
+    ssize_t readBytes = read(socket, buffer, room);
+    if (readBytes > 0 && toSpill)
+      pipeline->spillLength += readBytes;
+    else if (readBytes > 0) {
+      pipeline->length += readBytes;
+      decodeChunks(pipeline);
+      if (pipeline->chunked == CHUNKED_ERROR)
+        return 0;
+    } else if (readBytes == 0)
+      return -1;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    else if (errno != EINTR)
+      return -1;
+  }
+}
+
+/* For bytes already taken off the socket, -1 when there is no room for them */
+int clientPipelineAppend(client_pipeline_t *pipeline, const char *data,
+                         size_t length) {
+  if (spilling(pipeline)) {
+    size_t spilled = min(length, pipeline->bodyLength - pipeline->spillLength);
+    memcpy(pipeline->spill + pipeline->spillLength, data, spilled);
+    pipeline->spillLength += spilled;
+    data += spilled;
+    length -= spilled;
+  }
+
+  /* A piece at a time, as decoding chunks makes room for more of them */
+  while (length > 0 && pipeline->chunked != CHUNKED_ERROR) {
+    size_t copied = min(reservePipeline(pipeline, length), length);
+    if (copied == 0)
+      return -1;
+    memcpy(pipeline->data + pipeline->length, data, copied);
+    pipeline->length += copied;
+    data += copied;
+    length -= copied;
+    decodeChunks(pipeline);
+  }
+  return 0;
+}
+
+static int startSpill(client_pipeline_t *pipeline) {
+  int fd = openSpill();
+  check_silent(fd >= 0, "openSpill() failed");
+  check_silent(mapSpill(pipeline, fd) == 0, "mapSpill() failed");
+
+  /* Move the body bytes read so far, keeping any of the next request */
+  char *body = pipeline->data + pipeline->headLength;
+  size_t buffered = pipeline->length - pipeline->headLength;
+  size_t spilled = min(buffered, pipeline->bodyLength);
+  memcpy(pipeline->spill, body, spilled);
+  memmove(body, body + spilled, buffered - spilled);
+  pipeline->length -= spilled;
+  pipeline->spillLength = spilled;
+  return 0;
+error:
+  return -1;
+}
+
+/*
+  Frames the request at the front of the pipeline. The head is parsed once,
+  after which the body length is known and a body over the spill threshold
+  is moved out to a temp file.
+*/
+pipeline_frame_t clientPipelineFrame(client_pipeline_t *pipeline) {
+  if (pipeline->headLength == 0) {
+    long long contentLength = 0;
+    int expectContinue = 0;
+    int chunked = 0;
+    ssize_t headLength =
+        parseRequestHead(pipeline->data, pipeline->length,
+                         pipeline->parsedLength, &contentLength,
+                         &expectContinue, &chunked);
+
+    /* Resume parsing where this call stopped once more bytes come */
+    if (headLength == -2) {
+      pipeline->parsedLength = pipeline->length;
+      check(pipeline->length < MAX_REQUEST_SIZE, "Request is too long");
+      return FRAME_HEAD;
+    }
+
+    check(headLength > 0, "Parse error");
+    check(chunked >= 0, "Unsupported Transfer-Encoding");
+    check(contentLength >= 0, "Invalid Content-Length");
+    check((unsigned long long)contentLength <= pipeline->maxBodySize,
+          "Request body too large");
+
+    pipeline->parsedLength = 0;
+    pipeline->headLength = headLength;
+    pipeline->bodyLength = contentLength;
+    pipeline->expectContinue = expectContinue;
+
+    if (chunked) {
+      pipeline->bodyLength = 0;
+      pipeline->chunked = CHUNKED_DECODING;
+      memset(&pipeline->decoder, 0, sizeof(pipeline->decoder));
+      pipeline->decoder.consume_trailer = 1;
+      decodeChunks(pipeline);
+    } else if (pipeline->spillThreshold > 0 &&
+        pipeline->bodyLength > pipeline->spillThreshold)
+      check(startSpill(pipeline) == 0, "Could not spill the request body");
+  }
+
+  check_silent(pipeline->chunked != CHUNKED_ERROR, "Invalid chunked body");
+  if (pipeline->chunked == CHUNKED_DECODING)
+    return FRAME_BODY;
+  if (pipeline->spill != NULL)
+    return pipeline->spillLength == pipeline->bodyLength ? FRAME_COMPLETE
+                                                         : FRAME_BODY;
+  return pipeline->length >= pipeline->headLength + pipeline->bodyLength
+             ? FRAME_COMPLETE
+             : FRAME_BODY;
+error:
+  return FRAME_ERROR;
+}
+
+static void resetFrame(client_pipeline_t *pipeline) {
+  pipeline->headLength = 0;
+  pipeline->bodyLength = 0;
+  pipeline->expectContinue = 0;
+  pipeline->chunked = CHUNKED_NONE;
+  pipeline->spill = NULL;
+  pipeline->spillLength = 0;
+}
+
+/* Drops the request at the front once it has been built */
+void clientPipelineConsume(client_pipeline_t *pipeline) {
+  size_t requestLength = pipeline->headLength;
+  if (pipeline->spill == NULL)
+    requestLength += pipeline->bodyLength;
+  memmove(pipeline->data, pipeline->data + requestLength,
+          pipeline->length - requestLength);
+  pipeline->length -= requestLength;
+  resetFrame(pipeline);
+}
+
+/*
+  Hands the buffer with the request at the front over to the caller to
+  free, NUL terminated after the request, in place of copying the request
+  out. Only what follows the request, usually nothing, is copied into a
+  buffer of its own. A spilled body is left for the caller to unmap.
+*/
+char *clientPipelineTake(client_pipeline_t *pipeline) {
+  size_t requestLength = pipeline->headLength;
+  if (pipeline->spill == NULL)
+    requestLength += pipeline->bodyLength;
+  size_t rest = pipeline->length - requestLength;
+  char *next = NULL;
+  if (rest > 0) {
+    next = malloc(rest);
+    check_mem(next);
+    memcpy(next, pipeline->data + requestLength, rest);
+  }
+  char *request = pipeline->data;
+  if (pipeline->size <= requestLength) {
+    request = realloc(request, requestLength + 1);
+    check_mem(request);
+  }
+  request[requestLength] = '\0';
+
+  pipeline->data = next;
+  pipeline->length = rest;
+  pipeline->size = rest;
+  resetFrame(pipeline);
+  return request;
+error:
+  free(next);
+  return NULL;
+}
+
+/* A client that sent Expect: 100-continue holds its body back until told */
+void clientPipelineContinue(client_pipeline_t *pipeline,
+                            client_output_t *output, int socket) {
+  if (!pipeline->expectContinue)
+    return;
+  pipeline->expectContinue = 0;
+  struct iovec iov = {.iov_base = "HTTP/1.1 100 Continue\r\n\r\n",
+                      .iov_len = 25};
+  if (output != NULL)
+    clientOutputWrite(output, socket, &iov, 1);
+  else
+    send(socket, iov.iov_base, iov.iov_len, MSG_NOSIGNAL);
+}
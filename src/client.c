@@ -1,5 +1,8 @@
 #include "express.h"
 #include <sys/time.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 double time_diff(struct timeval x, struct timeval y) {
   double x_ms, y_ms, diff;
@@ -18,27 +21,76 @@ void buildRequest(request_t *req, client_t client, router_t *baseRouter);
 void freeRequest(request_t *req);
 void freeResponse(response_t *res);
 
+/* Build, route and free one request; returns 1 to keep the connection open */
+int serveClientRequest(client_t client, router_t *baseRouter) {
+  request_t *req = malloc(sizeof(request_t));
+  buildRequest(req, client, baseRouter);
+
+  if (req->method == NULL) {
+    free(req);
+    return 0;
+  }
+
+  response_t *res = malloc(sizeof(response_t));
+  buildResponse(client, req, res);
+
+  baseRouter->handler(req, res);
+
+  /* A streamed response the handler left open is ended for it, through
+     res->end when there is one, so a middleware wrapping it can finish */
+  if (res->headersSent && !res->didSend && res->end != NULL)
+    res->end();
+  else if (res->headersSent && !res->didSend)
+    expressResEnd(res);
+
+  int keepAlive = req->keepAlive && res->didSend;
+
+  freeResponse(res);
+  freeRequest(req);
+
+  return keepAlive;
+}
+
+void clientPipelineInit(client_pipeline_t *pipeline, size_t maxBodySize,
+                        size_t spillThreshold);
+void clientPipelineFree(client_pipeline_t *pipeline);
+int clientPipelineRead(client_pipeline_t *pipeline, int socket);
+pipeline_frame_t clientPipelineFrame(client_pipeline_t *pipeline);
+void clientPipelineContinue(client_pipeline_t *pipeline,
+                            client_output_t *output, int socket);
+
+void clientOutputInit(client_output_t *output, int deferred,
+                      size_t highWaterMark);
+void clientOutputFree(client_output_t *output);
+int clientOutputFlush(client_output_t *output, int socket);
+void clientOutputBlockSigpipe();
+
 static void closeClientConnection(client_t client) {
   shutdown(client.socket, SHUT_RDWR);
   close(client.socket);
 }
 
-static client_t acceptClientConnection(server_t *server) {
+void formatClientAddress(const struct sockaddr_storage *address,
+                         socklen_t length, char *text, size_t size);
+
+/* The address goes to ip, which has CLIENT_ADDRESS_LENGTH bytes */
+static client_t acceptClientConnection(int serverSocket, char *ip) {
   int clientSocket = -1;
-  struct sockaddr_in echoClntAddr;
-  unsigned int clntLen = sizeof(echoClntAddr);
+  struct sockaddr_storage clientAddress;
+  socklen_t clientAddressLength = sizeof(clientAddress);
 
-  check(server->socket >= 0, "server->socket is not valid");
+  check(serverSocket >= 0, "server->socket is not valid");
 
-  check_silent(
-      (clientSocket = accept(server->socket, (struct sockaddr *)&echoClntAddr,
-                             &clntLen)) >= 0,
-      "accept() failed");
+  check_silent((clientSocket = accept(serverSocket,
+                                      (struct sockaddr *)&clientAddress,
+                                      &clientAddressLength)) >= 0,
+               "accept() failed");
   check(fcntl(clientSocket, F_SETFL, O_NONBLOCK) >= 0, "fcntl() failed");
 
-  char *client_ip = inet_ntoa(echoClntAddr.sin_addr);
+  formatClientAddress(&clientAddress, clientAddressLength, ip,
+                      CLIENT_ADDRESS_LENGTH);
 
-  return (client_t){.socket = clientSocket, .ip = client_ip};
+  return (client_t){.socket = clientSocket, .ip = ip};
 error:
   shutdown(clientSocket, SHUT_RDWR);
   if (clientSocket >= 0)
@@ -55,39 +107,203 @@ A multi-threaded implementation of the client handler that uses epoll().
 
 typedef enum req_status_t { READING, ENDED } req_status_t;
 
+typedef enum read_phase_t { READ_IDLE, READ_HEADERS, READ_BODY } read_phase_t;
+
 typedef struct http_status_t {
   client_t client;
+  char ip[CLIENT_ADDRESS_LENGTH];
   req_status_t reqStatus;
-  dispatch_source_t timerSource;
+  read_phase_t readPhase;
+  wheel_timer_t timer;
+  int requestCount;
+  client_pipeline_t pipeline;
+  client_buffer_t headerBuffer;
+  client_output_t output;
+  struct h2_connection_t *h2;
+  websocket_t *websocket;
+  struct sse_subscriber_t *subscriber;
+  server_t *server;
+  timer_wheel_t *timerWheel;
+  /* Every connection on the worker, for a drain to go through */
+  struct http_status_t *next;
+  struct http_status_t *prev;
+  struct http_status_t **connections;
 } http_status_t;
 
 typedef struct client_thread_args_t {
   int epollFd;
+  int serverSocket;
+  int cpu;
   server_t *server;
   router_t *baseRouter;
+  timer_wheel_t timerWheel;
+  http_status_t *connections;
 } client_thread_args_t;
 
+uint64_t timerWheelNow();
+void timerWheelInit(timer_wheel_t *wheel, uint64_t nowMs);
+void wheelTimerInit(wheel_timer_t *timer, void (*expire)(wheel_timer_t *),
+                    void *data);
+void timerWheelAdd(timer_wheel_t *wheel, wheel_timer_t *timer,
+                   uint64_t timeoutMs);
+void timerWheelCancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+void timerWheelAdvance(timer_wheel_t *wheel, uint64_t nowMs);
+int timerWheelTimeout(timer_wheel_t *wheel, uint64_t nowMs);
+
+int http2Preface(client_pipeline_t *pipeline);
+struct h2_connection_t *http2Open(client_t client, server_t *server);
+struct h2_connection_t *http2Upgrade(client_t client, server_t *server,
+                                     router_t *baseRouter);
+int http2Serve(struct h2_connection_t *conn, client_t client,
+               router_t *baseRouter, int *reading);
+void http2Free(struct h2_connection_t *conn);
+int http2Idle(struct h2_connection_t *conn);
+
+void websocketAttach(websocket_t *ws, int epollFd, void *event);
+void websocketDetach(websocket_t *ws);
+int websocketArm(websocket_t *ws, uint32_t events);
+int websocketIdle(websocket_t *ws);
+int websocketServe(websocket_t *ws);
+
+int sseWorkerWake(void *ptr);
+int sseAttach(struct sse_subscriber_t *sub, int epollFd, void *event);
+void sseDetach(struct sse_subscriber_t *sub);
+int sseServe(struct sse_subscriber_t *sub);
+int sseHeartbeat(struct sse_subscriber_t *sub);
+
+static void freeHttpStatus(http_status_t *status) {
+  if (status->websocket != NULL)
+    websocketDetach(status->websocket);
+  if (status->subscriber != NULL)
+    sseDetach(status->subscriber);
+  closeClientConnection(status->client);
+  if (status->prev != NULL)
+    status->prev->next = status->next;
+  else
+    *status->connections = status->next;
+  if (status->next != NULL)
+    status->next->prev = status->prev;
+  __atomic_sub_fetch(&status->server->connections, 1, __ATOMIC_RELEASE);
+  if (status->h2 != NULL)
+    http2Free(status->h2);
+  clientPipelineFree(&status->pipeline);
+  clientOutputFree(&status->output);
+  free(status->headerBuffer.data);
+  free(status);
+}
+
+static void expireClient(wheel_timer_t *timer) {
+  http_status_t *status = (http_status_t *)timer->data;
+  /* An idle WebSocket is pinged, and closed if it is still idle next time */
+  if (status->websocket != NULL && websocketIdle(status->websocket) == 0) {
+    timerWheelAdd(status->timerWheel, timer,
+                  status->server->websocketPingInterval * 1000);
+    return;
+  }
+  /* A subscriber gets a heartbeat, unless it has stopped taking events */
+  if (status->subscriber != NULL && sseHeartbeat(status->subscriber) == 0) {
+    timerWheelAdd(status->timerWheel, timer,
+                  status->server->sseHeartbeatInterval * 1000);
+    return;
+  }
+  if (status->requestCount == 0)
+    log_err("timeout");
+  freeHttpStatus(status);
+}
+
+/* Nothing is half read, half written or still being served */
+static int idleConnection(http_status_t *status) {
+  return status->websocket == NULL && status->readPhase == READ_IDLE &&
+         status->pipeline.length == 0 && status->output.length == 0 &&
+         (status->h2 == NULL || http2Idle(status->h2));
+}
+
+/*
+  While draining, idle connections are closed and WebSockets are asked to
+  close, the rest are left to finish. Past the deadline everything goes.
+*/
+static void drainConnections(client_thread_args_t *args, int expired) {
+  http_status_t *status = args->connections;
+  while (status != NULL) {
+    http_status_t *next = status->next;
+    if (expired || idleConnection(status)) {
+      timerWheelCancel(&args->timerWheel, &status->timer);
+      freeHttpStatus(status);
+    } else if (status->websocket != NULL) {
+      expressWebSocketClose(status->websocket, 1001, "Server is going away");
+    }
+    status = next;
+  }
+}
+
+int initReusePortSocket(server_t *server);
+void releaseInheritedSockets(server_t *server);
+
+/* The socket this worker was given, or one shared by every worker */
+static int listeningSocket(server_t *server, int serverSocket,
+                           int listenerCount, int fd) {
+  if (fd == serverSocket)
+    return 1;
+  for (int i = 1; i < listenerCount; i++)
+    if (server->listeners[i] == fd)
+      return 1;
+  return 0;
+}
+
+/* cpu_set_t needs _GNU_SOURCE, which clashes with error_t */
+void pinThreadToCpu(int cpu) {
+  size_t bitsPerWord = 8 * sizeof(unsigned long);
+  unsigned long cpuMask[1024 / (8 * sizeof(unsigned long))] = {0};
+  cpuMask[cpu / bitsPerWord] |= 1UL << (cpu % bitsPerWord);
+  if (syscall(SYS_sched_setaffinity, 0, sizeof(cpuMask), cpuMask) < 0)
+    log_warn("sched_setaffinity() failed");
+}
+
 void *clientAcceptEventHandler(void *args) {
   client_thread_args_t *clientThreadArgs = (client_thread_args_t *)args;
 
   int epollFd = clientThreadArgs->epollFd;
+  int serverSocket = clientThreadArgs->serverSocket;
   server_t *server = clientThreadArgs->server;
   router_t *baseRouter = clientThreadArgs->baseRouter;
+  timer_wheel_t *timerWheel = &clientThreadArgs->timerWheel;
+  /* Kept, as closing the server empties the list while workers drain */
+  int listenerCount = server->listenerCount;
+
+  if (clientThreadArgs->cpu >= 0)
+    pinThreadToCpu(clientThreadArgs->cpu);
+  clientOutputBlockSigpipe();
+
+  timerWheelInit(timerWheel, timerWheelNow());
 
   struct epoll_event *events =
       malloc(sizeof(struct epoll_event) * server->maxEvents);
   struct epoll_event ev;
   int nfds;
+  int draining = 0;
 
   while (1) {
-    nfds = epoll_wait(epollFd, events, server->maxEvents, -1);
+    /* A draining worker looks over its connections every tick */
+    int timeout = timerWheelTimeout(timerWheel, timerWheelNow());
+    if (draining && (timeout < 0 || timeout > TIMER_WHEEL_TICK_MS))
+      timeout = TIMER_WHEEL_TICK_MS;
+    nfds = epoll_wait(epollFd, events, server->maxEvents, timeout);
 
-    if (nfds <= 0) {
+    if (nfds < 0) {
       log_err("epoll_wait() failed");
       continue;
     }
 
-    check(server->socket >= 0, "server->socket is not valid");
+    if (!draining && __atomic_load_n(&server->draining, __ATOMIC_ACQUIRE)) {
+      draining = 1;
+      epoll_ctl(epollFd, EPOLL_CTL_DEL, serverSocket, NULL);
+      for (int i = 1; i < listenerCount; i++)
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, server->listeners[i], NULL);
+      epoll_ctl(epollFd, EPOLL_CTL_DEL, server->drainFd, NULL);
+      __atomic_sub_fetch(&server->accepting, 1, __ATOMIC_RELEASE);
+    }
+
+    check(server->socket >= 0 || draining, "server->socket is not valid");
 
     for (int n = 0; n < nfds; ++n) {
 #ifdef REQUEST_TIMING
@@ -95,14 +311,17 @@ void *clientAcceptEventHandler(void *args) {
       struct timeval before, after;
       gettimeofday(&before, NULL);
 #endif // REQUEST_TIMING
-      if (events[n].data.fd == server->socket) {
+      if (listeningSocket(server, serverSocket, listenerCount,
+                          events[n].data.fd)) {
+        int listener = events[n].data.fd;
+        char ip[CLIENT_ADDRESS_LENGTH];
         while (1) {
 #ifdef REQUEST_TIMING
           begin = clock();
           gettimeofday(&before, NULL);
 #endif // REQUEST_TIMING
 
-          client_t client = acceptClientConnection(server);
+          client_t client = acceptClientConnection(listener, ip);
 
           if (client.socket < 0) {
             if (errno == EAGAIN | errno == EWOULDBLOCK) {
@@ -117,123 +336,388 @@ void *clientAcceptEventHandler(void *args) {
 
           http_status_t *status = malloc(sizeof(http_status_t));
           status->client = client;
+          memcpy(status->ip, ip, sizeof(ip));
+          status->client.ip = status->ip;
           status->reqStatus = READING;
+          status->readPhase = READ_IDLE;
+          status->requestCount = 0;
+          clientPipelineInit(&status->pipeline, server->maxBodySize,
+                             server->bodySpillThreshold);
+          status->client.pipeline = &status->pipeline;
+          status->headerBuffer =
+              (client_buffer_t){.data = NULL, .length = 0, .size = 0};
+          status->client.headerBuffer = &status->headerBuffer;
+          clientOutputInit(&status->output, 0, server->outputHighWaterMark);
+          status->client.output = &status->output;
+          status->h2 = NULL;
+          status->websocket = NULL;
+          status->client.websocket = &status->websocket;
+          status->subscriber = NULL;
+          status->client.subscriber = &status->subscriber;
+          status->server = server;
+          status->timerWheel = timerWheel;
+          status->connections = &clientThreadArgs->connections;
+          status->prev = NULL;
+          status->next = clientThreadArgs->connections;
+          if (status->next != NULL)
+            status->next->prev = status;
+          clientThreadArgs->connections = status;
+          __atomic_add_fetch(&server->connections, 1, __ATOMIC_RELEASE);
 
           ev.data.ptr = status;
 
-          dispatch_source_t timerSource = dispatch_source_create(
-              DISPATCH_SOURCE_TYPE_TIMER, 0, 0, server->serverQueue);
-
-          status->timerSource = timerSource;
-
-          dispatch_time_t delay = dispatch_time(
-              DISPATCH_TIME_NOW, ACCEPT_TIMEOUT_SECS * NSEC_PER_SEC);
-          dispatch_source_set_timer(timerSource, delay, delay, 0);
-          dispatch_source_set_event_handler(timerSource, ^{
-            log_err("timeout");
-            dispatch_source_cancel(timerSource);
-            dispatch_release(timerSource);
-            closeClientConnection(client);
-            free(status);
-          });
-          dispatch_resume(timerSource);
+          wheelTimerInit(&status->timer, expireClient, status);
+          timerWheelAdd(timerWheel, &status->timer,
+                        server->acceptTimeout * 1000);
 
           if (epoll_ctl(epollFd, EPOLL_CTL_ADD, client.socket, &ev) < 0) {
             log_err("epoll_ctl() failed");
-            free(status);
+            timerWheelCancel(timerWheel, &status->timer);
+            freeHttpStatus(status);
             continue;
           }
         }
+      } else if (events[n].data.ptr == server) {
+        /* The drain's wake, which the check above has already seen */
+      } else if (sseWorkerWake(events[n].data.ptr)) {
+        /* Events published to this worker's subscribers went out */
       } else {
         http_status_t *status = (http_status_t *)events[n].data.ptr;
-        if (status->reqStatus == READING) {
-          ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-          ev.data.ptr = status;
+        client_output_t *output = &status->output;
+        client_t client = status->client;
+        ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+        ev.data.ptr = status;
+
+        /* What the socket would not take last time goes out first */
+        size_t queuedBytes = output->length;
+        if (queuedBytes > 0 && clientOutputFlush(output, client.socket) < 0) {
+          timerWheelCancel(timerWheel, &status->timer);
+          freeHttpStatus(status);
+          continue;
+        }
 
-          dispatch_source_cancel(status->timerSource);
-          dispatch_release(status->timerSource);
+        int pipelineDepth = 0;
+        read_phase_t readPhase = status->readPhase;
 
-          client_t client = status->client;
+        if (status->reqStatus == READING) {
+          /* Edge-triggered, so the socket is drained on every event */
+          int peerClosed =
+              clientPipelineRead(&status->pipeline, client.socket) < 0;
+
+          int keepAlive = 1;
+          readPhase = READ_IDLE;
+
+          /* A connection that opens with the HTTP/2 preface stays on it */
+          int preface = 0;
+          if (server->http2 && status->h2 == NULL &&
+              status->requestCount == 0 && status->pipeline.length > 0)
+            preface = http2Preface(&status->pipeline);
+          if (preface > 0)
+            status->h2 = http2Open(client, server);
+          else if (preface < 0)
+            readPhase = READ_HEADERS;
+
+          /*
+            Serve the complete requests read so far, a bounded number, and
+            none while the client is behind on taking its responses.
+          */
+          while (status->h2 == NULL && status->websocket == NULL &&
+                 status->subscriber == NULL && preface == 0 && keepAlive &&
+                 !output->failed && status->pipeline.length > 0 &&
+                 pipelineDepth < server->maxPipelineDepth &&
+                 output->length <= server->outputHighWaterMark) {
+            pipeline_frame_t frame = clientPipelineFrame(&status->pipeline);
+            if (frame == FRAME_ERROR) {
+              keepAlive = 0;
+              break;
+            }
 
-          request_t *req = malloc(sizeof(request_t));
-          buildRequest(req, client, baseRouter);
+            if (frame == FRAME_HEAD) {
+              readPhase = READ_HEADERS;
+              break;
+            }
 
-          if (req->method == NULL) {
-            free(status);
-            free(req);
-            closeClientConnection(client);
-            continue;
-          }
+            if (frame == FRAME_BODY) {
+              clientPipelineContinue(&status->pipeline, output, client.socket);
+              readPhase = READ_BODY;
+              break;
+            }
 
-          response_t *res = malloc(sizeof(response_t));
-          buildResponse(client, req, res);
+            /* The first request can switch the connection to HTTP/2 */
+            if (server->http2 && status->requestCount == 0) {
+              status->h2 = http2Upgrade(client, server, baseRouter);
+              if (status->h2 != NULL) {
+                status->requestCount++;
+                pipelineDepth++;
+                break;
+              }
+            }
 
-          baseRouter->handler(req, res);
+            /* Offer keep-alive until the per-connection request cap is hit */
+            status->client.keepAlive =
+                server->keepAlive && !draining &&
+                status->requestCount + 1 < server->keepAliveMaxRequests;
+            client = status->client;
+
+            keepAlive = serveClientRequest(client, baseRouter);
 
 #ifdef REQUEST_TIMING
-          gettimeofday(&after, NULL);
-          clock_t end = clock();
-          double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
-          printf("%f (%.0lf us)\n", time_spent, time_diff(before, after));
+            gettimeofday(&after, NULL);
+            clock_t end = clock();
+            double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
+            printf("%f (%.0lf us)\n", time_spent, time_diff(before, after));
 #endif // REQUEST_TIMING
 
-          status->reqStatus = ENDED;
+            status->requestCount++;
+            pipelineDepth++;
 
-          if (epoll_ctl(epollFd, EPOLL_CTL_MOD, client.socket, &ev) < 0) {
-            log_err("epoll_ctl() failed");
-            freeResponse(res);
-            freeRequest(req);
-            closeClientConnection(client);
-            continue;
+            /* A WebSocket route takes the connection over from here on */
+            if (status->websocket != NULL) {
+              websocketAttach(status->websocket, epollFd, status);
+              keepAlive = 1;
+              break;
+            }
+
+            /* So does a subscription to Server-Sent Events */
+            if (status->subscriber != NULL) {
+              keepAlive =
+                  sseAttach(status->subscriber, epollFd, status) == 0;
+              break;
+            }
           }
 
-          freeResponse(res);
-          freeRequest(req);
-          closeClientConnection(client);
-        } else if (status->reqStatus == ENDED) {
-          free(status);
+          /*
+            Handling frames makes room in the pipeline, so the socket is
+            read again until it runs dry or the bound is hit.
+          */
+          int frames = 0;
+          while (status->h2 != NULL && keepAlive &&
+                 pipelineDepth < server->maxPipelineDepth &&
+                 output->length <= server->outputHighWaterMark) {
+            int reading = 0;
+            frames = http2Serve(status->h2, client, baseRouter, &reading);
+            keepAlive = frames >= 0;
+            readPhase = reading ? READ_BODY : READ_IDLE;
+            if (frames <= 0 || peerClosed)
+              break;
+            pipelineDepth++;
+            peerClosed =
+                clientPipelineRead(&status->pipeline, client.socket) < 0;
+          }
+
+          /* The same for a WebSocket, whose frames can outgrow a read */
+          while (status->websocket != NULL && keepAlive &&
+                 pipelineDepth < server->maxPipelineDepth &&
+                 output->length <= server->outputHighWaterMark) {
+            int full = status->pipeline.size > 0 &&
+                       status->pipeline.length == status->pipeline.size;
+            frames = websocketServe(status->websocket);
+            keepAlive = frames >= 0;
+            if (frames < 0 || (frames == 0 && !full) || peerClosed)
+              break;
+            pipelineDepth++;
+            peerClosed =
+                clientPipelineRead(&status->pipeline, client.socket) < 0;
+          }
+
+          /* A subscriber has nothing to read, only to be written to */
+          if (status->subscriber != NULL && keepAlive)
+            keepAlive = sseServe(status->subscriber) == 0;
+
+          /* A closed peer still gets the requests it sent in full */
+          int moreToServe =
+              status->h2 != NULL || status->websocket != NULL
+                  ? frames > 0
+                  : readPhase == READ_IDLE && status->pipeline.length > 0;
+          if (!keepAlive || (peerClosed && !moreToServe))
+            status->reqStatus = ENDED;
+
+          /*
+            Complete requests left in the pipeline are already buffered so
+            EPOLLIN will not fire for them. Arming EPOLLOUT puts the
+            connection back in the ready list behind the other clients.
+          */
+          if (status->reqStatus == READING && moreToServe)
+            ev.events |= EPOLLOUT;
+        }
+
+        /*
+          The connection is only closed once its output has been flushed,
+          or right away when there is no flushing it
+        */
+        if ((status->reqStatus == ENDED && output->length == 0) ||
+            output->failed) {
+          timerWheelCancel(timerWheel, &status->timer);
+          freeHttpStatus(status);
+          continue;
+        }
+
+        if (output->length > 0) {
+          /* Stop reading from a client that is not taking its responses */
+          ev.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+          if (status->reqStatus == READING &&
+              output->length <= server->outputHighWaterMark)
+            ev.events |= EPOLLIN;
+
+          /* The write deadline restarts whenever the client takes bytes */
+          if (queuedBytes == 0 || output->length < queuedBytes)
+            timerWheelAdd(timerWheel, &status->timer,
+                          server->writeTimeout * 1000);
+        } else if (pipelineDepth > 0 || queuedBytes > 0 ||
+                   readPhase != status->readPhase) {
+          /*
+            Each phase gets one deadline, which more bytes do not extend.
+            Serving a request starts the next phase over.
+          */
+          int timeoutSecs =
+              status->websocket != NULL    ? server->websocketPingInterval
+              : status->subscriber != NULL ? server->sseHeartbeatInterval
+              : readPhase == READ_HEADERS  ? server->headerTimeout
+              : readPhase == READ_BODY     ? server->bodyTimeout
+                                           : server->keepAliveTimeout;
+          timerWheelAdd(timerWheel, &status->timer, timeoutSecs * 1000);
+        }
+        status->readPhase = readPhase;
+
+        /* Other threads arm a WebSocket too, so it is done under its lock */
+        int armed =
+            status->websocket != NULL
+                ? websocketArm(status->websocket, ev.events)
+                : epoll_ctl(epollFd, EPOLL_CTL_MOD, client.socket, &ev);
+        if (armed < 0) {
+          log_err("epoll_ctl() failed");
+          timerWheelCancel(timerWheel, &status->timer);
+          freeHttpStatus(status);
+          continue;
         }
       }
     }
+
+    /* After the batch, so no event above can be for a client freed here */
+    timerWheelAdvance(timerWheel, timerWheelNow());
+
+    if (draining) {
+      int expired = __atomic_load_n(&server->drainExpired, __ATOMIC_ACQUIRE);
+      drainConnections(clientThreadArgs, expired);
+      if (clientThreadArgs->connections == NULL)
+        break;
+    }
   }
+  /* Only a drain leaves nothing behind that could still use the epoll set */
+  if (draining)
+    close(epollFd);
 error:
   free(events);
+  if (!draining)
+    __atomic_sub_fetch(&server->accepting, 1, __ATOMIC_RELEASE);
+  __atomic_sub_fetch(&server->workers, 1, __ATOMIC_RELEASE);
   return NULL;
 }
 
+/*
+
+Every worker thread has its own epoll instance and timer wheel, and a
+connection stays on the worker that accepted it, so its timer is never
+touched by another thread.
+
+By default the workers share the listening socket, registered with
+EPOLLEXCLUSIVE so a new connection wakes one worker rather than all of them.
+In sharded mode every worker gets its own SO_REUSEPORT listening socket and
+is pinned to a core, and the kernel spreads connections across the sockets.
+
+*/
 int initClientAcceptEventHandler(server_t *server, router_t *baseRouter) {
+  long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpuCount < 1)
+    cpuCount = 1;
+
+  int epollCount = 0;
+  client_thread_args_t *threadArgs =
+      malloc(sizeof(client_thread_args_t) * server->threadCount);
+  check_mem(threadArgs);
+
+  if (server->reusePort) {
+    server->shardCount = 0;
+    server->shardSockets = malloc(sizeof(int) * server->threadCount);
+    check_mem(server->shardSockets);
+  }
 
-  pthread_t threads[server->threadCount];
+  /* Level-triggered, so it wakes every worker and not just the first */
+  server->drainFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  check(server->drainFd >= 0, "eventfd() failed");
+  struct epoll_event drainEvent = {.events = EPOLLIN, .data.ptr = server};
 
-  int epollFd = epoll_create1(0);
-  check(epollFd >= 0, "epoll_create1() failed");
+  for (int i = 0; i < server->threadCount; ++i) {
+    int serverSocket = server->socket;
+    struct epoll_event epollEvent;
+    epollEvent.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+
+    if (server->reusePort) {
+      epollEvent.events = EPOLLIN | EPOLLET;
+      /* The first shard reuses the socket bound by server->listen */
+      if (i > 0) {
+        serverSocket = initReusePortSocket(server);
+        check(serverSocket >= 0, "initReusePortSocket() failed");
+        server->shardSockets[server->shardCount++] = serverSocket;
+      }
+    }
 
-  client_thread_args_t threadArgs;
-  threadArgs.epollFd = epollFd;
-  threadArgs.server = server;
-  threadArgs.baseRouter = baseRouter;
+    int epollFd = epoll_create1(0);
+    check(epollFd >= 0, "epoll_create1() failed");
+    epollCount++;
+
+    threadArgs[i].epollFd = epollFd;
+    threadArgs[i].serverSocket = serverSocket;
+    threadArgs[i].cpu = server->reusePort ? i % min(cpuCount, 1024) : -1;
+    threadArgs[i].server = server;
+    threadArgs[i].baseRouter = baseRouter;
+    threadArgs[i].connections = NULL;
+
+    epollEvent.data.fd = serverSocket;
+
+    check(epoll_ctl(epollFd, EPOLL_CTL_ADD, serverSocket, &epollEvent) >= 0,
+          "epoll_ctl() failed");
+    check(epoll_ctl(epollFd, EPOLL_CTL_ADD, server->drainFd, &drainEvent) >= 0,
+          "epoll_ctl() failed");
+
+    /* Any other address is shared, whether or not the first is sharded */
+    for (int j = 1; j < server->listenerCount; j++) {
+      struct epoll_event listenerEvent = {
+          .events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE,
+          .data.fd = server->listeners[j]};
+      check(epoll_ctl(epollFd, EPOLL_CTL_ADD, server->listeners[j],
+                      &listenerEvent) >= 0,
+            "epoll_ctl() failed");
+    }
+  }
 
-  struct epoll_event epollEvent;
-  epollEvent.events = EPOLLIN | EPOLLET;
-  epollEvent.data.fd = server->socket;
+  releaseInheritedSockets(server);
 
-  check(epoll_ctl(epollFd, EPOLL_CTL_ADD, server->socket, &epollEvent) >= 0,
-        "epoll_ctl() failed");
+  /* A drain waits for every worker to be done with its connections */
+  __atomic_store_n(&server->workers, server->threadCount, __ATOMIC_RELEASE);
+  __atomic_store_n(&server->accepting, server->threadCount, __ATOMIC_RELEASE);
 
-  for (int i = 0; i < server->threadCount; ++i) {
+  for (int i = 1; i < server->threadCount; ++i) {
+    pthread_t thread;
     pthread_attr_t attr;
     pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, 1);
-    check(pthread_create(&threads[i], NULL, clientAcceptEventHandler,
-                         &threadArgs) >= 0,
-          "pthread_create() failed");
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, clientAcceptEventHandler,
+                       &threadArgs[i]) != 0) {
+      log_err("pthread_create() failed");
+      __atomic_sub_fetch(&server->workers, 1, __ATOMIC_RELEASE);
+      __atomic_sub_fetch(&server->accepting, 1, __ATOMIC_RELEASE);
+    }
     pthread_attr_destroy(&attr);
   }
 
-  clientAcceptEventHandler(&threadArgs);
+  clientAcceptEventHandler(&threadArgs[0]);
 
   return 0;
 error:
+  for (int i = 0; i < epollCount; ++i)
+    close(threadArgs[i].epollFd);
+  free(threadArgs);
   return -1;
 }
 #elif __MACH__
@@ -246,79 +730,112 @@ For an unknown reason this implementation is not working on linux.
 
 */
 int initClientAcceptEventHandler(server_t *server, router_t *baseRouter) {
-  dispatch_source_t acceptSource = dispatch_source_create(
-      DISPATCH_SOURCE_TYPE_READ, server->socket, 0, server->serverQueue);
-
-  dispatch_source_set_event_handler(acceptSource, ^{
-    const unsigned long numPendingConnections =
-        dispatch_source_get_data(acceptSource);
-    for (unsigned long i = 0; i < numPendingConnections; i++) {
+  for (int l = 0; l < server->listenerCount; l++) {
+    int listener = server->listeners[l];
+    dispatch_source_t acceptSource = dispatch_source_create(
+        DISPATCH_SOURCE_TYPE_READ, listener, 0, server->serverQueue);
+
+    dispatch_source_set_event_handler(acceptSource, ^{
+      const unsigned long numPendingConnections =
+          dispatch_source_get_data(acceptSource);
+      for (unsigned long i = 0; i < numPendingConnections; i++) {
 #ifdef REQUEST_TIMING
-      clock_t begin = clock();
-      __block struct timeval before, after;
-      gettimeofday(&before, NULL);
+        clock_t begin = clock();
+        __block struct timeval before, after;
+        gettimeofday(&before, NULL);
 #endif // REQUEST_TIMING
 
-      client_t client = acceptClientConnection(server);
-      if (client.socket < 0)
-        continue;
-
-      dispatch_source_t timerSource = dispatch_source_create(
-          DISPATCH_SOURCE_TYPE_TIMER, 0, 0, server->serverQueue);
-      dispatch_source_t readSource = dispatch_source_create(
-          DISPATCH_SOURCE_TYPE_READ, client.socket, 0, server->serverQueue);
-
-      dispatch_time_t delay =
-          dispatch_time(DISPATCH_TIME_NOW, ACCEPT_TIMEOUT_SECS * NSEC_PER_SEC);
-      dispatch_source_set_timer(timerSource, delay, delay, 0);
-      dispatch_source_set_event_handler(timerSource, ^{
-        log_err("timeout");
-        dispatch_source_cancel(timerSource);
-        dispatch_release(timerSource);
-        closeClientConnection(client);
-        dispatch_source_cancel(readSource);
-        dispatch_release(readSource);
-      });
-
-      dispatch_source_set_event_handler(readSource, ^{
-        dispatch_source_cancel(timerSource);
-        dispatch_release(timerSource);
-
-        request_t *req = malloc(sizeof(request_t));
-        buildRequest(req, client, baseRouter);
-
-        if (req->method == NULL) {
-          free(req);
+        /* The client's address is kept after the pipeline, freed with it */
+        client_pipeline_t *pipeline =
+            malloc(sizeof(client_pipeline_t) + CLIENT_ADDRESS_LENGTH);
+        client_t client =
+            acceptClientConnection(listener, (char *)(pipeline + 1));
+        if (client.socket < 0) {
+          free(pipeline);
+          continue;
+        }
+
+        clientPipelineInit(pipeline, server->maxBodySize,
+                           server->bodySpillThreshold);
+        client.pipeline = pipeline;
+
+        dispatch_source_t timerSource = dispatch_source_create(
+            DISPATCH_SOURCE_TYPE_TIMER, 0, 0, server->serverQueue);
+        dispatch_source_t readSource = dispatch_source_create(
+            DISPATCH_SOURCE_TYPE_READ, client.socket, 0, server->serverQueue);
+
+        dispatch_time_t delay = dispatch_time(
+            DISPATCH_TIME_NOW, ACCEPT_TIMEOUT_SECS * NSEC_PER_SEC);
+        dispatch_source_set_timer(timerSource, delay, delay, 0);
+        dispatch_source_set_event_handler(timerSource, ^{
+          log_err("timeout");
+          dispatch_source_cancel(timerSource);
+          dispatch_release(timerSource);
           closeClientConnection(client);
+          clientPipelineFree(pipeline);
+          free(pipeline);
           dispatch_source_cancel(readSource);
           dispatch_release(readSource);
-          return;
-        }
+        });
+
+        dispatch_source_set_event_handler(readSource, ^{
+          int peerClosed = clientPipelineRead(pipeline, client.socket) < 0;
+          pipeline_frame_t frame = clientPipelineFrame(pipeline);
+          if (frame == FRAME_BODY)
+            clientPipelineContinue(pipeline, NULL, client.socket);
 
-        response_t *res = malloc(sizeof(response_t));
-        buildResponse(client, req, res);
+          /* The read source fires again when the rest of the request arrives */
+          if (!peerClosed && (frame == FRAME_HEAD || frame == FRAME_BODY))
+            return;
 
-        baseRouter->handler(req, res);
+          dispatch_source_cancel(timerSource);
+          dispatch_release(timerSource);
+
+          request_t *req = malloc(sizeof(request_t));
+          buildRequest(req, client, baseRouter);
+
+          if (req->method == NULL) {
+            free(req);
+            closeClientConnection(client);
+            clientPipelineFree(pipeline);
+            free(pipeline);
+            dispatch_source_cancel(readSource);
+            dispatch_release(readSource);
+            return;
+          }
+
+          response_t *res = malloc(sizeof(response_t));
+          buildResponse(client, req, res);
+
+          baseRouter->handler(req, res);
+
+          if (res->headersSent && !res->didSend && res->end != NULL)
+            res->end();
+          else if (res->headersSent && !res->didSend)
+            expressResEnd(res);
 
 #ifdef REQUEST_TIMING
-        gettimeofday(&after, NULL);
-        clock_t end = clock();
-        double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
-        printf("%f (%.0lf us)\n", time_spent, time_diff(before, after));
+          gettimeofday(&after, NULL);
+          clock_t end = clock();
+          double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
+          printf("%f (%.0lf us)\n", time_spent, time_diff(before, after));
 #endif // REQUEST_TIMING
 
-        closeClientConnection(client);
-        freeResponse(res);
-        freeRequest(req);
-        dispatch_source_cancel(readSource);
-        dispatch_release(readSource);
-      });
+          closeClientConnection(client);
+          clientPipelineFree(pipeline);
+          free(pipeline);
+          freeResponse(res);
+          freeRequest(req);
+          dispatch_source_cancel(readSource);
+          dispatch_release(readSource);
+        });
 
-      dispatch_resume(timerSource);
-      dispatch_resume(readSource);
-    }
-  });
-  dispatch_resume(acceptSource);
+        dispatch_resume(timerSource);
+        dispatch_resume(readSource);
+      }
+    });
+    dispatch_resume(acceptSource);
+  }
 
   return 1;
 }
@@ -61,6 +61,12 @@ char *errorMessage(error_t *err) {
 }
 
 int initClientAcceptEventHandler(server_t *server, router_t *router);
+#ifdef __linux__
+int initClientIoUringEventHandler(server_t *server, router_t *router);
+#endif
+int handoffReceive(server_t *server);
+int handoffListen(server_t *server, void (^handedOff)());
+void handoffAnnounce(server_t *server);
 
 app_t *express() {
   app_t *app = malloc(sizeof(app_t));
@@ -78,6 +84,7 @@ app_t *express() {
   app->patch = router->patch;
   app->delete = router->delete;
   app->all = router->all;
+  app->ws = router->ws;
   app->use = router->use;
   app->error = router->error;
   app->useRouter = router->useRouter;
@@ -93,18 +100,45 @@ app_t *express() {
 
   app->closeServer = Block_copy(^() {
     printf("\nClosing server...\n");
-    server->close();
+    server->drain(NULL);
+  });
+
+  app->drain = Block_copy(^(drainProgressHandler progress) {
+    printf("\nDraining server...\n");
+    return server->drain(progress);
   });
 
   app->listen = Block_copy(^(int port, void (^callback)()) {
+    int inherited = handoffReceive(server);
+    check(inherited >= 0, "Failed to take over the listening sockets");
+    if (inherited > 0)
+      printf("Took over %d listening sockets\n", inherited);
     check(server->initSocket() >= 0, "Failed to initialize server socket");
     check(server->listen(port) >= 0, "Failed to listen on port %d", port);
     dispatch_async(server->serverQueue, ^{
+#ifdef __linux__
+      if (server->ioUring) {
+        if (initClientIoUringEventHandler(server, router) == 0)
+          return;
+        log_warn("io_uring is unavailable, falling back to epoll");
+      }
+#endif
       check(initClientAcceptEventHandler(server, router),
             "Failed to initialize client accept event handler");
     error:
       return;
     });
+    int hotRestart = server->handoffPath != NULL;
+#ifdef __linux__
+    hotRestart = hotRestart && !server->ioUring;
+#endif
+    if (hotRestart && handoffListen(server, ^{
+          printf("\nHanded off to the new server\n");
+          shutdownAndFreeApp(app);
+          exit(0);
+        }) < 0)
+      log_warn("Not listening for a hot restart at %s", server->handoffPath);
+    handoffAnnounce(server);
     callback();
     if (port > 0)
       dispatch_main();
@@ -121,6 +155,7 @@ app_t *express() {
     router->free();
     free(router);
     Block_release(app->closeServer);
+    Block_release(app->drain);
     Block_release(app->listen);
     Block_release(app->free);
   });
@@ -129,8 +164,8 @@ app_t *express() {
 };
 
 void shutdownAndFreeApp(app_t *app) {
+  /* Nothing is freed until the workers are done with the routers */
   app->closeServer();
-  usleep(100);
   app->free();
   free(app);
 }
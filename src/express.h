@@ -32,17 +32,20 @@
 #include <dispatch/dispatch.h>
 #include <errno.h>
 #include <execinfo.h>
+#include <fcntl.h>
 #include <memory-manager/memory-manager.h>
 #include <picohttpparser/picohttpparser.h>
 #include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string/string.h>
 #include <sys/errno.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
 
@@ -50,11 +53,35 @@
 #include <bsd/string.h>
 #include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/syscall.h>
 #endif
 
 #define MAX_REQUEST_SIZE 4096
+#define MAX_BODY_SIZE (16 * 1024 * 1024)
+#define BODY_SPILL_THRESHOLD (1024 * 1024)
 #define READ_TIMEOUT_SECS 30
 #define ACCEPT_TIMEOUT_SECS 30
+#define WRITE_TIMEOUT_SECS 30
+#define KEEP_ALIVE_TIMEOUT_SECS 5
+#define DRAIN_TIMEOUT_SECS 30
+#define HANDOFF_MAX_SOCKETS 253
+#define KEEP_ALIVE_MAX_REQUESTS 1000
+#define MAX_PIPELINE_DEPTH 16
+#define OUTPUT_HIGH_WATER_MARK 65536
+#define OUTPUT_FILE_CHUNK_SIZE 65536
+#define MULTIPART_BOUNDARY_SIZE 70
+#define MULTIPART_HEADERS_SIZE 4096
+#define MAX_RANGES 16
+#define HTTP2_MAX_CONCURRENT_STREAMS 100
+#define HTTP2_MAX_HEADER_LIST_SIZE 16384
+#define WEBSOCKET_PING_INTERVAL_SECS 30
+#define SSE_HEARTBEAT_INTERVAL_SECS 15
+#define SSE_MAX_BACKLOG (1024 * 1024)
+#define SSE_CHANNELS 1024
+#define STATIC_CACHE_BUCKETS 1024
+#define STATIC_CACHE_MAX_ENTRIES 1024
+#define STATIC_CACHE_MAX_FDS 1024
+#define STATIC_CACHE_MAX_BYTES (1024 * 1024)
 #define BT_BUF_SIZE 100
 
 /* Helpers */
@@ -188,13 +215,79 @@ typedef struct error_t {
 
 /* Server */
 
+/* Where a drain has got to, each time it reports its progress */
+typedef enum drain_phase_t {
+  DRAIN_STARTED,
+  DRAIN_WAITING,
+  DRAIN_TIMED_OUT,
+  DRAIN_COMPLETE
+} drain_phase_t;
+
+typedef struct drain_progress_t {
+  drain_phase_t phase;
+  /* Connections still open */
+  int connections;
+  uint64_t elapsedMs;
+} drain_progress_t;
+
+typedef void (^drainProgressHandler)(drain_progress_t progress);
+
 typedef struct server_t {
   int socket;
   int port;
+  /*
+    Where to listen, NULL terminated, as "127.0.0.1", "[::1]:8080" or
+    "unix:/run/app.sock". An address without a port takes the one given to
+    listen. NULL listens on every interface, over IPv6 and IPv4 both.
+  */
+  const char **addresses;
+  /* Every listening socket, the first of them being socket */
+  int *listeners;
+  int listenerCount;
   int threadCount;
   int maxEvents;
+  int reusePort;
+  int ioUring;
+  int http2;
+  int *shardSockets;
+  int shardCount;
+  int keepAlive;
+  int keepAliveTimeout;
+  int keepAliveMaxRequests;
+  int acceptTimeout;
+  int headerTimeout;
+  int bodyTimeout;
+  int writeTimeout;
+  int websocketPingInterval;
+  int sseHeartbeatInterval;
+  int drainTimeout;
+  /* Shared with the workers, and only read or written atomically */
+  int draining;
+  int drainExpired;
+  int connections;
+  int workers;
+  /* Written once to wake every worker when a drain starts */
+  int drainFd;
+  /* Workers that have not yet stopped accepting */
+  int accepting;
+  /* Hot restart, where pidFile names the process that is serving */
+  char *pidFile;
+  char *handoffPath;
+  int handoffSocket;
+  dispatch_source_t handoffSource;
+  /* Connection to the process replaced, acknowledged once accepting */
+  int handoffPeer;
+  /* Sockets taken over from the process this one replaced */
+  int *inheritedSockets;
+  int inheritedCount;
+  int handedOff;
+  int maxPipelineDepth;
+  size_t outputHighWaterMark;
+  size_t maxBodySize;
+  size_t bodySpillThreshold;
   dispatch_queue_t serverQueue;
   void (^close)();
+  int (^drain)(drainProgressHandler progress);
   int (^listen)(int port);
   int (^initSocket)();
   void (^free)();
@@ -202,11 +295,118 @@ typedef struct server_t {
 
 server_t *expressServer();
 
+/* Timer wheel */
+
+#define TIMER_WHEEL_TICK_MS 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+typedef struct wheel_timer_t {
+  struct wheel_timer_t *next;
+  struct wheel_timer_t *prev;
+  uint64_t expires;
+  void (*expire)(struct wheel_timer_t *timer);
+  void *data;
+} wheel_timer_t;
+
+/* Owned by a single thread, so nothing in it is locked */
+typedef struct timer_wheel_t {
+  uint64_t tick;
+  size_t count;
+  wheel_timer_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
 /* Client */
 
+typedef enum chunked_body_t {
+  CHUNKED_ERROR = -1,
+  CHUNKED_NONE,
+  CHUNKED_DECODING,
+  CHUNKED_COMPLETE
+} chunked_body_t;
+
+/*
+  Bytes read from a connection that no request has taken yet. The head of a
+  request is at most MAX_REQUEST_SIZE, and a body larger than spillThreshold
+  is read into spill, an mmap of an unlinked temp file, instead of data. A
+  chunked body is decoded in place as it arrives, bodyLength counting the
+  bytes decoded so far. Past spillThreshold those are written out to
+  spillFd, spillLength counting them, and mapped into spill once the last
+  chunk is in. On an HTTP/2 connection frameLength is the length of a frame
+  that has only partly arrived.
+*/
+typedef struct client_pipeline_t {
+  char *data;
+  size_t length;
+  size_t size;
+  size_t parsedLength;
+  size_t headLength;
+  size_t bodyLength;
+  int expectContinue;
+  chunked_body_t chunked;
+  struct phr_chunked_decoder decoder;
+  char *spill;
+  size_t spillLength;
+  int spillFd;
+  size_t maxBodySize;
+  size_t spillThreshold;
+  size_t frameLength;
+} client_pipeline_t;
+
+typedef enum pipeline_frame_t {
+  FRAME_ERROR = -1,
+  FRAME_HEAD,
+  FRAME_BODY,
+  FRAME_COMPLETE
+} pipeline_frame_t;
+
+typedef struct client_buffer_t {
+  char *data;
+  size_t length;
+  size_t size;
+} client_buffer_t;
+
+/* A run of response bytes, copied into data or left in the file fd */
+typedef struct output_segment_t {
+  struct output_segment_t *next;
+  int fd;
+  off_t offset;
+  size_t length;
+  size_t size;
+  char data[];
+} output_segment_t;
+
+typedef struct client_output_t {
+  output_segment_t *head;
+  output_segment_t *tail;
+  size_t length;
+  size_t highWaterMark;
+  int deferred;
+  /* Set once the socket fails or a copy cannot be made, after which nothing
+     is queued and the connection is to be closed */
+  int failed;
+} client_output_t;
+
+/* Room for a client address as text, a Unix socket path included */
+#define CLIENT_ADDRESS_LENGTH 128
+
 typedef struct client_t {
   int socket;
   char *ip;
+  int keepAlive;
+  client_pipeline_t *pipeline;
+  /* Response headers are serialised here, reused across requests */
+  client_buffer_t *headerBuffer;
+  /* Whatever the socket does not take right away is queued here */
+  client_output_t *output;
+  /* The HTTP/2 stream a request came in on, NULL for HTTP/1 */
+  struct h2_stream_t *stream;
+  /* Where a WebSocket route leaves the socket taking the connection over,
+     NULL where connections are not upgraded */
+  struct websocket_t **websocket;
+  /* The same for a response that subscribes to Server-Sent Events */
+  struct sse_subscriber_t **subscriber;
 } client_t;
 
 /* Request */
@@ -214,6 +414,51 @@ typedef struct client_t {
 struct request_t;
 
 typedef void (^cleanupHandler)(struct request_t *finishedReq);
+typedef void (^bodyDataHandler)(const char *chunk, size_t length);
+
+/*
+  A part of a multipart/form-data body. A field's value is kept in the
+  request's memory, a file is written to a temp file at path that is removed
+  along with the request, so rename() it to keep it.
+*/
+typedef struct multipart_part_t {
+  struct multipart_part_t *next;
+  struct multipart_part_t *nextFile;
+  char *name;
+  char *filename;
+  char *contentType;
+  char *value;
+  char *path;
+  size_t size;
+  int fd;
+} multipart_part_t;
+
+/* Called with each piece of a part as it is parsed, then with a length of 0 */
+typedef void (^multipartDataHandler)(multipart_part_t *part, const char *data,
+                                     size_t length);
+
+typedef enum multipart_state_t {
+  MULTIPART_ERROR = -1,
+  MULTIPART_PREAMBLE,
+  MULTIPART_BOUNDARY,
+  MULTIPART_BOUNDARY_CR,
+  MULTIPART_BOUNDARY_DASH,
+  MULTIPART_HEADERS,
+  MULTIPART_DATA,
+  MULTIPART_EPILOGUE
+} multipart_state_t;
+
+typedef struct multipart_parser_t {
+  struct request_t *req;
+  multipart_state_t state;
+  char delimiter[MULTIPART_BOUNDARY_SIZE + 4];
+  size_t delimiterLength;
+  size_t matched;
+  char headers[MULTIPART_HEADERS_SIZE];
+  size_t headersLength;
+  multipart_part_t *part;
+  multipartDataHandler handler;
+} multipart_parser_t;
 
 typedef struct request_t {
   const char *path;
@@ -227,13 +472,19 @@ typedef struct request_t {
   int ipsCount;
   const char **ips;
   const char *protocol;
+  int httpVersionMinor;
+  int keepAlive;
   int secure;
   void *route;
   int xhr;
   int subdomainsCount;
   const char **subdomains;
-  char rawRequest[MAX_REQUEST_SIZE];
+  char *rawRequest;
   size_t rawRequestSize;
+  const char *rawBody;
+  size_t bodyReadOffset;
+  multipart_part_t *parts;
+  int multipartParsed;
   key_value_t queryKeyValues[100];
   size_t queryKeyValueCount;
   const char *queryString;
@@ -268,6 +519,11 @@ typedef struct request_t {
   void * (^m)(const char *middlewareKey);
   void (^mSet)(const char *middlewareKey, void *middleware);
   void * (^malloc)(size_t size);
+  size_t (^readBody)(char *buf, size_t length);
+  void (^onData)(bodyDataHandler handler);
+  multipart_part_t * (^part)(const char *name);
+  multipart_part_t * (^files)(void);
+  int (^onPart)(multipartDataHandler handler);
   void *(*threadLocalMalloc)(size_t size);
   void (*threadLocalFree)(void *ptr);
   void * (^blockCopy)(void *);
@@ -281,6 +537,11 @@ void *expressReqMiddlewareGet(request_t *req, const char *key);
 void expressReqMiddlewareSet(request_t *req, const char *key, void *middleware);
 char *expressReqBody(request_t *req, const char *key);
 void *expressReqMalloc(request_t *req, size_t size);
+size_t expressReqReadBody(request_t *req, char *buf, size_t length);
+void expressReqOnData(request_t *req, bodyDataHandler handler);
+multipart_part_t *expressReqPart(request_t *req, const char *name);
+multipart_part_t *expressReqFiles(request_t *req);
+int expressReqOnPart(request_t *req, multipartDataHandler handler);
 void *expressReqBlockCopy(request_t *req, void *block);
 
 void expressReqHelpers(request_t *req);
@@ -295,6 +556,12 @@ typedef struct response_sender_t {
   responseSenderCallback callback;
 } response_sender_t;
 
+/* Bytes of a file asked for with a Range header */
+typedef struct byte_range_t {
+  size_t start;
+  size_t length;
+} byte_range_t;
+
 typedef struct response_t {
   client_t client;
   request_t *req;
@@ -304,8 +571,13 @@ typedef struct response_t {
   size_t headersKeyValueCount;
   size_t cookieHeadersLength;
   char cookieHeaders[4096];
+  /* Header lines, each ending in CRLF, that go out as they are */
+  const char *headerBlock;
+  size_t headerBlockLength;
   int status;
   int didSend;
+  int headersSent;
+  int chunked;
   response_sender_t *senders[100];
   int sendersCount;
   void (^set)(const char *, const char *);
@@ -323,6 +595,9 @@ typedef struct response_t {
   void (^send)(const char *);
   void (^sendf)(const char *, ...);
   void (^sendFile)(const char *);
+  int (^write)(const char *, size_t);
+  void (^flushHeaders)();
+  void (^end)();
   void (^render)(void *, void *);
   void (^error)(error_t *err);
 } response_t;
@@ -333,6 +608,9 @@ void expressResError(response_t *res, error_t *err);
 void expressResSend(response_t *res, const char *body);
 void expressResSendf(response_t *res, const char *format, ...);
 void expressResSendFile(response_t *res, const char *path);
+int expressResWrite(response_t *res, const char *data, size_t length);
+void expressResFlushHeaders(response_t *res);
+void expressResEnd(response_t *res);
 void expressResStatus(response_t *res, int status);
 void expressResType(response_t *res, const char *type);
 void expressResJson(response_t *res, const char *json);
@@ -364,15 +642,83 @@ typedef void (^paramHandler)(request_t *req, response_t *res,
                              const char *paramValue, void (^next)(),
                              void (^cleanup)(cleanupHandler));
 
+/* WebSocket */
+
+typedef enum websocket_opcode_t {
+  WEBSOCKET_CONTINUATION = 0x0,
+  WEBSOCKET_TEXT = 0x1,
+  WEBSOCKET_BINARY = 0x2,
+  WEBSOCKET_CLOSE = 0x8,
+  WEBSOCKET_PING = 0x9,
+  WEBSOCKET_PONG = 0xa
+} websocket_opcode_t;
+
+struct websocket_t;
+
+/* data is the whole message, length bytes that are not NUL terminated */
+typedef void (^websocketMessageHandler)(struct websocket_t *ws,
+                                        websocket_opcode_t opcode,
+                                        const char *data, size_t length);
+typedef void (^websocketCloseHandler)(struct websocket_t *ws, int code);
+
+/*
+  A connection upgraded by a WebSocket route. Its handlers run one at a time
+  on the worker thread the connection belongs to. It can be sent to from any
+  thread, for as long as a reference to it is held, and sends fail once the
+  connection has closed.
+*/
+typedef struct websocket_t {
+  int socket;
+  int epollFd;
+  void *event;
+  pthread_t worker;
+  pthread_mutex_t lock;
+  int references;
+  client_output_t *output;
+  client_output_t pending;
+  client_pipeline_t *pipeline;
+  size_t maxMessageSize;
+  websocket_opcode_t messageOpcode;
+  char *message;
+  size_t messageLength;
+  size_t messageSize;
+  int pingSent;
+  int closeSent;
+  int closeReceived;
+  int closed;
+  void *user;
+  websocketMessageHandler onMessage;
+  websocketCloseHandler onClose;
+  int (^send)(const char *text);
+  int (^sendBinary)(const char *data, size_t length);
+  void (^close)(int code, const char *reason);
+} websocket_t;
+
+/* Runs before the socket is served, req is gone once it returns */
+typedef void (^websocketHandler)(websocket_t *ws, request_t *req);
+
+int expressWebSocketSend(websocket_t *ws, websocket_opcode_t opcode,
+                         const char *data, size_t length);
+void expressWebSocketClose(websocket_t *ws, int code, const char *reason);
+void expressWebSocketRetain(websocket_t *ws);
+void expressWebSocketRelease(websocket_t *ws);
+
 /* Function signatures */
 
 typedef char * (^getBlock)(const char *key);
 typedef void * (^mallocBlock)(size_t);
+typedef size_t (^readBodyBlock)(char *buf, size_t length);
+typedef void (^onDataBlock)(bodyDataHandler handler);
+typedef multipart_part_t * (^partBlock)(const char *name);
+typedef multipart_part_t * (^filesBlock)(void);
+typedef int (^onPartBlock)(multipartDataHandler handler);
 typedef void * (^copyBlock)(void *);
 typedef void (^getMiddlewareSetBlock)(const char *key, void *middleware);
 typedef void * (^getMiddlewareBlock)(const char *key);
 typedef void (^sendBlock)(const char *body);
 typedef void (^sendfBlock)(const char *format, ...);
+typedef int (^writeBlock)(const char *data, size_t length);
+typedef void (^endBlock)();
 typedef void (^sendStatusBlock)(int status);
 typedef void (^downloadBlock)(const char *filePath, const char *name);
 typedef void (^setBlock)(const char *key, const char *value);
@@ -390,6 +736,17 @@ int writePid(char *pidFile);
 unsigned long readPid(char *pidFile);
 char *cwdFullPath(const char *path);
 char *matchEmbeddedFile(const char *path, embedded_files_data_t embeddedFiles);
+const unsigned char *findEmbeddedFile(const char *path,
+                                      embedded_files_data_t embeddedFiles,
+                                      size_t *length);
+int acceptsEncoding(const char *acceptEncoding, const char *coding);
+
+/* MIME types, looked up by lowercase extension in a fixed size hash table */
+#define MIME_TABLE_SIZE 2048
+#define MIME_EXTENSION_SIZE 32
+
+const char *expressMimeType(const char *path);
+int expressMimeTypeSet(const char *extension, const char *type);
 
 /* Public middleware */
 
@@ -408,8 +765,109 @@ typedef struct mem_session_t {
   int count;
 } mem_session_t;
 
+/* A static file and the precompressed siblings it may have */
+typedef enum static_encoding_t {
+  STATIC_IDENTITY,
+  STATIC_GZIP,
+  STATIC_BROTLI,
+  STATIC_ENCODINGS
+} static_encoding_t;
+
+/*
+  One file kept open, its validators worked out and every header but
+  Content-Type laid out in headers, fd is -1 when it is absent
+*/
+typedef struct static_file_t {
+  int fd;
+  int wd;
+  size_t size;
+  time_t modified;
+  char etag[64];
+  char lastModified[32];
+  char *headers;
+  size_t headersLength;
+} static_file_t;
+
+/* Freed with its last reference, the cache holding one while it is linked */
+typedef struct static_cache_entry_t {
+  struct static_cache_entry_t *next;
+  int refs;
+  /* The descriptors and memory the entry holds, counted against the cache */
+  size_t fds;
+  size_t bytes;
+  char *urlPath;
+  const char *contentType;
+  static_file_t files[STATIC_ENCODINGS];
+} static_cache_entry_t;
+
+/*
+  Files served by expressStaticCache, at most maxEntries of them, holding no
+  more than maxFds descriptors and maxBytes of memory. Lookups run
+  concurrently on queue, changes to the entries run as barriers on it, and
+  changes counts the file changes read so far.
+*/
+typedef struct static_cache_t {
+  static_cache_entry_t *buckets[STATIC_CACHE_BUCKETS];
+  size_t count;
+  size_t fds;
+  size_t bytes;
+  size_t changes;
+  size_t maxEntries;
+  size_t maxFds;
+  size_t maxBytes;
+  const char *cacheControl;
+  int inotifyFd;
+  dispatch_queue_t queue;
+  dispatch_source_t source;
+} static_cache_t;
+
+/* An embedded file, sent from where it was compiled in */
+typedef struct embedded_file_t {
+  const char *name;
+  const unsigned char *data;
+  size_t length;
+  const char *contentType;
+  char etag[20];
+  struct embedded_file_t *variants[STATIC_ENCODINGS];
+} embedded_file_t;
+
+/*
+  A minimal perfect hash over the embedded file names, built once. A name
+  hashes to a bucket, and the bucket's seed to the slot in files holding it.
+  A negative seed is the slot itself, less one, for buckets of one name.
+*/
+typedef struct embedded_files_index_t {
+  embedded_file_t *files;
+  int *seeds;
+  size_t count;
+} embedded_files_index_t;
+
 middlewareHandler expressStatic(const char *path, const char *fullPath,
                                 embedded_files_data_t embeddedFiles);
+middlewareHandler expressStaticCache(const char *path, const char *fullPath,
+                                     const char *cacheControl,
+                                     size_t maxEntries);
+/* Bodies shorter than this are not worth compressing */
+#define COMPRESSION_MIN_LENGTH 1024
+
+middlewareHandler expressCompression(size_t minLength);
+
+/*
+  Named channels of Server-Sent Events, looked up without a lock. A channel
+  is added the first time it is subscribed to and lasts as long as the hub,
+  which has to outlive the server.
+*/
+typedef struct sse_hub_t {
+  struct sse_channel_t *channels[SSE_CHANNELS];
+  pthread_mutex_t lock;
+} sse_hub_t;
+
+sse_hub_t *expressSseHub();
+void expressSseHubFree(sse_hub_t *hub);
+int expressSsePublish(sse_hub_t *hub, const char *channel, const char *event,
+                      const char *data);
+void expressSseSubscribe(response_t *res, sse_hub_t *hub, const char *channel);
+
 middlewareHandler memSessionMiddlewareFactory(mem_session_t *memSession,
                                               dispatch_queue_t memSessionQueue);
 middlewareHandler expressHelpersMiddleware();
@@ -444,6 +902,7 @@ typedef struct router_t {
   void (^patch)(const char *path, requestHandler);
   void (^delete)(const char *path, requestHandler);
   void (^all)(const char *path, requestHandler);
+  void (^ws)(const char *path, websocketHandler);
   void (^use)(middlewareHandler);
   void (^useRouter)(char *mountPath, struct router_t *routerToMount);
   void (^mountTo)(struct router_t *baseRouter);
@@ -479,6 +938,7 @@ typedef struct app_t {
   void (^patch)(const char *path, requestHandler);
   void (^delete)(const char *path, requestHandler);
   void (^all)(const char *path, requestHandler);
+  void (^ws)(const char *path, websocketHandler);
   void (^listen)(int port, void (^callback)());
   void (^use)(middlewareHandler);
   void (^useRouter)(char *mountPath, struct router_t *routerToMount);
@@ -487,6 +947,7 @@ typedef struct app_t {
   void (^error)(errorHandler);
   void (^cleanup)(appCleanupHandler);
   void (^closeServer)();
+  int (^drain)(drainProgressHandler progress);
   void (^free)();
 } app_t;
 
@@ -0,0 +1,248 @@
+#include "express.h"
+#include <limits.h>
+#include <sys/un.h>
+
+/*
+
+Hot restart.
+
+A server with a handoffPath listens there, on a Unix socket, for the process
+replacing it, and hands whoever connects every listening socket it has with
+SCM_RIGHTS. The new process can also be started with the sockets already
+open, their descriptors listed in EXPRESS_LISTEN_FDS, comma separated. The
+sockets are the very same ones either way, with the same accept queue, so
+no connection is refused while the two processes overlap.
+
+Once it is accepting, the new process writes its pid to the pidFile and
+acknowledges the sockets over the same Unix socket, which it kept open. Only
+then does the old process let go of them and drain. Should the new process
+exit before that, the connection closes unacknowledged and the old one
+keeps serving. Sockets passed in EXPRESS_LISTEN_FDS are acknowledged to no
+one, whoever passed them stops the old process.
+
+*/
+
+/* Listening sockets first, then the shards of a sharded server */
+static int listeningSockets(server_t *server, int *sockets) {
+  int count = 0;
+  for (int i = 0; i < server->listenerCount && count < HANDOFF_MAX_SOCKETS; i++)
+    sockets[count++] = server->listeners[i];
+  for (int i = 0; i < server->shardCount && count < HANDOFF_MAX_SOCKETS; i++)
+    sockets[count++] = server->shardSockets[i];
+  return count;
+}
+
+static int sendSockets(int connection, int *sockets, int count) {
+  char byte = 0;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_SOCKETS)];
+  memset(control, 0, sizeof(control));
+  struct msghdr message = {.msg_iov = &iov,
+                           .msg_iovlen = 1,
+                           .msg_control = control,
+                           .msg_controllen = CMSG_SPACE(sizeof(int) * count)};
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+  memcpy(CMSG_DATA(header), sockets, sizeof(int) * count);
+  return sendmsg(connection, &message, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static int receiveSockets(int connection, int *sockets) {
+  char byte;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_SOCKETS)];
+  struct msghdr message = {.msg_iov = &iov,
+                           .msg_iovlen = 1,
+                           .msg_control = control,
+                           .msg_controllen = sizeof(control)};
+  ssize_t received;
+  do {
+    received = recvmsg(connection, &message, 0);
+  } while (received < 0 && errno == EINTR);
+  check(received == 1, "recvmsg() failed");
+
+  int count = 0;
+  for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL;
+       header = CMSG_NXTHDR(&message, header)) {
+    if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+      continue;
+    int length = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(sockets + count, CMSG_DATA(header), sizeof(int) * length);
+    count += length;
+  }
+  return count;
+error:
+  return -1;
+}
+
+/*
+  0 when there is nothing listening at path to take over from. The
+  connection is left open in peer, to be acknowledged on.
+*/
+static int receiveFromPath(const char *path, int *sockets, int *peer) {
+  int connection = -1;
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  check(strlen(path) < sizeof(address.sun_path), "%s is too long", path);
+  strcpy(address.sun_path, path);
+
+  check((connection = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0,
+        "socket() failed");
+  if (connect(connection, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    check_silent(errno == ENOENT || errno == ECONNREFUSED, "connect() failed");
+    close(connection);
+    errno = 0;
+    return 0;
+  }
+  int count = receiveSockets(connection, sockets);
+  if (count > 0)
+    *peer = connection;
+  else
+    close(connection);
+  return count;
+error:
+  if (connection >= 0)
+    close(connection);
+  return -1;
+}
+
+static int receiveFromEnvironment(const char *fds, int *sockets) {
+  int count = 0;
+  for (const char *fd = fds; *fd != '\0' && count < HANDOFF_MAX_SOCKETS;) {
+    char *end;
+    long socket = strtol(fd, &end, 10);
+    check(end != fd && socket >= 0 && socket <= INT_MAX &&
+              fcntl(socket, F_GETFD) >= 0,
+          "EXPRESS_LISTEN_FDS has no socket at %s", fd);
+    sockets[count++] = socket;
+    fd = *end == ',' ? end + 1 : end;
+  }
+  /* So that nothing this process starts takes them too */
+  unsetenv("EXPRESS_LISTEN_FDS");
+  return count;
+error:
+  return -1;
+}
+
+/*
+  Takes over the listening sockets of the process being replaced, if there
+  is one, for listen to pick out by their address. Returns how many there
+  were, 0 for none, or -1 on failure.
+*/
+int handoffReceive(server_t *server) {
+  int sockets[HANDOFF_MAX_SOCKETS];
+  int count = 0;
+  const char *fds = getenv("EXPRESS_LISTEN_FDS");
+  if (fds != NULL)
+    count = receiveFromEnvironment(fds, sockets);
+  else if (server->handoffPath != NULL)
+    count = receiveFromPath(server->handoffPath, sockets, &server->handoffPeer);
+  if (count <= 0)
+    return count;
+
+  /* They may come from a process that had not made them non-blocking */
+  for (int i = 0; i < count; i++)
+    check(fcntl(sockets[i], F_SETFL, O_NONBLOCK) >= 0, "fcntl() failed");
+  server->inheritedSockets = malloc(sizeof(int) * count);
+  check_mem(server->inheritedSockets);
+  memcpy(server->inheritedSockets, sockets, sizeof(int) * count);
+  server->inheritedCount = count;
+  return count;
+error:
+  for (int i = 0; i < count; i++)
+    close(sockets[i]);
+  if (server->handoffPeer >= 0)
+    close(server->handoffPeer);
+  server->handoffPeer = -1;
+  return -1;
+}
+
+/*
+  Waits on the connection for the byte the new process sends once it is
+  accepting. A connection closed without it was a process that gave up.
+*/
+static void awaitAck(server_t *server, int connection, void (^handedOff)()) {
+  dispatch_source_t source = dispatch_source_create(
+      DISPATCH_SOURCE_TYPE_READ, connection, 0, server->serverQueue);
+  dispatch_source_set_event_handler(source, ^{
+    char byte;
+    ssize_t received = recv(connection, &byte, 1, MSG_DONTWAIT);
+    if (received < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+    dispatch_source_cancel(source);
+    if (received != 1 || __atomic_exchange_n(&server->handedOff, 1,
+                                             __ATOMIC_ACQ_REL))
+      return;
+    dispatch_async(dispatch_get_main_queue(), handedOff);
+  });
+  dispatch_source_set_cancel_handler(source, ^{
+    close(connection);
+    dispatch_release(source);
+  });
+  dispatch_resume(source);
+}
+
+static void handOver(server_t *server, void (^handedOff)()) {
+  int connection;
+  while ((connection = accept(server->handoffSocket, NULL, NULL)) >= 0) {
+    int sockets[HANDOFF_MAX_SOCKETS];
+    int count = listeningSockets(server, sockets);
+    if (count > 0 && sendSockets(connection, sockets, count) == 0) {
+      awaitAck(server, connection, handedOff);
+      continue;
+    }
+    if (count > 0)
+      log_err("sendmsg() failed");
+    close(connection);
+  }
+}
+
+/*
+  Listens at handoffPath for the process that will replace this one, in
+  place of whichever process listened there before. Calls handedOff on the
+  main queue once that process has taken the sockets and is accepting.
+*/
+int handoffListen(server_t *server, void (^handedOff)()) {
+  int handoffSocket = -1;
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  const char *path = server->handoffPath;
+  check(strlen(path) < sizeof(address.sun_path), "%s is too long", path);
+  strcpy(address.sun_path, path);
+
+  check((handoffSocket = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0,
+        "socket() failed");
+  unlink(path);
+  check(bind(handoffSocket, (struct sockaddr *)&address, sizeof(address)) >= 0,
+        "bind() failed");
+  /* Connecting takes write permission, so only the same user gets them */
+  check(chmod(path, S_IRUSR | S_IWUSR) >= 0, "chmod() failed");
+  check(fcntl(handoffSocket, F_SETFL, O_NONBLOCK) >= 0, "fcntl() failed");
+  check(listen(handoffSocket, 16) >= 0, "listen() failed");
+
+  server->handoffSocket = handoffSocket;
+  server->handoffSource = dispatch_source_create(
+      DISPATCH_SOURCE_TYPE_READ, handoffSocket, 0, server->serverQueue);
+  dispatch_source_set_event_handler(server->handoffSource, ^{
+    handOver(server, handedOff);
+  });
+  dispatch_resume(server->handoffSource);
+  return 0;
+error:
+  if (handoffSocket >= 0)
+    close(handoffSocket);
+  return -1;
+}
+
+/* The new process is accepting, so the one it replaces can stop */
+void handoffAnnounce(server_t *server) {
+  if (server->pidFile != NULL && !writePid(server->pidFile))
+    log_err("Failed to write %s", server->pidFile);
+  if (server->handoffPeer < 0)
+    return;
+  char byte = 0;
+  if (send(server->handoffPeer, &byte, 1, MSG_NOSIGNAL) != 1)
+    log_err("send() failed");
+  close(server->handoffPeer);
+  server->handoffPeer = -1;
+}
@@ -1,6 +1,9 @@
 #include "express.h"
 
-char *matchEmbeddedFile(const char *path, embedded_files_data_t embeddedFiles) {
+/* The embedded file for path, pointing into the embedded data itself */
+const unsigned char *findEmbeddedFile(const char *path,
+                                      embedded_files_data_t embeddedFiles,
+                                      size_t *length) {
   size_t pathLen = strlen(path);
   for (int i = 0; i < embeddedFiles.count; i++) {
     int match = 1;
@@ -14,15 +17,46 @@ char *matchEmbeddedFile(const char *path, embedded_files_data_t embeddedFiles) {
       }
     }
     if (match) {
-      char *data = malloc(sizeof(char) * (embeddedFiles.lengths[i] + 1));
-      memcpy(data, embeddedFiles.data[i], embeddedFiles.lengths[i]);
-      data[embeddedFiles.lengths[i]] = '\0';
-      return data;
+      *length = embeddedFiles.lengths[i];
+      return embeddedFiles.data[i];
     }
   }
-  return (char *)NULL;
+  return NULL;
+}
+
+char *matchEmbeddedFile(const char *path, embedded_files_data_t embeddedFiles) {
+  size_t length;
+  const unsigned char *file = findEmbeddedFile(path, embeddedFiles, &length);
+  if (file == NULL)
+    return (char *)NULL;
+  char *data = malloc(sizeof(char) * (length + 1));
+  memcpy(data, file, length);
+  data[length] = '\0';
+  return data;
 };
 
+/* Whether Accept-Encoding allows coding, a q of 0 turns it down */
+int acceptsEncoding(const char *acceptEncoding, const char *coding) {
+  size_t codingLen = strlen(coding);
+  int wildcard = 0;
+  const char *token = acceptEncoding;
+  while (*token != '\0') {
+    while (*token == ' ' || *token == '\t' || *token == ',')
+      token++;
+    size_t nameLen = strcspn(token, " \t;,");
+    const char *end = token + strcspn(token, ",");
+    const char *q = strstr(token, "q=");
+    int accepted = q == NULL || q > end || strtod(q + 2, NULL) > 0;
+
+    if (nameLen == codingLen && strncasecmp(token, coding, codingLen) == 0)
+      return accepted;
+    if (nameLen == 1 && *token == '*')
+      wildcard = accepted;
+    token = end;
+  }
+  return wildcard;
+}
+
 char *cwdFullPath(const char *path) {
   char cwd[PATH_MAX];
   getcwd(cwd, sizeof(cwd));
@@ -34,9 +68,13 @@ char *cwdFullPath(const char *path) {
 
 int writePid(char *pidFile) {
   char buf[100];
-  int fd = open(pidFile, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  int fd = open(pidFile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return 0;
   snprintf(buf, 100, "%ld\n", (long)getpid());
-  return (unsigned long)write(fd, buf, strlen(buf)) == (unsigned long)strlen;
+  ssize_t written = write(fd, buf, strlen(buf));
+  close(fd);
+  return written == (ssize_t)strlen(buf);
 }
 
 unsigned long readPid(char *pidFile) {
@@ -45,9 +83,10 @@ unsigned long readPid(char *pidFile) {
     return -1;
   char buf[100];
   unsigned long pid = 0;
-  while (read(fd, buf, 1) > 0) {
+  while (read(fd, buf, 1) > 0 && buf[0] >= '0' && buf[0] <= '9') {
     pid = pid * 10 + (unsigned long)(buf[0] - '0');
   }
+  close(fd);
   return pid;
 }
 
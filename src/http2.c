@@ -0,0 +1,1410 @@
+#include "express.h"
+#include <netinet/tcp.h>
+
+/*
+
+Cleartext HTTP/2, started by prior knowledge, with the connection preface,
+or by upgrading the first request of an HTTP/1.1 connection.
+
+A stream's header block is decoded into a phr_header array and written out
+as an HTTP/1.1 head, followed by the body its DATA frames carry, in a
+pipeline of the stream's own. buildRequest, the router and the middleware
+serve it like any other request, into a deferred output queue that is then
+sent on as HEADERS and DATA frames, as much at a time as the peer's flow
+control windows and the connection's output queue allow.
+
+Responses are encoded with literals only, so the decoder's dynamic table is
+the only one kept.
+
+*/
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH 24
+#define H2_FRAME_HEADER_LENGTH 9
+#define H2_FRAME_SIZE 16384
+#define H2_WINDOW_SIZE 65535
+#define H2_MAX_WINDOW_SIZE 0x7fffffff
+#define HPACK_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_TABLE_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+#define HPACK_STATIC_ENTRIES 61
+
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY_FLAG 0x20
+
+typedef enum h2_frame_type_t {
+  H2_DATA,
+  H2_HEADERS,
+  H2_PRIORITY,
+  H2_RST_STREAM,
+  H2_SETTINGS,
+  H2_PUSH_PROMISE,
+  H2_PING,
+  H2_GOAWAY,
+  H2_WINDOW_UPDATE,
+  H2_CONTINUATION
+} h2_frame_type_t;
+
+typedef enum h2_setting_t {
+  H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+  H2_SETTINGS_ENABLE_PUSH,
+  H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+  H2_SETTINGS_INITIAL_WINDOW_SIZE,
+  H2_SETTINGS_MAX_FRAME_SIZE,
+  H2_SETTINGS_MAX_HEADER_LIST_SIZE
+} h2_setting_t;
+
+typedef enum h2_error_code_t {
+  H2_NO_ERROR,
+  H2_PROTOCOL_ERROR,
+  H2_INTERNAL_ERROR,
+  H2_FLOW_CONTROL_ERROR,
+  H2_SETTINGS_TIMEOUT,
+  H2_STREAM_CLOSED,
+  H2_FRAME_SIZE_ERROR,
+  H2_REFUSED_STREAM,
+  H2_CANCEL,
+  H2_COMPRESSION_ERROR,
+  H2_CONNECT_ERROR,
+  H2_ENHANCE_YOUR_CALM
+} h2_error_code_t;
+
+typedef enum h2_stream_state_t {
+  H2_STREAM_OPEN,
+  H2_STREAM_RESPONDING
+} h2_stream_state_t;
+
+/* A request being read, or a response being sent, or both */
+typedef struct h2_stream_t {
+  struct h2_stream_t *next;
+  uint32_t id;
+  h2_stream_state_t state;
+  int64_t window;
+  int head;
+  int headersSent;
+  client_pipeline_t request;
+  client_output_t output;
+} h2_stream_t;
+
+typedef struct hpack_entry_t {
+  char *name;
+  size_t nameLength;
+  char *value;
+  size_t valueLength;
+} hpack_entry_t;
+
+/* A ring of entries, which is never more than the smallest entries fill */
+typedef struct hpack_table_t {
+  hpack_entry_t entries[HPACK_TABLE_ENTRIES];
+  size_t newest;
+  size_t count;
+  size_t size;
+  size_t maxSize;
+} hpack_table_t;
+
+typedef struct h2_connection_t {
+  h2_stream_t *streams;
+  size_t streamCount;
+  uint32_t lastStreamId;
+  int64_t window;
+  uint32_t initialWindow;
+  uint32_t maxFrameSize;
+  size_t unacknowledged;
+  size_t maxBodySize;
+  size_t highWaterMark;
+  int preface;
+  int goaway;
+  /* Set while a header block is continued in CONTINUATION frames */
+  uint32_t continuationId;
+  int continuationFlags;
+  client_buffer_t block;
+  client_buffer_t encoded;
+  hpack_table_t table;
+  struct phr_header headers[100];
+  size_t stringsLength;
+  char strings[HTTP2_MAX_HEADER_LIST_SIZE];
+} h2_connection_t;
+
+int serveClientRequest(client_t client, router_t *baseRouter);
+void clientPipelineInit(client_pipeline_t *pipeline, size_t maxBodySize,
+                        size_t spillThreshold);
+void clientPipelineFree(client_pipeline_t *pipeline);
+void clientPipelineConsume(client_pipeline_t *pipeline);
+void clientOutputInit(client_output_t *output, int deferred,
+                      size_t highWaterMark);
+void clientOutputFree(client_output_t *output);
+void clientOutputWrite(client_output_t *output, int socket, struct iovec *iov,
+                       int count);
+ssize_t clientOutputPeek(client_output_t *output, const char **data,
+                         char *scratch, size_t scratchSize);
+void clientOutputConsume(client_output_t *output, size_t length);
+
+static const char *staticTable[HPACK_STATIC_ENTRIES][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""}};
+
+/* The length of each symbol's Huffman code, the last one being EOS */
+static const uint8_t huffmanLengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28,
+    28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28, 6,  10, 10, 12, 13, 6,
+    8,  11, 10, 10, 8,  11, 8,  6,  6,  6,  5,  5,  5,  6,  6,  6,  6,  6,  6,
+    6,  7,  8,  15, 6,  12, 10, 13, 6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+    7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8,  13, 19, 13, 14,
+    6,  15, 5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,  6,  7,
+    6,  5,  5,  6,  7,  7,  7,  7,  7,  15, 11, 14, 13, 28, 20, 22, 20, 20, 22,
+    22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23, 23, 23,
+    23, 21, 22, 23, 22, 23, 23, 24, 22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22,
+    24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22,
+    22, 23, 26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25, 19,
+    21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27, 20, 24, 20, 21,
+    22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27, 27,
+    27, 27, 28, 27, 27, 27, 27, 27, 26, 30};
+
+static uint16_t huffmanSymbols[257];
+static uint32_t huffmanFirstCode[31];
+static uint16_t huffmanFirstIndex[31];
+static uint16_t huffmanCount[31];
+static pthread_once_t huffmanOnce = PTHREAD_ONCE_INIT;
+
+/*
+  The code is canonical, the codes of a length being consecutive numbers
+  given out in symbol order, so the lengths are all it takes to decode it.
+*/
+static void loadHuffmanCode() {
+  uint16_t index = 0;
+  uint32_t code = 0;
+  for (int length = 1; length <= 30; length++) {
+    huffmanFirstCode[length] = code;
+    huffmanFirstIndex[length] = index;
+    for (int symbol = 0; symbol < 257; symbol++) {
+      if (huffmanLengths[symbol] == length)
+        huffmanSymbols[index++] = symbol;
+    }
+    huffmanCount[length] = index - huffmanFirstIndex[length];
+    code = (code + huffmanCount[length]) << 1;
+  }
+}
+
+static ssize_t huffmanDecode(const unsigned char *data, size_t length,
+                             char *out, size_t size) {
+  pthread_once(&huffmanOnce, loadHuffmanCode);
+  size_t written = 0;
+  uint32_t code = 0;
+  int codeLength = 0;
+  for (size_t i = 0; i < length; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      code = (code << 1) | ((data[i] >> bit) & 1);
+      codeLength++;
+      uint32_t offset = code - huffmanFirstCode[codeLength];
+      if (code < huffmanFirstCode[codeLength] ||
+          offset >= huffmanCount[codeLength]) {
+        if (codeLength == 30)
+          return -1;
+        continue;
+      }
+
+      uint16_t symbol = huffmanSymbols[huffmanFirstIndex[codeLength] + offset];
+      if (symbol == 256 || written == size)
+        return -1;
+      out[written++] = (char)symbol;
+      code = 0;
+      codeLength = 0;
+    }
+  }
+
+  /* What is left is padding, the first bits of EOS, which are all ones */
+  if (codeLength > 7 || code != (1u << codeLength) - 1)
+    return -1;
+  return written;
+}
+
+static int hpackInteger(const unsigned char **data, const unsigned char *end,
+                        int prefixBits, size_t *value) {
+  size_t limit = (1u << prefixBits) - 1;
+  if (*data >= end)
+    return -1;
+  *value = *(*data)++ & limit;
+  if (*value < limit)
+    return 0;
+
+  for (int shift = 0; shift <= 28; shift += 7) {
+    if (*data >= end)
+      return -1;
+    unsigned char byte = *(*data)++;
+    *value += (size_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+      return 0;
+  }
+  return -1;
+}
+
+/* Every name and value of a block is copied into strings, -2 once it fills */
+static int copyString(h2_connection_t *conn, const char *string,
+                      size_t length, const char **copy) {
+  if (length > sizeof(conn->strings) - conn->stringsLength)
+    return -2;
+  char *out = conn->strings + conn->stringsLength;
+  memcpy(out, string, length);
+  conn->stringsLength += length;
+  *copy = out;
+  return 0;
+}
+
+static int hpackString(h2_connection_t *conn, const unsigned char **data,
+                       const unsigned char *end, const char **string,
+                       size_t *length) {
+  if (*data >= end)
+    return -1;
+  int huffman = **data & 0x80;
+  size_t encodedLength;
+  if (hpackInteger(data, end, 7, &encodedLength) != 0 ||
+      encodedLength > (size_t)(end - *data))
+    return -1;
+  const unsigned char *encoded = *data;
+  *data += encodedLength;
+  if (!huffman) {
+    *length = encodedLength;
+    return copyString(conn, (const char *)encoded, encodedLength, string);
+  }
+
+  /* The shortest code is 5 bits, so that is as long as it can decode to */
+  size_t room = sizeof(conn->strings) - conn->stringsLength;
+  if (encodedLength * 8 / 5 > room)
+    return -2;
+  char *out = conn->strings + conn->stringsLength;
+  ssize_t decoded = huffmanDecode(encoded, encodedLength, out, room);
+  if (decoded < 0)
+    return -1;
+  conn->stringsLength += decoded;
+  *string = out;
+  *length = decoded;
+  return 0;
+}
+
+/* Index 1 is the newest entry */
+static hpack_entry_t *tableEntry(hpack_table_t *table, size_t index) {
+  if (index == 0 || index > table->count)
+    return NULL;
+  return &table->entries[(table->newest + HPACK_TABLE_ENTRIES - (index - 1)) %
+                         HPACK_TABLE_ENTRIES];
+}
+
+static void evictEntries(hpack_table_t *table, size_t maxSize) {
+  while (table->size > maxSize) {
+    hpack_entry_t *oldest = tableEntry(table, table->count);
+    table->size -=
+        oldest->nameLength + oldest->valueLength + HPACK_ENTRY_OVERHEAD;
+    free(oldest->name);
+    table->count--;
+  }
+}
+
+/* An entry larger than the whole table empties it and is not added */
+static int insertEntry(hpack_table_t *table, const char *name,
+                       size_t nameLength, const char *value,
+                       size_t valueLength) {
+  size_t entrySize = nameLength + valueLength + HPACK_ENTRY_OVERHEAD;
+  if (entrySize > table->maxSize) {
+    evictEntries(table, 0);
+    return 0;
+  }
+  evictEntries(table, table->maxSize - entrySize);
+
+  char *data = malloc(nameLength + valueLength + 1);
+  check_mem(data);
+  memcpy(data, name, nameLength);
+  memcpy(data + nameLength, value, valueLength);
+  table->newest = (table->newest + 1) % HPACK_TABLE_ENTRIES;
+  table->entries[table->newest] =
+      (hpack_entry_t){.name = data,
+                      .nameLength = nameLength,
+                      .value = data + nameLength,
+                      .valueLength = valueLength};
+  table->count++;
+  table->size += entrySize;
+  return 0;
+error:
+  return -1;
+}
+
+/* The name, and the value unless value is NULL, of a static or table entry */
+static int hpackField(h2_connection_t *conn, size_t index, const char **name,
+                      size_t *nameLength, const char **value,
+                      size_t *valueLength) {
+  const char *entryName, *entryValue;
+  size_t entryNameLength, entryValueLength;
+  if (index > 0 && index <= HPACK_STATIC_ENTRIES) {
+    entryName = staticTable[index - 1][0];
+    entryNameLength = strlen(entryName);
+    entryValue = staticTable[index - 1][1];
+    entryValueLength = strlen(entryValue);
+  } else {
+    hpack_entry_t *entry =
+        tableEntry(&conn->table, index - HPACK_STATIC_ENTRIES);
+    if (index == 0 || entry == NULL)
+      return -1;
+    entryName = entry->name;
+    entryNameLength = entry->nameLength;
+    entryValue = entry->value;
+    entryValueLength = entry->valueLength;
+  }
+
+  /* Copied, as a later field of the block can evict the entry */
+  int status = copyString(conn, entryName, entryNameLength, name);
+  *nameLength = entryNameLength;
+  if (status != 0 || value == NULL)
+    return status;
+  *valueLength = entryValueLength;
+  return copyString(conn, entryValue, entryValueLength, value);
+}
+
+/*
+  Decodes a header block into conn->headers. Returns -1 when the block is
+  not valid HPACK and -2 when it decodes to more than the connection takes,
+  either of which leaves the table out of step with the peer's.
+*/
+static int hpackDecode(h2_connection_t *conn, const unsigned char *data,
+                       size_t length, size_t *numHeaders) {
+  const unsigned char *end = data + length;
+  size_t maxHeaders = sizeof(conn->headers) / sizeof(conn->headers[0]);
+  size_t count = 0;
+  conn->stringsLength = 0;
+  while (data < end) {
+    const char *name = NULL, *value = NULL;
+    size_t nameLength = 0, valueLength = 0, index;
+    int status;
+    unsigned char first = *data;
+    if (first & 0x80) {
+      status = hpackInteger(&data, end, 7, &index);
+      if (status == 0)
+        status = hpackField(conn, index, &name, &nameLength, &value,
+                            &valueLength);
+    } else if ((first & 0xe0) == 0x20) {
+      status = hpackInteger(&data, end, 5, &index);
+      if (status != 0 || index > HPACK_TABLE_SIZE)
+        return -1;
+      conn->table.maxSize = index;
+      evictEntries(&conn->table, index);
+      continue;
+    } else {
+      /* A literal, added to the table or not, and with a name or an index */
+      int indexing = (first & 0xc0) == 0x40;
+      status = hpackInteger(&data, end, indexing ? 6 : 4, &index);
+      if (status == 0 && index > 0)
+        status = hpackField(conn, index, &name, &nameLength, NULL, NULL);
+      else if (status == 0)
+        status = hpackString(conn, &data, end, &name, &nameLength);
+      if (status == 0)
+        status = hpackString(conn, &data, end, &value, &valueLength);
+      if (status == 0 && indexing)
+        status = insertEntry(&conn->table, name, nameLength, value,
+                             valueLength);
+    }
+
+    if (status != 0)
+      return status;
+    if (count == maxHeaders)
+      return -2;
+    conn->headers[count++] = (struct phr_header){.name = name,
+                                                 .name_len = nameLength,
+                                                 .value = value,
+                                                 .value_len = valueLength};
+  }
+  *numHeaders = count;
+  return 0;
+}
+
+static void appendBuffer(client_buffer_t *buffer, const void *data,
+                         size_t length) {
+  if (buffer->length + length > buffer->size) {
+    size_t size = max(buffer->size * 2, buffer->length + length);
+    char *grown = realloc(buffer->data, size);
+    check_mem(grown);
+    buffer->data = grown;
+    buffer->size = size;
+  }
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+error:
+  return;
+}
+
+static void hpackPutInteger(client_buffer_t *buffer, unsigned char first,
+                            int prefixBits, size_t value) {
+  unsigned char bytes[16];
+  size_t count = 0;
+  size_t limit = (1u << prefixBits) - 1;
+  if (value < limit) {
+    bytes[count++] = first | value;
+  } else {
+    bytes[count++] = first | limit;
+    for (value -= limit; value >= 0x80; value >>= 7)
+      bytes[count++] = (value & 0x7f) | 0x80;
+    bytes[count++] = value;
+  }
+  appendBuffer(buffer, bytes, count);
+}
+
+/* Never Huffman encoded, a response is sent as it is */
+static void hpackPutString(client_buffer_t *buffer, const char *string,
+                           size_t length) {
+  hpackPutInteger(buffer, 0, 7, length);
+  appendBuffer(buffer, string, length);
+}
+
+/* The index of a static entry with this lowercase name, 0 when none has it */
+static size_t staticNameIndex(const char *name, size_t length) {
+  for (size_t i = 15; i <= HPACK_STATIC_ENTRIES; i++) {
+    if (strlen(staticTable[i - 1][0]) == length &&
+        memcmp(staticTable[i - 1][0], name, length) == 0)
+      return i;
+  }
+  return 0;
+}
+
+static uint32_t getUint32(const unsigned char *data) {
+  return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 |
+         (uint32_t)data[2] << 8 | data[3];
+}
+
+static void putUint32(unsigned char *data, uint32_t value) {
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value;
+}
+
+static void writeFrame(client_t client, h2_frame_type_t type, int flags,
+                       uint32_t streamId, const void *payload, size_t length) {
+  unsigned char header[H2_FRAME_HEADER_LENGTH] = {
+      length >> 16, length >> 8, length, type, flags};
+  putUint32(header + 5, streamId & H2_MAX_WINDOW_SIZE);
+  struct iovec iov[2] = {{.iov_base = header, .iov_len = sizeof(header)},
+                         {.iov_base = (void *)payload, .iov_len = length}};
+  clientOutputWrite(client.output, client.socket, iov, length > 0 ? 2 : 1);
+}
+
+static void writeWindowUpdate(client_t client, uint32_t streamId,
+                              size_t increment) {
+  unsigned char payload[4];
+  putUint32(payload, increment);
+  writeFrame(client, H2_WINDOW_UPDATE, 0, streamId, payload, sizeof(payload));
+}
+
+static void writeSettings(client_t client) {
+  unsigned char payload[12];
+  payload[0] = 0;
+  payload[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  putUint32(payload + 2, HTTP2_MAX_CONCURRENT_STREAMS);
+  payload[6] = 0;
+  payload[7] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+  putUint32(payload + 8, HTTP2_MAX_HEADER_LIST_SIZE);
+  writeFrame(client, H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+static h2_stream_t *findStream(h2_connection_t *conn, uint32_t id) {
+  for (h2_stream_t *stream = conn->streams; stream != NULL;
+       stream = stream->next) {
+    if (stream->id == id)
+      return stream;
+  }
+  return NULL;
+}
+
+/* Streams are kept in the order they were opened, the order they respond */
+static h2_stream_t *openStream(h2_connection_t *conn, uint32_t id) {
+  h2_stream_t *stream = malloc(sizeof(h2_stream_t));
+  check_mem(stream);
+  stream->next = NULL;
+  stream->id = id;
+  stream->state = H2_STREAM_OPEN;
+  stream->window = conn->initialWindow;
+  stream->head = 0;
+  stream->headersSent = 0;
+  clientPipelineInit(&stream->request, conn->maxBodySize, 0);
+  clientOutputInit(&stream->output, 1, conn->highWaterMark);
+
+  h2_stream_t **link = &conn->streams;
+  while (*link != NULL)
+    link = &(*link)->next;
+  *link = stream;
+  conn->streamCount++;
+  return stream;
+error:
+  return NULL;
+}
+
+static void closeStream(h2_connection_t *conn, h2_stream_t *stream) {
+  for (h2_stream_t **link = &conn->streams; *link != NULL;
+       link = &(*link)->next) {
+    if (*link == stream) {
+      *link = stream->next;
+      break;
+    }
+  }
+  conn->streamCount--;
+  clientPipelineFree(&stream->request);
+  clientOutputFree(&stream->output);
+  free(stream);
+}
+
+static void resetStream(h2_connection_t *conn, client_t client, uint32_t id,
+                        h2_error_code_t error) {
+  unsigned char payload[4];
+  putUint32(payload, error);
+  writeFrame(client, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+  h2_stream_t *stream = findStream(conn, id);
+  if (stream != NULL)
+    closeStream(conn, stream);
+}
+
+static int appendRequest(client_pipeline_t *request, const char *data,
+                         size_t length) {
+  if (request->length + length > request->size) {
+    size_t size = max(request->size * 2, request->length + length);
+    char *grown = realloc(request->data, size);
+    check_mem(grown);
+    request->data = grown;
+    request->size = size;
+  }
+  memcpy(request->data + request->length, data, length);
+  request->length += length;
+  return 0;
+error:
+  return -1;
+}
+
+static int headerIs(struct phr_header *header, const char *name) {
+  return header->name_len == strlen(name) &&
+         memcmp(header->name, name, header->name_len) == 0;
+}
+
+static int validValue(struct phr_header *header) {
+  for (size_t i = 0; i < header->value_len; i++) {
+    char c = header->value[i];
+    if (c == '\0' || c == '\r' || c == '\n')
+      return 0;
+  }
+  return 1;
+}
+
+/*
+  A field the HTTP/1.1 head could not carry as it is, or that only means
+  something to a single HTTP/1.1 connection, makes the request malformed.
+*/
+static int validField(struct phr_header *header) {
+  if (header->name_len == 0 || !validValue(header))
+    return 0;
+  for (size_t i = 0; i < header->name_len; i++) {
+    unsigned char c = header->name[i];
+    if (c <= ' ' || c >= 0x7f || c == ':' || isupper(c))
+      return 0;
+  }
+  return !headerIs(header, "connection") && !headerIs(header, "keep-alive") &&
+         !headerIs(header, "proxy-connection") &&
+         !headerIs(header, "transfer-encoding") &&
+         !headerIs(header, "upgrade");
+}
+
+/* The router looks headers up by their HTTP/1.1 spelling, Content-Type */
+static void appendHeaderName(client_pipeline_t *request, const char *name,
+                             size_t length) {
+  size_t start = request->length;
+  if (appendRequest(request, name, length) != 0)
+    return;
+  for (size_t i = 0; i < length; i++) {
+    if (i == 0 || name[i - 1] == '-')
+      request->data[start + i] = toupper((unsigned char)name[i]);
+  }
+}
+
+/*
+  Writes the decoded header block out as the stream's HTTP/1.1 head. Cookie
+  fields, which HTTP/2 lets a client split up, are joined back into one.
+*/
+static int writeRequestHead(h2_connection_t *conn, h2_stream_t *stream,
+                            size_t numHeaders) {
+  struct phr_header *method = NULL, *path = NULL, *authority = NULL;
+  int regular = 0, cookies = 0;
+  for (size_t i = 0; i < numHeaders; i++) {
+    struct phr_header *header = &conn->headers[i];
+    if (header->name_len > 0 && header->name[0] == ':') {
+      check_silent(!regular, "Pseudo-header after a regular one");
+      if (headerIs(header, ":method"))
+        method = header;
+      else if (headerIs(header, ":path"))
+        path = header;
+      else if (headerIs(header, ":authority"))
+        authority = header;
+      else
+        check_silent(headerIs(header, ":scheme"), "Unknown pseudo-header");
+      continue;
+    }
+    regular = 1;
+    check_silent(validField(header), "Malformed header field");
+    cookies += headerIs(header, "cookie");
+  }
+  check_silent(method != NULL && path != NULL && path->value_len > 0,
+               "Request without a method or path");
+  check_silent(memchr(method->value, ' ', method->value_len) == NULL &&
+                   memchr(path->value, ' ', path->value_len) == NULL,
+               "Malformed request line");
+
+  client_pipeline_t *request = &stream->request;
+  stream->head = method->value_len == 4 &&
+                 memcmp(method->value, "HEAD", 4) == 0;
+  appendRequest(request, method->value, method->value_len);
+  appendRequest(request, " ", 1);
+  appendRequest(request, path->value, path->value_len);
+  appendRequest(request, " HTTP/1.1\r\n", 11);
+  if (authority != NULL && validValue(authority)) {
+    appendRequest(request, "Host: ", 6);
+    appendRequest(request, authority->value, authority->value_len);
+    appendRequest(request, "\r\n", 2);
+  }
+
+  for (size_t i = 0; i < numHeaders; i++) {
+    struct phr_header *header = &conn->headers[i];
+    if (header->name[0] == ':' || headerIs(header, "cookie") ||
+        (authority != NULL && headerIs(header, "host")))
+      continue;
+    appendHeaderName(request, header->name, header->name_len);
+    appendRequest(request, ": ", 2);
+    appendRequest(request, header->value, header->value_len);
+    appendRequest(request, "\r\n", 2);
+  }
+
+  if (cookies > 0) {
+    appendRequest(request, "Cookie: ", 8);
+    for (size_t i = 0; i < numHeaders; i++) {
+      struct phr_header *header = &conn->headers[i];
+      if (!headerIs(header, "cookie"))
+        continue;
+      appendRequest(request, header->value, header->value_len);
+      if (--cookies > 0)
+        appendRequest(request, "; ", 2);
+    }
+    appendRequest(request, "\r\n", 2);
+  }
+
+  check(appendRequest(request, "\r\n", 2) == 0, "Could not write request");
+  request->headLength = request->length;
+  return 0;
+error:
+  return -1;
+}
+
+/* The stream's request is complete, so it is served and starts responding */
+static void serveStream(h2_connection_t *conn, h2_stream_t *stream,
+                        client_t client, router_t *baseRouter) {
+  client_t streamClient = client;
+  streamClient.pipeline = &stream->request;
+  streamClient.output = &stream->output;
+  streamClient.stream = stream;
+  streamClient.websocket = NULL;
+  streamClient.subscriber = NULL;
+  streamClient.keepAlive = 1;
+  stream->state = H2_STREAM_RESPONDING;
+  serveClientRequest(streamClient, baseRouter);
+  clientPipelineFree(&stream->request);
+
+  /* Nothing is sent for a request that could not be built or queued */
+  if (stream->output.length == 0)
+    resetStream(conn, client, stream->id, H2_INTERNAL_ERROR);
+}
+
+/*
+  Turns the HTTP/1.1 head at the front of the stream's output into a header
+  block, dropping the fields HTTP/2 has no place for.
+*/
+static int writeResponseHeaders(h2_connection_t *conn, h2_stream_t *stream,
+                                client_t client) {
+  char scratch[H2_FRAME_SIZE];
+  const char *data;
+  ssize_t length =
+      clientOutputPeek(&stream->output, &data, scratch, sizeof(scratch));
+  check(length > 0, "Response without a head");
+
+  int minorVersion, status;
+  const char *message;
+  size_t messageLength;
+  struct phr_header headers[100];
+  size_t numHeaders = sizeof(headers) / sizeof(headers[0]);
+  int headLength =
+      phr_parse_response(data, length, &minorVersion, &status, &message,
+                         &messageLength, headers, &numHeaders, 0);
+  check(headLength > 0, "Could not parse response head");
+
+  client_buffer_t *block = &conn->encoded;
+  block->length = 0;
+  char statusString[8];
+  snprintf(statusString, sizeof(statusString), "%03d", status);
+  size_t statusIndex = 0;
+  for (size_t i = 8; i <= 14; i++) {
+    if (strcmp(staticTable[i - 1][1], statusString) == 0)
+      statusIndex = i;
+  }
+  if (statusIndex > 0) {
+    hpackPutInteger(block, 0x80, 7, statusIndex);
+  } else {
+    hpackPutInteger(block, 0x00, 4, 8);
+    hpackPutString(block, statusString, strlen(statusString));
+  }
+
+  for (size_t i = 0; i < numHeaders; i++) {
+    char name[256];
+    if (headers[i].name_len >= sizeof(name))
+      continue;
+    for (size_t j = 0; j < headers[i].name_len; j++)
+      name[j] = tolower((unsigned char)headers[i].name[j]);
+    struct phr_header field = {.name = name,
+                               .name_len = headers[i].name_len,
+                               .value = headers[i].value,
+                               .value_len = headers[i].value_len};
+    if (!validField(&field))
+      continue;
+
+    /* Literals without indexing, by the static table's name when it has it */
+    size_t index = staticNameIndex(name, field.name_len);
+    hpackPutInteger(block, 0x00, 4, index);
+    if (index == 0)
+      hpackPutString(block, name, field.name_len);
+    hpackPutString(block, field.value, field.value_len);
+  }
+
+  clientOutputConsume(&stream->output, headLength);
+  if (stream->head)
+    clientOutputConsume(&stream->output, stream->output.length);
+
+  /* One frame after another, nothing can come between them */
+  int endStream = stream->output.length == 0 ? H2_END_STREAM : 0;
+  size_t offset = 0;
+  do {
+    size_t fragment = min(block->length - offset, (size_t)conn->maxFrameSize);
+    int flags = offset + fragment == block->length ? H2_END_HEADERS : 0;
+    writeFrame(client, offset == 0 ? H2_HEADERS : H2_CONTINUATION,
+               flags | (offset == 0 ? endStream : 0), stream->id,
+               block->data + offset, fragment);
+    offset += fragment;
+  } while (offset < block->length);
+  stream->headersSent = 1;
+  return 0;
+error:
+  return -1;
+}
+
+/*
+  Sends as much of a response as the windows and the connection's output
+  queue allow. Returns 1 once it has all been sent, -1 when it cannot be.
+*/
+static int writeResponse(h2_connection_t *conn, h2_stream_t *stream,
+                         client_t client) {
+  if (!stream->headersSent && writeResponseHeaders(conn, stream, client) != 0)
+    return -1;
+
+  char scratch[H2_FRAME_SIZE];
+  while (stream->output.length > 0 && conn->window > 0 &&
+         stream->window > 0 &&
+         client.output->length <= conn->highWaterMark) {
+    const char *data;
+    ssize_t length =
+        clientOutputPeek(&stream->output, &data, scratch, sizeof(scratch));
+    if (length <= 0)
+      return -1;
+
+    size_t window = min(conn->window, stream->window);
+    size_t frameLength = min((size_t)length, sizeof(scratch));
+    frameLength = min(frameLength, window);
+    int flags = frameLength == stream->output.length ? H2_END_STREAM : 0;
+    writeFrame(client, H2_DATA, flags, stream->id, data, frameLength);
+    clientOutputConsume(&stream->output, frameLength);
+    conn->window -= frameLength;
+    stream->window -= frameLength;
+  }
+  return stream->output.length == 0;
+}
+
+static void writeResponses(h2_connection_t *conn, client_t client) {
+  h2_stream_t *stream = conn->streams;
+  while (stream != NULL) {
+    h2_stream_t *next = stream->next;
+    int sent = stream->state == H2_STREAM_RESPONDING
+                   ? writeResponse(conn, stream, client)
+                   : 0;
+    if (sent < 0)
+      resetStream(conn, client, stream->id, H2_INTERNAL_ERROR);
+    else if (sent > 0)
+      closeStream(conn, stream);
+    stream = next;
+  }
+}
+
+static h2_error_code_t applySettings(h2_connection_t *conn,
+                                     const unsigned char *payload,
+                                     size_t length) {
+  if (length % 6 != 0)
+    return H2_FRAME_SIZE_ERROR;
+  for (size_t i = 0; i < length; i += 6) {
+    uint16_t id = payload[i] << 8 | payload[i + 1];
+    uint32_t value = getUint32(payload + i + 2);
+    switch (id) {
+    case H2_SETTINGS_ENABLE_PUSH:
+      if (value > 1)
+        return H2_PROTOCOL_ERROR;
+      break;
+    case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+      if (value > H2_MAX_WINDOW_SIZE)
+        return H2_FLOW_CONTROL_ERROR;
+      /* Open streams' windows move by as much as the setting does */
+      for (h2_stream_t *stream = conn->streams; stream != NULL;
+           stream = stream->next) {
+        stream->window += (int64_t)value - conn->initialWindow;
+        if (stream->window > H2_MAX_WINDOW_SIZE)
+          return H2_FLOW_CONTROL_ERROR;
+      }
+      conn->initialWindow = value;
+      break;
+    case H2_SETTINGS_MAX_FRAME_SIZE:
+      if (value < H2_FRAME_SIZE || value > 0xffffff)
+        return H2_PROTOCOL_ERROR;
+      conn->maxFrameSize = value;
+      break;
+    default:
+      break;
+    }
+  }
+  return H2_NO_ERROR;
+}
+
+/* Strips a PADDED frame's padding, NULL when there is more than the frame */
+static const unsigned char *unpad(const unsigned char *payload,
+                                  size_t *length, int flags) {
+  if ((flags & H2_PADDED) == 0)
+    return payload;
+  if (*length == 0 || (size_t)payload[0] + 1 > *length)
+    return NULL;
+  *length -= (size_t)payload[0] + 1;
+  return payload + 1;
+}
+
+static h2_error_code_t endHeaders(h2_connection_t *conn, client_t client,
+                                  router_t *baseRouter, uint32_t id,
+                                  int flags) {
+  size_t numHeaders = 0;
+  int decoded = hpackDecode(conn, (const unsigned char *)conn->block.data,
+                            conn->block.length, &numHeaders);
+  if (decoded == -2)
+    return H2_ENHANCE_YOUR_CALM;
+  if (decoded != 0)
+    return H2_COMPRESSION_ERROR;
+
+  /* Trailers, which end the request and are otherwise ignored */
+  h2_stream_t *stream = findStream(conn, id);
+  if (stream != NULL && stream->state == H2_STREAM_OPEN) {
+    if ((flags & H2_END_STREAM) == 0)
+      return H2_PROTOCOL_ERROR;
+    serveStream(conn, stream, client, baseRouter);
+    return H2_NO_ERROR;
+  }
+  if (stream != NULL || id <= conn->lastStreamId)
+    return H2_STREAM_CLOSED;
+  if (id % 2 == 0)
+    return H2_PROTOCOL_ERROR;
+
+  conn->lastStreamId = id;
+  if (conn->goaway)
+    return H2_NO_ERROR;
+  if (conn->streamCount >= HTTP2_MAX_CONCURRENT_STREAMS) {
+    resetStream(conn, client, id, H2_REFUSED_STREAM);
+    return H2_NO_ERROR;
+  }
+
+  stream = openStream(conn, id);
+  if (stream == NULL) {
+    resetStream(conn, client, id, H2_REFUSED_STREAM);
+    return H2_NO_ERROR;
+  }
+  if (writeRequestHead(conn, stream, numHeaders) != 0)
+    resetStream(conn, client, id, H2_PROTOCOL_ERROR);
+  else if (flags & H2_END_STREAM)
+    serveStream(conn, stream, client, baseRouter);
+  return H2_NO_ERROR;
+}
+
+/* HEADERS and any CONTINUATION frames are collected into one block */
+static h2_error_code_t receiveBlock(h2_connection_t *conn, client_t client,
+                                    router_t *baseRouter, uint32_t id,
+                                    const unsigned char *fragment,
+                                    size_t length, int flags) {
+  if (conn->block.length + length > HTTP2_MAX_HEADER_LIST_SIZE)
+    return H2_ENHANCE_YOUR_CALM;
+  appendBuffer(&conn->block, fragment, length);
+  if ((flags & H2_END_HEADERS) == 0)
+    return H2_NO_ERROR;
+  conn->continuationId = 0;
+  return endHeaders(conn, client, baseRouter, id, conn->continuationFlags);
+}
+
+static h2_error_code_t receiveHeaders(h2_connection_t *conn, client_t client,
+                                      router_t *baseRouter, uint32_t id,
+                                      const unsigned char *payload,
+                                      size_t length, int flags) {
+  if (id == 0)
+    return H2_PROTOCOL_ERROR;
+  payload = unpad(payload, &length, flags);
+  if (payload == NULL)
+    return H2_PROTOCOL_ERROR;
+  if (flags & H2_PRIORITY_FLAG) {
+    if (length < 5)
+      return H2_FRAME_SIZE_ERROR;
+    payload += 5;
+    length -= 5;
+  }
+  conn->block.length = 0;
+  conn->continuationId = id;
+  conn->continuationFlags = flags;
+  return receiveBlock(conn, client, baseRouter, id, payload, length, flags);
+}
+
+static h2_error_code_t receiveData(h2_connection_t *conn, client_t client,
+                                   router_t *baseRouter, uint32_t id,
+                                   const unsigned char *payload,
+                                   size_t length, int flags) {
+  if (id == 0 || id > conn->lastStreamId)
+    return H2_PROTOCOL_ERROR;
+
+  /* The whole frame counts against the connection's window, padding too */
+  conn->unacknowledged += length;
+  size_t frameLength = length;
+  payload = unpad(payload, &length, flags);
+  if (payload == NULL)
+    return H2_PROTOCOL_ERROR;
+
+  /* Frames the peer sent before it saw a stream reset are dropped */
+  h2_stream_t *stream = findStream(conn, id);
+  if (stream == NULL)
+    return H2_NO_ERROR;
+  if (stream->state != H2_STREAM_OPEN) {
+    resetStream(conn, client, id, H2_STREAM_CLOSED);
+    return H2_NO_ERROR;
+  }
+
+  client_pipeline_t *request = &stream->request;
+  if (request->bodyLength + length > request->maxBodySize ||
+      appendRequest(request, (const char *)payload, length) != 0) {
+    resetStream(conn, client, id, H2_ENHANCE_YOUR_CALM);
+    return H2_NO_ERROR;
+  }
+  request->bodyLength += length;
+
+  if (flags & H2_END_STREAM)
+    serveStream(conn, stream, client, baseRouter);
+  else if (frameLength > 0)
+    writeWindowUpdate(client, id, frameLength);
+  return H2_NO_ERROR;
+}
+
+static h2_error_code_t receiveWindowUpdate(h2_connection_t *conn,
+                                           client_t client, uint32_t id,
+                                           const unsigned char *payload,
+                                           size_t length) {
+  if (length != 4)
+    return H2_FRAME_SIZE_ERROR;
+  uint32_t increment = getUint32(payload) & H2_MAX_WINDOW_SIZE;
+  if (id == 0) {
+    conn->window += increment;
+    return increment == 0 || conn->window > H2_MAX_WINDOW_SIZE
+               ? H2_FLOW_CONTROL_ERROR
+               : H2_NO_ERROR;
+  }
+
+  h2_stream_t *stream = findStream(conn, id);
+  if (stream == NULL)
+    return id > conn->lastStreamId ? H2_PROTOCOL_ERROR : H2_NO_ERROR;
+  stream->window += increment;
+  if (increment == 0)
+    resetStream(conn, client, id, H2_PROTOCOL_ERROR);
+  else if (stream->window > H2_MAX_WINDOW_SIZE)
+    resetStream(conn, client, id, H2_FLOW_CONTROL_ERROR);
+  return H2_NO_ERROR;
+}
+
+static h2_error_code_t receiveFrame(h2_connection_t *conn, client_t client,
+                                    router_t *baseRouter,
+                                    const unsigned char *frame,
+                                    size_t length) {
+  h2_frame_type_t type = frame[3];
+  int flags = frame[4];
+  uint32_t id = getUint32(frame + 5) & H2_MAX_WINDOW_SIZE;
+  const unsigned char *payload = frame + H2_FRAME_HEADER_LENGTH;
+
+  /* A header block is never interleaved with any other frame */
+  if (conn->continuationId != 0 &&
+      (type != H2_CONTINUATION || id != conn->continuationId))
+    return H2_PROTOCOL_ERROR;
+
+  switch (type) {
+  case H2_DATA:
+    return receiveData(conn, client, baseRouter, id, payload, length, flags);
+  case H2_HEADERS:
+    return receiveHeaders(conn, client, baseRouter, id, payload, length,
+                          flags);
+  case H2_CONTINUATION:
+    if (conn->continuationId == 0)
+      return H2_PROTOCOL_ERROR;
+    return receiveBlock(conn, client, baseRouter, id, payload, length, flags);
+  case H2_PRIORITY:
+    return id == 0 ? H2_PROTOCOL_ERROR : H2_NO_ERROR;
+  case H2_RST_STREAM: {
+    if (id == 0 || id > conn->lastStreamId)
+      return H2_PROTOCOL_ERROR;
+    if (length != 4)
+      return H2_FRAME_SIZE_ERROR;
+    h2_stream_t *stream = findStream(conn, id);
+    if (stream != NULL)
+      closeStream(conn, stream);
+    return H2_NO_ERROR;
+  }
+  case H2_SETTINGS: {
+    if (id != 0)
+      return H2_PROTOCOL_ERROR;
+    if (flags & H2_ACK)
+      return length == 0 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+    h2_error_code_t error = applySettings(conn, payload, length);
+    if (error == H2_NO_ERROR)
+      writeFrame(client, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+    return error;
+  }
+  case H2_PING:
+    if (id != 0)
+      return H2_PROTOCOL_ERROR;
+    if (length != 8)
+      return H2_FRAME_SIZE_ERROR;
+    if ((flags & H2_ACK) == 0)
+      writeFrame(client, H2_PING, H2_ACK, 0, payload, length);
+    return H2_NO_ERROR;
+  case H2_GOAWAY:
+    /* The streams the peer has opened are still answered */
+    conn->goaway = 1;
+    return id == 0 ? H2_NO_ERROR : H2_PROTOCOL_ERROR;
+  case H2_WINDOW_UPDATE:
+    return receiveWindowUpdate(conn, client, id, payload, length);
+  case H2_PUSH_PROMISE:
+    return H2_PROTOCOL_ERROR;
+  default:
+    return H2_NO_ERROR;
+  }
+}
+
+/*
+  Nagle's algorithm would hold back the end of a window's worth of DATA
+  until the peer acknowledged the rest, which delays the WINDOW_UPDATE that
+  lets the next window go.
+*/
+static h2_connection_t *createConnection(client_t client, server_t *server) {
+  int flag = 1;
+  if (setsockopt(client.socket, IPPROTO_TCP, TCP_NODELAY, &flag,
+                 sizeof(flag)) < 0)
+    log_warn("setsockopt() failed");
+
+  h2_connection_t *conn = malloc(sizeof(h2_connection_t));
+  check_mem(conn);
+  conn->streams = NULL;
+  conn->streamCount = 0;
+  conn->lastStreamId = 0;
+  conn->window = H2_WINDOW_SIZE;
+  conn->initialWindow = H2_WINDOW_SIZE;
+  conn->maxFrameSize = H2_FRAME_SIZE;
+  conn->unacknowledged = 0;
+  conn->maxBodySize = server->maxBodySize;
+  conn->highWaterMark = server->outputHighWaterMark;
+  conn->preface = 0;
+  conn->goaway = 0;
+  conn->continuationId = 0;
+  conn->continuationFlags = 0;
+  conn->block = (client_buffer_t){.data = NULL, .length = 0, .size = 0};
+  conn->encoded = (client_buffer_t){.data = NULL, .length = 0, .size = 0};
+  memset(&conn->table, 0, sizeof(conn->table));
+  conn->table.maxSize = HPACK_TABLE_SIZE;
+  conn->stringsLength = 0;
+  return conn;
+error:
+  return NULL;
+}
+
+/* No stream is open, so closing the connection loses nothing */
+int http2Idle(h2_connection_t *conn) { return conn->streams == NULL; }
+
+void http2Free(h2_connection_t *conn) {
+  while (conn->streams != NULL)
+    closeStream(conn, conn->streams);
+  evictEntries(&conn->table, 0);
+  free(conn->block.data);
+  free(conn->encoded.data);
+  free(conn);
+}
+
+/* 1 when data starts with the preface, -2 while it still could, else 0 */
+int http2Preface(client_pipeline_t *pipeline) {
+  size_t length = min(pipeline->length, (size_t)H2_PREFACE_LENGTH);
+  if (length > 0 && memcmp(pipeline->data, H2_PREFACE, length) != 0)
+    return 0;
+  return length == H2_PREFACE_LENGTH ? 1 : -2;
+}
+
+/* For a client that starts with the preface, which is read with its frames */
+h2_connection_t *http2Open(client_t client, server_t *server) {
+  h2_connection_t *conn = createConnection(client, server);
+  if (conn != NULL)
+    writeSettings(client);
+  return conn;
+}
+
+static ssize_t decodeBase64Url(const char *data, size_t length,
+                               unsigned char *out, size_t size) {
+  uint32_t bits = 0;
+  int bitCount = 0;
+  size_t written = 0;
+  for (size_t i = 0; i < length && data[i] != '='; i++) {
+    char c = data[i];
+    int value = c >= 'A' && c <= 'Z'   ? c - 'A'
+                : c >= 'a' && c <= 'z' ? c - 'a' + 26
+                : c >= '0' && c <= '9' ? c - '0' + 52
+                : c == '-'             ? 62
+                : c == '_'             ? 63
+                                       : -1;
+    if (value < 0)
+      return -1;
+    bits = bits << 6 | value;
+    bitCount += 6;
+    if (bitCount >= 8) {
+      bitCount -= 8;
+      if (written == size)
+        return -1;
+      out[written++] = bits >> bitCount;
+    }
+  }
+  return written;
+}
+
+static int headerHasToken(struct phr_header *header, const char *token) {
+  size_t tokenLength = strlen(token);
+  const char *value = header->value;
+  const char *end = value + header->value_len;
+  while (value < end) {
+    while (value < end && (*value == ' ' || *value == ','))
+      value++;
+    const char *stop = value;
+    while (stop < end && *stop != ',' && *stop != ' ')
+      stop++;
+    if ((size_t)(stop - value) == tokenLength &&
+        strncasecmp(value, token, tokenLength) == 0)
+      return 1;
+    value = stop;
+  }
+  return 0;
+}
+
+/*
+  Switches the connection to HTTP/2 when the request at the front of its
+  pipeline asks to, answering that request as stream 1. A request with a
+  body is left to HTTP/1.1, as the body would have to be read first.
+*/
+h2_connection_t *http2Upgrade(client_t client, server_t *server,
+                              router_t *baseRouter) {
+  client_pipeline_t *pipeline = client.pipeline;
+  if (pipeline->bodyLength > 0 || pipeline->chunked != CHUNKED_NONE)
+    return NULL;
+
+  const char *method, *path;
+  size_t methodLen, pathLen;
+  int minorVersion;
+  struct phr_header headers[100];
+  size_t numHeaders = sizeof(headers) / sizeof(headers[0]);
+  if (phr_parse_request(pipeline->data, pipeline->headLength, &method,
+                        &methodLen, &path, &pathLen, &minorVersion, headers,
+                        &numHeaders, 0) <= 0)
+    return NULL;
+
+  int upgrade = 0;
+  struct phr_header *settings = NULL;
+  for (size_t i = 0; i < numHeaders; i++) {
+    if (headers[i].name_len == 7 &&
+        strncasecmp(headers[i].name, "Upgrade", 7) == 0)
+      upgrade = headerHasToken(&headers[i], "h2c");
+    else if (headers[i].name_len == 14 &&
+             strncasecmp(headers[i].name, "HTTP2-Settings", 14) == 0)
+      settings = &headers[i];
+  }
+  if (!upgrade || settings == NULL)
+    return NULL;
+
+  /* Settings the peer cannot have meant turn the upgrade down */
+  unsigned char payload[256];
+  ssize_t payloadLength = decodeBase64Url(settings->value, settings->value_len,
+                                          payload, sizeof(payload));
+  check_silent(payloadLength >= 0, "Invalid HTTP2-Settings");
+  h2_connection_t *conn = createConnection(client, server);
+  check_silent(conn != NULL, "No connection");
+  if (applySettings(conn, payload, payloadLength) != H2_NO_ERROR) {
+    http2Free(conn);
+    return NULL;
+  }
+
+  h2_stream_t *stream = openStream(conn, 1);
+  if (stream == NULL ||
+      appendRequest(&stream->request, pipeline->data,
+                    pipeline->headLength) != 0) {
+    http2Free(conn);
+    return NULL;
+  }
+  stream->request.headLength = pipeline->headLength;
+  stream->head = methodLen == 4 && memcmp(method, "HEAD", 4) == 0;
+  conn->lastStreamId = 1;
+  clientPipelineConsume(pipeline);
+
+  char *switching = "HTTP/1.1 101 Switching Protocols\r\n"
+                    "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+  struct iovec iov = {.iov_base = switching, .iov_len = strlen(switching)};
+  clientOutputWrite(client.output, client.socket, &iov, 1);
+  writeSettings(client);
+  serveStream(conn, stream, client, baseRouter);
+  writeResponses(conn, client);
+  return conn;
+error:
+  return NULL;
+}
+
+/*
+  Handles the complete frames in the pipeline and sends what responses it
+  can. Returns how many frames it handled, or -1 once the connection is to
+  be closed, and sets reading while a frame or request is incomplete.
+*/
+int http2Serve(h2_connection_t *conn, client_t client, router_t *baseRouter,
+               int *reading) {
+  client_pipeline_t *pipeline = client.pipeline;
+  h2_error_code_t error = H2_NO_ERROR;
+  size_t offset = 0;
+  int frames = 0;
+
+  if (!conn->preface) {
+    int preface = http2Preface(pipeline);
+    if (preface == -2) {
+      *reading = 1;
+      return 0;
+    }
+    if (preface == 0)
+      error = H2_PROTOCOL_ERROR;
+    else
+      offset = H2_PREFACE_LENGTH;
+    conn->preface = 1;
+  }
+
+  pipeline->frameLength = 0;
+  while (error == H2_NO_ERROR &&
+         pipeline->length - offset >= H2_FRAME_HEADER_LENGTH) {
+    const unsigned char *frame = (unsigned char *)pipeline->data + offset;
+    size_t length = frame[0] << 16 | frame[1] << 8 | frame[2];
+    if (length > H2_FRAME_SIZE) {
+      error = H2_FRAME_SIZE_ERROR;
+      break;
+    }
+    if (pipeline->length - offset < H2_FRAME_HEADER_LENGTH + length) {
+      pipeline->frameLength = H2_FRAME_HEADER_LENGTH + length;
+      break;
+    }
+    error = receiveFrame(conn, client, baseRouter, frame, length);
+    offset += H2_FRAME_HEADER_LENGTH + length;
+    frames++;
+  }
+
+  if (error != H2_NO_ERROR) {
+    unsigned char payload[8];
+    putUint32(payload, conn->lastStreamId);
+    putUint32(payload + 4, error);
+    writeFrame(client, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    return -1;
+  }
+  if (offset > 0)
+    memmove(pipeline->data, pipeline->data + offset,
+            pipeline->length - offset);
+  pipeline->length -= offset;
+
+  /* The connection's window is given back once for every read */
+  if (conn->unacknowledged > 0)
+    writeWindowUpdate(client, 0, conn->unacknowledged);
+  conn->unacknowledged = 0;
+  writeResponses(conn, client);
+
+  *reading = pipeline->length > 0 || conn->continuationId != 0;
+  for (h2_stream_t *stream = conn->streams; stream != NULL;
+       stream = stream->next)
+    *reading |= stream->state == H2_STREAM_OPEN;
+
+  /* After a GOAWAY the connection lasts as long as its streams */
+  if (conn->goaway && conn->streams == NULL)
+    return -1;
+  return frames;
+}
@@ -0,0 +1,314 @@
+#include <express.h>
+#include <zlib.h>
+
+/*
+
+Compresses dynamic responses for clients that take gzip or deflate.
+
+Bodies passed to res->send, res->sendf and res->json are compressed in one
+go and sent with a Content-Length. Bodies written with res->write are
+compressed as they are written, each write flushed so the client is never
+kept waiting on the compressor. Files are left to expressStatic, which has
+precompressed variants of its own.
+
+*/
+
+void expressResSendBuffer(response_t *res, const char *body, size_t bodyLen);
+
+typedef enum compression_coding_t {
+  COMPRESSION_NONE = -1,
+  COMPRESSION_GZIP,
+  COMPRESSION_DEFLATE,
+  COMPRESSION_CODINGS
+} compression_coding_t;
+
+static const char *codingNames[COMPRESSION_CODINGS] = {"gzip", "deflate"};
+
+/* Set up once per thread and reset for each response, deflateInit is slow */
+typedef struct compressor_t {
+  z_stream streams[COMPRESSION_CODINGS];
+  int initialised[COMPRESSION_CODINGS];
+  int busy;
+} compressor_t;
+
+/* The response's own blocks, which the compressing ones send through */
+typedef struct compression_t {
+  response_t *res;
+  compression_coding_t coding;
+  size_t minLength;
+  z_stream *stream;
+  sendBlock send;
+  sendfBlock sendf;
+  sendBlock json;
+  writeBlock write;
+  endBlock flushHeaders;
+  endBlock end;
+} compression_t;
+
+static pthread_key_t compressorKey;
+static pthread_once_t compressorOnce = PTHREAD_ONCE_INIT;
+
+static void freeCompressor(void *value) {
+  compressor_t *compressor = value;
+  for (int i = 0; i < COMPRESSION_CODINGS; i++) {
+    if (compressor->initialised[i])
+      deflateEnd(&compressor->streams[i]);
+  }
+  free(compressor);
+}
+
+static void createCompressorKey() {
+  pthread_key_create(&compressorKey, freeCompressor);
+}
+
+/* A thread serves one response at a time, so a stream is rarely busy */
+static z_stream *acquireStream(compression_coding_t coding) {
+  pthread_once(&compressorOnce, createCompressorKey);
+  compressor_t *compressor = pthread_getspecific(compressorKey);
+  if (compressor == NULL) {
+    compressor = calloc(1, sizeof(compressor_t));
+    check_mem(compressor);
+    pthread_setspecific(compressorKey, compressor);
+  }
+  check_silent(!compressor->busy, "Compressor in use");
+
+  z_stream *stream = &compressor->streams[coding];
+  if (compressor->initialised[coding]) {
+    deflateReset(stream);
+  } else {
+    /* 16 more window bits asks zlib for a gzip header and trailer */
+    int windowBits = coding == COMPRESSION_GZIP ? 15 + 16 : 15;
+    check(deflateInit2(stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits,
+                       8, Z_DEFAULT_STRATEGY) == Z_OK,
+          "deflateInit2() failed");
+    compressor->initialised[coding] = 1;
+  }
+  compressor->busy = 1;
+  return stream;
+error:
+  return NULL;
+}
+
+static void releaseStream() {
+  compressor_t *compressor = pthread_getspecific(compressorKey);
+  if (compressor != NULL)
+    compressor->busy = 0;
+}
+
+static int compressibleType(const char *contentType) {
+  /* Sent as text/html when no type is set */
+  if (contentType == NULL || strncasecmp(contentType, "text/", 5) == 0)
+    return 1;
+
+  static const char *types[] = {"application/json", "application/javascript",
+                                "application/xml", "image/svg+xml"};
+  size_t typeLen = strcspn(contentType, "; ");
+  for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+    if (strlen(types[i]) == typeLen &&
+        strncasecmp(contentType, types[i], typeLen) == 0)
+      return 1;
+  }
+
+  /* Suffixed types, such as application/vnd.api+json */
+  return (typeLen > 5 &&
+          strncasecmp(contentType + typeLen - 5, "+json", 5) == 0) ||
+         (typeLen > 4 &&
+          strncasecmp(contentType + typeLen - 4, "+xml", 4) == 0);
+}
+
+/*
+  Whether the body about to be sent should be compressed. Any response that
+  could have been compressed varies with Accept-Encoding, even when this
+  client did not ask for it.
+*/
+static int shouldCompress(compression_t *compression) {
+  response_t *res = compression->res;
+  if (res->headersSent || res->didSend ||
+      !compressibleType(expressResGet(res, "Content-Type")))
+    return 0;
+  expressResSet(res, "Vary", "Accept-Encoding");
+  return compression->coding != COMPRESSION_NONE && res->status != 204 &&
+         res->status != 206 && res->status != 304 &&
+         expressResGet(res, "Content-Encoding") == NULL &&
+         expressResGet(res, "Content-Length") == NULL;
+}
+
+static void compressSend(compression_t *compression, const char *body,
+                         size_t length) {
+  response_t *res = compression->res;
+  if (!shouldCompress(compression) || length < compression->minLength ||
+      length > UINT_MAX) {
+    compression->send(body);
+    return;
+  }
+
+  char *compressed = NULL;
+  z_stream *stream = acquireStream(compression->coding);
+  check_silent(stream != NULL, "No compressor");
+  uLong bound = deflateBound(stream, length);
+  compressed = malloc(bound);
+  check_mem(compressed);
+
+  stream->next_in = (Bytef *)body;
+  stream->avail_in = (uInt)length;
+  stream->next_out = (Bytef *)compressed;
+  stream->avail_out = (uInt)bound;
+  check(deflate(stream, Z_FINISH) == Z_STREAM_END, "deflate() failed");
+  releaseStream();
+
+  expressResSet(res, "Content-Encoding", codingNames[compression->coding]);
+  expressResSendBuffer(res, compressed, stream->total_out);
+  free(compressed);
+  return;
+error:
+  if (stream != NULL)
+    releaseStream();
+  free(compressed);
+  compression->send(body);
+}
+
+/* Compresses data and writes out whatever the compressor hands back */
+static int deflateWrite(compression_t *compression, const char *data,
+                        size_t length, int flush) {
+  z_stream *stream = compression->stream;
+  unsigned char out[16384];
+  int writable = 1;
+  stream->next_in = (Bytef *)data;
+  stream->avail_in = (uInt)length;
+  do {
+    stream->next_out = out;
+    stream->avail_out = sizeof(out);
+    int status = deflate(stream, flush);
+    check(status == Z_OK || status == Z_STREAM_END || status == Z_BUF_ERROR,
+          "deflate() failed");
+    size_t produced = sizeof(out) - stream->avail_out;
+    if (produced > 0)
+      writable = compression->write((const char *)out, produced);
+  } while (stream->avail_out == 0);
+  return writable;
+error:
+  return 0;
+}
+
+/* The first write decides, as it is the one that sends the headers */
+static int compressWrite(compression_t *compression, const char *data,
+                         size_t length) {
+  response_t *res = compression->res;
+  if (compression->stream == NULL && shouldCompress(compression)) {
+    compression->stream = acquireStream(compression->coding);
+    if (compression->stream != NULL)
+      expressResSet(res, "Content-Encoding",
+                    codingNames[compression->coding]);
+  }
+  if (compression->stream == NULL || res->didSend || length == 0)
+    return compression->write(data, length);
+
+  /* zlib takes at most UINT_MAX bytes at a time */
+  for (; length > UINT_MAX; data += UINT_MAX, length -= UINT_MAX)
+    deflateWrite(compression, data, UINT_MAX, Z_NO_FLUSH);
+  return deflateWrite(compression, data, length, Z_SYNC_FLUSH);
+}
+
+static void compressEnd(compression_t *compression) {
+  response_t *res = compression->res;
+  if (compression->stream != NULL) {
+    if (res->headersSent && !res->didSend)
+      deflateWrite(compression, NULL, 0, Z_FINISH);
+    releaseStream();
+    compression->stream = NULL;
+  }
+  compression->end();
+}
+
+/* Formats into memory of its own, a compressed body is sent from a copy */
+static char *formatBody(const char *format, va_list args) {
+  va_list argsCopy;
+  va_copy(argsCopy, args);
+  int bodyLen = vsnprintf(NULL, 0, format, argsCopy);
+  va_end(argsCopy);
+  if (bodyLen < 0)
+    return NULL;
+  char *body = malloc(bodyLen + 1);
+  if (body != NULL)
+    vsnprintf(body, bodyLen + 1, format, args);
+  return body;
+}
+
+/*
+  Compresses bodies of minLength bytes and more, or COMPRESSION_MIN_LENGTH
+  when minLength is 0. It wraps the response's blocks, so it goes after
+  expressHelpersMiddleware and before anything that sends.
+*/
+middlewareHandler expressCompression(size_t minLength) {
+  if (minLength == 0)
+    minLength = COMPRESSION_MIN_LENGTH;
+  return Block_copy(^(request_t *req, response_t *res, void (^next)(),
+                      void (^cleanup)(cleanupHandler)) {
+    compression_t *compression = req->malloc(sizeof(compression_t));
+    if (compression == NULL || res->send == NULL) {
+      cleanup(Block_copy(^(UNUSED request_t *finishedReq){
+      }));
+      next();
+      return;
+    }
+
+    /* gzip first, deflate is sent inconsistently enough to be a fallback */
+    char *acceptEncoding = req->get("Accept-Encoding");
+    compression->coding = COMPRESSION_NONE;
+    if (acceptEncoding != NULL && acceptsEncoding(acceptEncoding, "gzip"))
+      compression->coding = COMPRESSION_GZIP;
+    else if (acceptEncoding != NULL &&
+             acceptsEncoding(acceptEncoding, "deflate"))
+      compression->coding = COMPRESSION_DEFLATE;
+    compression->res = res;
+    compression->minLength = minLength;
+    compression->stream = NULL;
+
+    compression->send = res->send;
+    res->send = Block_copy(^(const char *body) {
+      compressSend(compression, body, strlen(body));
+    });
+    compression->sendf = res->sendf;
+    res->sendf = Block_copy(^(const char *format, ...) {
+      va_list args;
+      va_start(args, format);
+      char *body = formatBody(format, args);
+      va_end(args);
+      if (body == NULL)
+        return;
+      compressSend(compression, body, strlen(body));
+      free(body);
+    });
+    compression->json = res->json;
+    res->json = Block_copy(^(const char *json) {
+      expressResSet(res, "Content-Type", "application/json");
+      compressSend(compression, json, strlen(json));
+    });
+    compression->write = res->write;
+    res->write = Block_copy(^(const char *data, size_t length) {
+      return compressWrite(compression, data, length);
+    });
+    compression->flushHeaders = res->flushHeaders;
+    res->flushHeaders = Block_copy(^() {
+      compressWrite(compression, NULL, 0);
+    });
+    compression->end = res->end;
+    res->end = Block_copy(^() {
+      compressEnd(compression);
+    });
+
+    /* The response, and the blocks wrapping these, are gone by now */
+    cleanup(Block_copy(^(UNUSED request_t *finishedReq) {
+      if (compression->stream != NULL)
+        releaseStream();
+      Block_release(compression->send);
+      Block_release(compression->sendf);
+      Block_release(compression->json);
+      Block_release(compression->write);
+      Block_release(compression->flushHeaders);
+      Block_release(compression->end);
+    }));
+
+    next();
+  });
+}
@@ -1,6 +1,18 @@
 #include <express.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 error_t *error404(request_t *req);
+void expressResSendFileDescriptor(response_t *res, int fd, size_t fileSize,
+                                  time_t modified);
+void expressResSendFileBlock(response_t *res, int fd, size_t fileSize,
+                             const char *etag, const char *lastModified);
+void expressResSendBuffer(response_t *res, const char *body, size_t bodyLen);
+
+static const char *encodingNames[STATIC_ENCODINGS] = {NULL, "gzip", "br"};
+static const char *encodingSuffixes[STATIC_ENCODINGS] = {"", ".gz", ".br"};
 
 static char *matchFilepath(request_t *req, const char *path) {
   regex_t regex;
@@ -32,49 +44,748 @@ static char *matchFilepath(request_t *req, const char *path) {
   return NULL;
 }
 
+/* The file under path for the request, if it does not lead out of fullPath */
+static char *staticFilePath(request_t *req, const char *path,
+                            const char *fullPath, int *isTraversal) {
+  char *filePath = matchFilepath(req, path);
+
+  char *rPath = realpath(filePath, NULL);
+  *isTraversal = rPath && strncmp(rPath, fullPath, strlen(fullPath)) != 0;
+
+  if (rPath)
+    free(rPath);
+
+  return filePath;
+}
+
+/* Whether If-None-Match lists the ETag, compared weakly */
+static int etagMatches(const char *ifNoneMatch, const char *etag) {
+  size_t etagLen = strlen(etag);
+  const char *tag = ifNoneMatch;
+  while (*tag != '\0') {
+    while (*tag == ' ' || *tag == '\t' || *tag == ',')
+      tag++;
+    if (*tag == '*')
+      return 1;
+    if (strncmp(tag, "W/", 2) == 0)
+      tag += 2;
+    if (strncmp(tag, etag, etagLen) == 0 &&
+        (tag[etagLen] == '\0' || tag[etagLen] == ',' || tag[etagLen] == ' '))
+      return 1;
+    while (*tag != '\0' && *tag != ',')
+      tag++;
+  }
+  return 0;
+}
+
+/* Brotli when the client takes it, being the smaller of the two */
+static static_encoding_t chooseEncoding(request_t *req, int hasGzip,
+                                        int hasBrotli) {
+  char *acceptEncoding = req->get("Accept-Encoding");
+  if (acceptEncoding == NULL)
+    return STATIC_IDENTITY;
+  if (hasBrotli && acceptsEncoding(acceptEncoding, "br"))
+    return STATIC_BROTLI;
+  if (hasGzip && acceptsEncoding(acceptEncoding, "gzip"))
+    return STATIC_GZIP;
+  return STATIC_IDENTITY;
+}
+
+/* A precompressed sibling keeps the type of the file it was made from */
+static void setEncoding(request_t *req, response_t *res,
+                        static_encoding_t encoding, int hasVariants) {
+  if (hasVariants)
+    res->set("Vary", "Accept-Encoding");
+  if (encoding == STATIC_IDENTITY)
+    return;
+  const char *mimetype = res->get("Content-Type") == NULL
+                             ? expressMimeType(req->path)
+                             : NULL;
+  if (mimetype != NULL)
+    res->set("Content-Type", mimetype);
+  res->set("Content-Encoding", encodingNames[encoding]);
+}
+
+static char *variantPath(request_t *req, const char *filePath,
+                         static_encoding_t encoding) {
+  size_t size = strlen(filePath) + strlen(encodingSuffixes[encoding]) + 1;
+  char *variant = req->malloc(size);
+  snprintf(variant, size, "%s%s", filePath, encodingSuffixes[encoding]);
+  return variant;
+}
+
+/*
+  Tries the siblings the client takes, smallest first, and falls back to the
+  file itself when none of them can be served. A sibling is not followed if
+  it is a link, as only the path to the file itself was checked to stay
+  under the root.
+*/
+static int openVariant(request_t *req, const char *filePath,
+                       static_encoding_t *encoding, struct stat *st) {
+  static const static_encoding_t preferred[] = {STATIC_BROTLI, STATIC_GZIP};
+  char *acceptEncoding = req->get("Accept-Encoding");
+  for (size_t i = 0; acceptEncoding != NULL && i < 2; i++) {
+    if (!acceptsEncoding(acceptEncoding, encodingNames[preferred[i]]))
+      continue;
+    int fd = open(variantPath(req, filePath, preferred[i]),
+                  O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+      continue;
+    if (fstat(fd, st) == 0 && S_ISREG(st->st_mode)) {
+      *encoding = preferred[i];
+      return fd;
+    }
+    close(fd);
+  }
+  *encoding = STATIC_IDENTITY;
+  int fd = open(filePath, O_RDONLY);
+  if (fd >= 0 && (fstat(fd, st) != 0 || !S_ISREG(st->st_mode))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* xxd names a file after its path, with anything but a letter or digit as _ */
+static char embeddedNameChar(char c) {
+  return isalnum((unsigned char)c) ? c : '_';
+}
+
+static uint32_t hashEmbeddedName(const char *name, size_t length,
+                                 uint32_t seed) {
+  uint32_t hash = 2166136261u ^ (seed * 16777619u);
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ (unsigned char)embeddedNameChar(name[i])) * 16777619u;
+  return hash;
+}
+
+static embedded_file_t *findIndexedFile(embedded_files_index_t *index,
+                                        const char *path, size_t length) {
+  size_t bucket = hashEmbeddedName(path, length, 0) % index->count;
+  int seed = index->seeds[bucket];
+  size_t slot = seed < 0 ? (size_t)(-seed - 1)
+                         : hashEmbeddedName(path, length, seed) % index->count;
+
+  /* A path that is not embedded still lands somewhere */
+  embedded_file_t *file = &index->files[slot];
+  for (size_t i = 0; i < length; i++) {
+    if (file->name[i] != embeddedNameChar(path[i]))
+      return NULL;
+  }
+  return file->name[length] == '\0' ? file : NULL;
+}
+
+/* The name ends in the extension, after the last _ rather than a dot */
+static const char *embeddedContentType(const char *name) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s", name);
+  char *dot = strrchr(path, '_');
+  if (dot == NULL)
+    return NULL;
+  *dot = '.';
+  return expressMimeType(path);
+}
+
+/* Finds a seed that puts every name in the bucket in a slot of its own */
+static int placeBucket(embedded_files_data_t embeddedFiles, size_t count,
+                       int *members, size_t memberCount, char *taken,
+                       size_t *slots) {
+  for (int seed = 1; seed < (int)count * 100 + 100; seed++) {
+    size_t placed = 0;
+    for (; placed < memberCount; placed++) {
+      const char *name = embeddedFiles.names[members[placed]];
+      slots[placed] = hashEmbeddedName(name, strlen(name), seed) % count;
+      if (taken[slots[placed]])
+        break;
+      taken[slots[placed]] = 1;
+    }
+    if (placed == memberCount)
+      return seed;
+    for (size_t i = 0; i < placed; i++)
+      taken[slots[i]] = 0;
+  }
+  return 0;
+}
+
+/*
+  Hash and displace: the largest buckets are placed first, while most slots
+  are free, and buckets of one name go straight into whichever slot is left.
+*/
+static embedded_files_index_t *
+indexEmbeddedFiles(embedded_files_data_t embeddedFiles) {
+  size_t count = embeddedFiles.count;
+  int *slotOf = malloc(sizeof(int) * count);
+  int *heads = malloc(sizeof(int) * count);
+  int *nexts = malloc(sizeof(int) * count);
+  size_t *sizes = calloc(count, sizeof(size_t));
+  int *members = malloc(sizeof(int) * count);
+  size_t *slots = malloc(sizeof(size_t) * count);
+  char *taken = calloc(count, 1);
+  embedded_files_index_t *index = calloc(1, sizeof(embedded_files_index_t));
+  check_mem(slotOf && heads && nexts && sizes && members && slots &&
+            taken && index);
+  index->count = count;
+  index->files = calloc(count, sizeof(embedded_file_t));
+  index->seeds = calloc(count, sizeof(int));
+  check_mem(index->files && index->seeds);
+
+  size_t largest = 0;
+  for (size_t i = 0; i < count; i++)
+    heads[i] = -1;
+  for (size_t i = 0; i < count; i++) {
+    const char *name = embeddedFiles.names[i];
+    size_t bucket = hashEmbeddedName(name, strlen(name), 0) % count;
+    nexts[i] = heads[bucket];
+    heads[bucket] = i;
+    sizes[bucket]++;
+    largest = max(largest, sizes[bucket]);
+  }
+
+  for (size_t size = largest; size > 1; size--) {
+    for (size_t bucket = 0; bucket < count; bucket++) {
+      if (sizes[bucket] != size)
+        continue;
+      size_t memberCount = 0;
+      for (int i = heads[bucket]; i >= 0; i = nexts[i])
+        members[memberCount++] = i;
+      int seed = placeBucket(embeddedFiles, count, members, memberCount,
+                             taken, slots);
+      check(seed > 0, "Embedded file names collide");
+      index->seeds[bucket] = seed;
+      for (size_t i = 0; i < memberCount; i++)
+        slotOf[members[i]] = slots[i];
+    }
+  }
+  size_t freeSlot = 0;
+  for (size_t bucket = 0; bucket < count; bucket++) {
+    if (sizes[bucket] != 1)
+      continue;
+    while (taken[freeSlot])
+      freeSlot++;
+    taken[freeSlot] = 1;
+    index->seeds[bucket] = -(int)freeSlot - 1;
+    slotOf[heads[bucket]] = freeSlot;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    embedded_file_t *file = &index->files[slotOf[i]];
+    file->name = embeddedFiles.names[i];
+    file->data = embeddedFiles.data[i];
+    file->length = embeddedFiles.lengths[i];
+    file->contentType = embeddedContentType(file->name);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t j = 0; j < file->length; j++)
+      hash = (hash ^ file->data[j]) * 1099511628211ull;
+    snprintf(file->etag, sizeof(file->etag), "\"%016llx\"",
+             (unsigned long long)hash);
+  }
+
+  /* xxd names app.css.gz app_css_gz */
+  for (size_t i = 0; i < count; i++) {
+    embedded_file_t *file = &index->files[i];
+    file->variants[STATIC_IDENTITY] = file;
+    for (int encoding = STATIC_GZIP; encoding < STATIC_ENCODINGS; encoding++) {
+      char variant[PATH_MAX];
+      int length = snprintf(variant, sizeof(variant), "%s%s", file->name,
+                            encodingSuffixes[encoding]);
+      if (length > 0 && length < (int)sizeof(variant))
+        file->variants[encoding] = findIndexedFile(index, variant, length);
+    }
+  }
+
+  free(slotOf);
+  free(heads);
+  free(nexts);
+  free(sizes);
+  free(members);
+  free(slots);
+  free(taken);
+  return index;
+error:
+  free(slotOf);
+  free(heads);
+  free(nexts);
+  free(sizes);
+  free(members);
+  free(slots);
+  free(taken);
+  if (index != NULL) {
+    free(index->files);
+    free(index->seeds);
+    free(index);
+  }
+  return NULL;
+}
+
+/* Sent straight from the data segment, with headers worked out up front */
+static void sendEmbeddedFile(request_t *req, response_t *res,
+                             embedded_files_index_t *index, void (^next)()) {
+  const char *reqPath = req->path + 1;
+  embedded_file_t *file = findIndexedFile(index, reqPath, strlen(reqPath));
+  if (file == NULL) {
+    next();
+    return;
+  }
+
+  int hasGzip = file->variants[STATIC_GZIP] != NULL;
+  int hasBrotli = file->variants[STATIC_BROTLI] != NULL;
+  static_encoding_t encoding = chooseEncoding(req, hasGzip, hasBrotli);
+  embedded_file_t *sent = file->variants[encoding];
+  if (file->contentType != NULL)
+    res->set("Content-Type", file->contentType);
+  setEncoding(req, res, encoding, hasGzip || hasBrotli);
+  res->set("ETag", sent->etag);
+
+  char *ifNoneMatch = req->get("If-None-Match");
+  int conditional =
+      strcmp(req->method, "GET") == 0 || strcmp(req->method, "HEAD") == 0;
+  if (conditional && ifNoneMatch != NULL &&
+      etagMatches(ifNoneMatch, sent->etag)) {
+    res->status = 304;
+    res->send("");
+    return;
+  }
+  expressResSendBuffer(res, (const char *)sent->data, sent->length);
+}
+
 middlewareHandler expressStatic(const char *path, const char *fullPath,
-                                UNUSED embedded_files_data_t embeddedFiles) {
+                                embedded_files_data_t embeddedFiles) {
+  embedded_files_index_t *index =
+      embeddedFiles.count > 0 ? indexEmbeddedFiles(embeddedFiles) : NULL;
+  if (embeddedFiles.count > 0 && index == NULL)
+    log_err("Could not index embedded files");
+
   return Block_copy(^(request_t *req, response_t *res, void (^next)(),
                       void (^cleanup)(cleanupHandler)) {
     cleanup(Block_copy(^(UNUSED request_t *finishedReq){
     }));
 
-    if (embeddedFiles.count > 0) {
-      const char *reqPath = req->path;
-      reqPath++;
-      char *data = matchEmbeddedFile(reqPath, embeddedFiles);
-      const char *mimetype = getMegaMimeType(req->path);
-      if (mimetype != NULL)
-        res->set("Content-Type", mimetype);
-      if (data != NULL) {
-        res->send(data);
-        free(data);
-      } else {
-        next();
-      }
+    if (index != NULL) {
+      sendEmbeddedFile(req, res, index, next);
+      return;
+    }
+
+    int isTraversal = 0;
+    char *filePath = staticFilePath(req, path, fullPath, &isTraversal);
+
+    if (isTraversal) {
+      error_t *err = error404(req);
+      res->error(err);
+      return;
+    }
+
+    if (filePath == NULL) {
+      next();
+      return;
+    }
+
+    /* Nothing about the encoding is set until its file is open */
+    static_encoding_t encoding;
+    struct stat st;
+    int fd = openVariant(req, filePath, &encoding, &st);
+    if (fd < 0) {
+      res->error(error404(req));
+      next();
       return;
     }
 
-    char *filePath = matchFilepath(req, path);
+    const char *mimetype = expressMimeType(filePath);
+    if (mimetype != NULL && res->get("Content-Type") == NULL)
+      res->set("Content-Type", mimetype);
+    setEncoding(req, res, encoding, encoding != STATIC_IDENTITY);
+    expressResSendFileDescriptor(res, fd, st.st_size, st.st_mtime);
+    close(fd);
+  });
+}
+
+static size_t hashPath(const char *urlPath) {
+  size_t hash = 5381;
+  while (*urlPath != '\0')
+    hash = hash * 33 + (unsigned char)*urlPath++;
+  return hash % STATIC_CACHE_BUCKETS;
+}
+
+static static_cache_entry_t *findEntry(static_cache_t *cache,
+                                       const char *urlPath) {
+  for (static_cache_entry_t *entry = cache->buckets[hashPath(urlPath)];
+       entry != NULL; entry = entry->next) {
+    if (strcmp(entry->urlPath, urlPath) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+static void freeEntry(static_cache_entry_t *entry) {
+  for (int i = 0; i < STATIC_ENCODINGS; i++) {
+    if (entry->files[i].fd >= 0)
+      close(entry->files[i].fd);
+    free(entry->files[i].headers);
+  }
+  free(entry->urlPath);
+  free(entry);
+}
+
+static void releaseEntry(static_cache_entry_t *entry) {
+  if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    freeEntry(entry);
+}
+
+static int watches(static_cache_entry_t *entry, int wd) {
+  for (int i = 0; i < STATIC_ENCODINGS; i++) {
+    if (entry->files[i].fd >= 0 && entry->files[i].wd == wd)
+      return 1;
+  }
+  return 0;
+}
+
+/* Whether a linked entry still relies on the watch */
+static int watched(static_cache_t *cache, int wd) {
+  for (int i = 0; i < STATIC_CACHE_BUCKETS; i++) {
+    for (static_cache_entry_t *entry = cache->buckets[i]; entry != NULL;
+         entry = entry->next) {
+      if (watches(entry, wd))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+  Run as a barrier. A watch is shared by every entry for the same file, so
+  it is only removed with the last of them. Should an entry being opened
+  have just been given it too, the IN_IGNORED that follows evicts that one.
+*/
+static void unwatchEntry(static_cache_t *cache, static_cache_entry_t *entry) {
+#ifdef __linux__
+  for (int i = 0; i < STATIC_ENCODINGS; i++) {
+    static_file_t *file = &entry->files[i];
+    if (file->wd < 0 || watched(cache, file->wd))
+      continue;
+    inotify_rm_watch(cache->inotifyFd, file->wd);
+    file->wd = -1;
+  }
+#else
+  (void)cache;
+  (void)entry;
+#endif
+}
+
+/* Whether the cache can take on that many more descriptors and bytes */
+static int hasRoom(static_cache_t *cache, size_t fds, size_t bytes) {
+  return __atomic_load_n(&cache->count, __ATOMIC_RELAXED) < cache->maxEntries &&
+         __atomic_load_n(&cache->fds, __ATOMIC_RELAXED) + fds <=
+             cache->maxFds &&
+         __atomic_load_n(&cache->bytes, __ATOMIC_RELAXED) + bytes <=
+             cache->maxBytes;
+}
+
+/* Drops every entry for the file behind the watch, there may be a few */
+static void evictWatch(static_cache_t *cache, int wd) {
+  for (int i = 0; i < STATIC_CACHE_BUCKETS; i++) {
+    static_cache_entry_t **link = &cache->buckets[i];
+    while (*link != NULL) {
+      static_cache_entry_t *entry = *link;
+      if (!watches(entry, wd)) {
+        link = &entry->next;
+        continue;
+      }
+      *link = entry->next;
+      __atomic_sub_fetch(&cache->count, 1, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&cache->fds, entry->fds, __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&cache->bytes, entry->bytes, __ATOMIC_RELAXED);
+      unwatchEntry(cache, entry);
+      releaseEntry(entry);
+    }
+  }
+}
+
+/* Files are only cached where a change to them can be seen */
+static int watchFile(static_cache_t *cache, const char *filePath, int flags) {
+#ifdef __linux__
+  if (cache->inotifyFd >= 0)
+    return inotify_add_watch(cache->inotifyFd, filePath,
+                             IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                                 IN_DELETE_SELF |
+                                 (flags & O_NOFOLLOW ? IN_DONT_FOLLOW : 0));
+#else
+  (void)flags;
+#endif
+  return -1;
+}
+
+static void readWatches(static_cache_t *cache) {
+#ifdef __linux__
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t length;
+  while ((length = read(cache->inotifyFd, buffer, sizeof(buffer))) > 0) {
+    char *event = buffer;
+    while (event < buffer + length) {
+      struct inotify_event *watchEvent = (struct inotify_event *)event;
+      __atomic_add_fetch(&cache->changes, 1, __ATOMIC_RELEASE);
+      evictWatch(cache, watchEvent->wd);
+      if (!(watchEvent->mask & IN_IGNORED))
+        inotify_rm_watch(cache->inotifyFd, watchEvent->wd);
+      event += sizeof(struct inotify_event) + watchEvent->len;
+    }
+  }
+#else
+  (void)cache;
+#endif
+}
+
+static int formatHeaders(char *buffer, size_t size, static_cache_t *cache,
+                         static_file_t *file, static_encoding_t encoding,
+                         int varies) {
+  const char *cacheControl = cache->cacheControl;
+  const char *contentEncoding = encodingNames[encoding];
+  return snprintf(buffer, size,
+                  "Accept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n"
+                  "%s%s%s%s%s%s%s",
+                  file->etag, file->lastModified,
+                  cacheControl != NULL ? "Cache-Control: " : "",
+                  cacheControl != NULL ? cacheControl : "",
+                  cacheControl != NULL ? "\r\n" : "",
+                  varies ? "Vary: Accept-Encoding\r\n" : "",
+                  contentEncoding != NULL ? "Content-Encoding: " : "",
+                  contentEncoding != NULL ? contentEncoding : "",
+                  contentEncoding != NULL ? "\r\n" : "");
+}
+
+/* Laid out once, to be sent as they are with every response for the file */
+static int layOutHeaders(static_cache_t *cache, static_file_t *file,
+                         static_encoding_t encoding, int varies) {
+  int length = formatHeaders(NULL, 0, cache, file, encoding, varies);
+  file->headers = malloc(length + 1);
+  check_mem(file->headers);
+  formatHeaders(file->headers, length + 1, cache, file, encoding, varies);
+  file->headersLength = length;
+  return 0;
+error:
+  return -1;
+}
 
-    char *rPath = realpath(filePath, NULL);
-    int isTraversal = rPath && strncmp(rPath, fullPath, strlen(fullPath)) != 0;
+/*
+  Watched before it is read, so no change can slip in between. Siblings are
+  opened with O_NOFOLLOW, as for openVariant.
+*/
+static int openFile(static_cache_t *cache, const char *filePath, int flags,
+                    static_file_t *file) {
+  struct stat st;
+  file->fd = -1;
+  file->wd = watchFile(cache, filePath, flags);
+  check_silent(file->wd >= 0, "Not watched");
+  file->fd = open(filePath, O_RDONLY | flags);
+  check_silent(file->fd >= 0, "Could not open file");
+  check_silent(fstat(file->fd, &st) == 0 && S_ISREG(st.st_mode),
+               "Not a file");
+
+  file->size = st.st_size;
+  file->modified = st.st_mtime;
+  snprintf(file->etag, sizeof(file->etag), "\"%llx-%llx-%zx\"",
+           (unsigned long long)st.st_ino, (unsigned long long)st.st_mtime,
+           file->size);
+  struct tm tm;
+  gmtime_r(&file->modified, &tm);
+  strftime(file->lastModified, sizeof(file->lastModified),
+           "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return 0;
+error:
+  if (file->fd >= 0)
+    close(file->fd);
+  file->fd = -1;
+  return -1;
+}
 
-    if (rPath)
-      free(rPath);
+/*
+  Opened outside the queue, so a miss holds up no lookup while it waits on
+  the disk. The precompressed siblings a file has are found once, here.
+*/
+static static_cache_entry_t *openEntry(static_cache_t *cache, request_t *req,
+                                       const char *filePath) {
+  static_cache_entry_t *entry = malloc(sizeof(static_cache_entry_t));
+  check_mem(entry);
+  entry->refs = 1;
+  entry->fds = 0;
+  entry->bytes = sizeof(static_cache_entry_t);
+  entry->urlPath = NULL;
+  for (int i = 0; i < STATIC_ENCODINGS; i++) {
+    entry->files[i].fd = -1;
+    entry->files[i].wd = -1;
+    entry->files[i].headers = NULL;
+  }
+  check_silent(openFile(cache, filePath, 0,
+                        &entry->files[STATIC_IDENTITY]) == 0,
+               "Could not cache file");
+  for (int i = STATIC_GZIP; i < STATIC_ENCODINGS; i++)
+    openFile(cache, variantPath(req, filePath, i), O_NOFOLLOW,
+             &entry->files[i]);
+  int varies = entry->files[STATIC_GZIP].fd >= 0 ||
+               entry->files[STATIC_BROTLI].fd >= 0;
+  for (int i = 0; i < STATIC_ENCODINGS; i++) {
+    if (entry->files[i].fd < 0)
+      continue;
+    check_silent(layOutHeaders(cache, &entry->files[i], i, varies) == 0,
+                 "Could not lay out headers");
+    entry->fds++;
+    entry->bytes += entry->files[i].headersLength + 1;
+  }
+  entry->urlPath = strdup(req->path);
+  check_mem(entry->urlPath);
+  entry->bytes += strlen(entry->urlPath) + 1;
+  entry->contentType = expressMimeType(filePath);
+  return entry;
+error:
+  if (entry != NULL) {
+    dispatch_barrier_sync(cache->queue, ^{
+      unwatchEntry(cache, entry);
+    });
+    freeEntry(entry);
+  }
+  return NULL;
+}
 
+/*
+  Run as a barrier, so no lookup sees the entry half linked in. An entry
+  opened while a change was read may already be stale, so it is served
+  once and not kept. The watches of whatever is not kept go with it.
+*/
+static void insertEntry(static_cache_t *cache, static_cache_entry_t *entry,
+                        size_t changes) {
+  if (__atomic_load_n(&cache->changes, __ATOMIC_ACQUIRE) == changes &&
+      hasRoom(cache, entry->fds, entry->bytes) &&
+      findEntry(cache, entry->urlPath) == NULL) {
+    size_t bucket = hashPath(entry->urlPath);
+    entry->refs++;
+    entry->next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    __atomic_add_fetch(&cache->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cache->fds, entry->fds, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cache->bytes, entry->bytes, __ATOMIC_RELAXED);
+  }
+  unwatchEntry(cache, entry);
+}
+
+/*
+  Answers from the entry alone, outside the queue. The caller holds a
+  reference, so the headers outlive the send even if the entry is evicted.
+*/
+static void serveEntry(static_cache_entry_t *entry, request_t *req,
+                       response_t *res) {
+  int hasGzip = entry->files[STATIC_GZIP].fd >= 0;
+  int hasBrotli = entry->files[STATIC_BROTLI].fd >= 0;
+  static_encoding_t encoding = chooseEncoding(req, hasGzip, hasBrotli);
+  static_file_t *file = &entry->files[encoding];
+
+  if (entry->contentType != NULL)
+    res->set("Content-Type", entry->contentType);
+  res->headerBlock = file->headers;
+  res->headerBlockLength = file->headersLength;
+
+  /* If-None-Match wins over If-Modified-Since, which is matched as sent */
+  int notModified = 0;
+  if (strcmp(req->method, "GET") == 0 || strcmp(req->method, "HEAD") == 0) {
+    char *ifNoneMatch = req->get("If-None-Match");
+    char *ifModifiedSince = req->get("If-Modified-Since");
+    if (ifNoneMatch != NULL)
+      notModified = etagMatches(ifNoneMatch, file->etag);
+    else if (ifModifiedSince != NULL)
+      notModified = strcmp(ifModifiedSince, file->lastModified) == 0;
+  }
+
+  if (notModified) {
+    res->status = 304;
+    res->send("");
+  } else {
+    expressResSendFileBlock(res, file->fd, file->size, file->etag,
+                            file->lastModified);
+  }
+  res->headerBlock = NULL;
+  res->headerBlockLength = 0;
+}
+
+/*
+  Like expressStatic, but a file that has been served before is answered
+  from an open descriptor and headers worked out when it was first opened,
+  with no regex, realpath or stat on the way. inotify drops an entry as soon
+  as its file changes, so files are only cached on Linux.
+*/
+middlewareHandler expressStaticCache(const char *path, const char *fullPath,
+                                     const char *cacheControl,
+                                     size_t maxEntries) {
+  static_cache_t *cache = calloc(1, sizeof(static_cache_t));
+  cache->maxEntries = maxEntries > 0 ? maxEntries : STATIC_CACHE_MAX_ENTRIES;
+  cache->maxBytes = STATIC_CACHE_MAX_BYTES;
+  /* Leaves most descriptors to the connections */
+  struct rlimit limit;
+  cache->maxFds = STATIC_CACHE_MAX_FDS;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    cache->maxFds = min(cache->maxFds, (size_t)limit.rlim_cur / 4);
+  cache->cacheControl = cacheControl;
+  cache->queue =
+      dispatch_queue_create("staticCacheQueue", DISPATCH_QUEUE_CONCURRENT);
+  cache->inotifyFd = -1;
+#ifdef __linux__
+  cache->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (cache->inotifyFd < 0)
+    log_warn("inotify_init1() failed, static files will not be cached");
+#endif
+  if (cache->inotifyFd >= 0) {
+    cache->source = dispatch_source_create(
+        DISPATCH_SOURCE_TYPE_READ, cache->inotifyFd, 0,
+        dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+    dispatch_source_set_event_handler(cache->source, ^{
+      dispatch_barrier_sync(cache->queue, ^{
+        readWatches(cache);
+      });
+    });
+    dispatch_resume(cache->source);
+  }
+
+  return Block_copy(^(request_t *req, response_t *res, void (^next)(),
+                      void (^cleanup)(cleanupHandler)) {
+    cleanup(Block_copy(^(UNUSED request_t *finishedReq){
+    }));
+
+    /* The lookup only takes a reference, the response goes out after it */
+    __block static_cache_entry_t *entry = NULL;
+    dispatch_sync(cache->queue, ^{
+      entry = findEntry(cache, req->path);
+      if (entry != NULL)
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+    });
+    if (entry != NULL) {
+      serveEntry(entry, req, res);
+      releaseEntry(entry);
+      return;
+    }
+
+    int isTraversal = 0;
+    char *filePath = staticFilePath(req, path, fullPath, &isTraversal);
     if (isTraversal) {
       error_t *err = error404(req);
       res->error(err);
       return;
     }
+    if (filePath == NULL) {
+      next();
+      return;
+    }
 
-    if (filePath != NULL) {
-      res->sendFile(filePath);
-      if (res->err)
-        next();
+    /* A miss only holds up lookups for as long as it takes to link it in */
+    size_t changes = __atomic_load_n(&cache->changes, __ATOMIC_ACQUIRE);
+    if (cache->inotifyFd >= 0 && hasRoom(cache, 1, 0))
+      entry = openEntry(cache, req, filePath);
+    if (entry != NULL) {
+      dispatch_barrier_sync(cache->queue, ^{
+        insertEntry(cache, entry, changes);
+      });
+      serveEntry(entry, req, res);
+      releaseEntry(entry);
     } else {
-      next();
+      res->sendFile(filePath);
     }
+    if (res->err)
+      next();
   });
 }
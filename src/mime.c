@@ -0,0 +1,133 @@
+#include "express.h"
+
+/*
+
+MIME types by file extension.
+
+The MegaMimes table is loaded into an open addressing hash table, keyed on
+the lowercase extension, the first time a type is looked up. After that the
+table only grows through expressMimeTypeSet, which publishes each slot with
+a release store, so lookups never take a lock and never see half an entry.
+
+*/
+
+typedef struct mime_entry_t {
+  const char *extension;
+  const char *type;
+} mime_entry_t;
+
+static mime_entry_t mimeTypes[MIME_TABLE_SIZE];
+static pthread_once_t mimeTypesOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mimeTypesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t hashExtension(const char *extension) {
+  uint32_t hash = 2166136261u;
+  while (*extension != '\0')
+    hash = (hash ^ (unsigned char)*extension++) * 16777619u;
+  return hash & (MIME_TABLE_SIZE - 1);
+}
+
+/* The slot holding extension, or the empty one it would go in */
+static mime_entry_t *findSlot(const char *extension) {
+  size_t slot = hashExtension(extension);
+  for (size_t i = 0; i < MIME_TABLE_SIZE; i++) {
+    mime_entry_t *entry = &mimeTypes[(slot + i) & (MIME_TABLE_SIZE - 1)];
+    const char *key = __atomic_load_n(&entry->extension, __ATOMIC_ACQUIRE);
+    if (key == NULL || strcmp(key, extension) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+/* Both are kept as they are, so they have to outlive the table */
+static int insertType(const char *extension, const char *type, int replace) {
+  mime_entry_t *entry = findSlot(extension);
+  check(entry != NULL, "MIME type table is full");
+  if (entry->extension != NULL && !replace)
+    return 0;
+  __atomic_store_n(&entry->type, type, __ATOMIC_RELEASE);
+  if (entry->extension == NULL)
+    __atomic_store_n(&entry->extension, extension, __ATOMIC_RELEASE);
+  return 0;
+error:
+  return -1;
+}
+
+/* Earlier rows win, as they do for getMegaMimeType */
+static void loadMimeTypes() {
+  for (size_t i = 0; MegaMimeTypes[i][EXTENSION_POS] != NULL; i++) {
+    const char *pattern = MegaMimeTypes[i][EXTENSION_POS];
+    if (strncmp(pattern, "*.", 2) != 0)
+      continue;
+
+    /* The few uppercase rows, such as *.Z, get a lowercase copy */
+    const char *extension = pattern + 2;
+    char *lowercase = NULL;
+    for (const char *c = extension; *c != '\0' && lowercase == NULL; c++) {
+      if (isupper((unsigned char)*c))
+        lowercase = strdup(extension);
+    }
+    for (char *c = lowercase; c != NULL && *c != '\0'; c++)
+      *c = tolower((unsigned char)*c);
+    insertType(lowercase != NULL ? lowercase : extension,
+               MegaMimeTypes[i][MIMETYPE_POS], 0);
+  }
+}
+
+/* Lowercases the extension of path into buffer, NULL when it has none */
+static char *pathExtension(const char *path, char *buffer, size_t size) {
+  const char *dot = strrchr(path, '.');
+  const char *separator = strrchr(path, '/');
+  if (dot == NULL || (separator != NULL && dot < separator))
+    return NULL;
+
+  size_t length = strlen(dot + 1);
+  if (length == 0 || length >= size)
+    return NULL;
+  for (size_t i = 0; i < length; i++)
+    buffer[i] = tolower((unsigned char)dot[i + 1]);
+  buffer[length] = '\0';
+  return buffer;
+}
+
+/* The type for the extension of path, or NULL when it is not known */
+const char *expressMimeType(const char *path) {
+  if (path == NULL)
+    return NULL;
+  pthread_once(&mimeTypesOnce, loadMimeTypes);
+
+  char buffer[MIME_EXTENSION_SIZE];
+  const char *extension = pathExtension(path, buffer, sizeof(buffer));
+  if (extension == NULL)
+    return NULL;
+  mime_entry_t *entry = findSlot(extension);
+  if (entry == NULL)
+    return NULL;
+  const char *key = __atomic_load_n(&entry->extension, __ATOMIC_ACQUIRE);
+  return key != NULL ? __atomic_load_n(&entry->type, __ATOMIC_ACQUIRE) : NULL;
+}
+
+/*
+  Sets the type for an extension, given without the dot, replacing any the
+  table has. Meant for startup, but safe to call while requests are served.
+*/
+int expressMimeTypeSet(const char *extension, const char *type) {
+  pthread_once(&mimeTypesOnce, loadMimeTypes);
+
+  char buffer[MIME_EXTENSION_SIZE];
+  size_t length = strlen(extension);
+  check(length > 0 && length < sizeof(buffer), "Invalid extension");
+  for (size_t i = 0; i <= length; i++)
+    buffer[i] = tolower((unsigned char)extension[i]);
+
+  pthread_mutex_lock(&mimeTypesLock);
+  mime_entry_t *entry = findSlot(buffer);
+  const char *key = entry != NULL && entry->extension != NULL
+                        ? entry->extension
+                        : strdup(buffer);
+  int status = key != NULL ? insertType(key, type, 1) : -1;
+  pthread_mutex_unlock(&mimeTypesLock);
+  return status;
+error:
+  return -1;
+}
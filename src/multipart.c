@@ -0,0 +1,365 @@
+#include "express.h"
+
+/*
+
+A streaming multipart/form-data parser.
+
+The body is fed in as pieces of any size and each part is handed on as it is
+parsed, without the part ever being buffered. Only a part's headers and the
+few bytes at the end of a piece that could be the start of a delimiter are
+kept between pieces, so the memory a parser needs does not grow with the
+body.
+
+*/
+
+void *expressReqMalloc(request_t *req, size_t size);
+char *expressReqGet(request_t *req, const char *headerKey);
+
+/* The value of a key=value or key="value" parameter of a header */
+static char *headerParam(request_t *req, const char *value, size_t valueLen,
+                         const char *key) {
+  size_t keyLen = strlen(key);
+  const char *end = value + valueLen;
+  const char *param = memchr(value, ';', valueLen);
+  while (param != NULL) {
+    const char *name = param + 1;
+    while (name < end && (*name == ' ' || *name == '\t'))
+      name++;
+    const char *equals = memchr(name, '=', end - name);
+    if (equals == NULL)
+      return NULL;
+
+    const char *start = equals + 1;
+    const char *stop;
+    if (start < end && *start == '"') {
+      start++;
+      stop = memchr(start, '"', end - start);
+      if (stop == NULL)
+        return NULL;
+      param = memchr(stop, ';', end - stop);
+    } else {
+      stop = memchr(start, ';', end - start);
+      param = stop;
+      if (stop == NULL)
+        stop = end;
+    }
+
+    if ((size_t)(equals - name) == keyLen &&
+        strncasecmp(name, key, keyLen) == 0) {
+      char *copy = expressReqMalloc(req, stop - start + 1);
+      check_mem(copy);
+      memcpy(copy, start, stop - start);
+      copy[stop - start] = '\0';
+      return copy;
+    }
+  }
+error:
+  return NULL;
+}
+
+int multipartParserInit(multipart_parser_t *parser, request_t *req,
+                        multipartDataHandler handler) {
+  char *contentType = expressReqGet(req, "Content-Type");
+  check_silent(contentType != NULL &&
+                   strncasecmp(contentType, "multipart/form-data", 19) == 0,
+               "Not a multipart body");
+  char *boundary =
+      headerParam(req, contentType, strlen(contentType), "boundary");
+  check(boundary != NULL, "Multipart body without a boundary");
+  size_t boundaryLength = strlen(boundary);
+  check(boundaryLength > 0 && boundaryLength <= MULTIPART_BOUNDARY_SIZE,
+        "Invalid multipart boundary");
+
+  parser->req = req;
+  parser->handler = handler;
+  parser->part = NULL;
+  parser->headersLength = 0;
+  parser->delimiterLength = boundaryLength + 4;
+  memcpy(parser->delimiter, "\r\n--", 4);
+  memcpy(parser->delimiter + 4, boundary, boundaryLength);
+
+  /* As if the body began with a CRLF, so the first delimiter needs none */
+  parser->state = MULTIPART_PREAMBLE;
+  parser->matched = 2;
+  return 0;
+error:
+  return -1;
+}
+
+static void emitData(multipart_parser_t *parser, const char *data,
+                     size_t length) {
+  if (parser->state != MULTIPART_DATA || length == 0)
+    return;
+  parser->part->size += length;
+  parser->handler(parser->part, data, length);
+}
+
+static void endPart(multipart_parser_t *parser) {
+  if (parser->state != MULTIPART_DATA)
+    return;
+  parser->handler(parser->part, NULL, 0);
+  parser->part = NULL;
+}
+
+static int beginPart(multipart_parser_t *parser) {
+  request_t *req = parser->req;
+  struct phr_header headers[16];
+  size_t numHeaders = sizeof(headers) / sizeof(headers[0]);
+  int parseBytes = phr_parse_headers(parser->headers, parser->headersLength,
+                                     headers, &numHeaders, 0);
+  check(parseBytes > 0, "Invalid multipart headers");
+
+  multipart_part_t *part = expressReqMalloc(req, sizeof(multipart_part_t));
+  check_mem(part);
+  memset(part, 0, sizeof(multipart_part_t));
+  part->fd = -1;
+  for (size_t i = 0; i != numHeaders; ++i) {
+    if (headers[i].name_len == strlen("Content-Disposition") &&
+        strncasecmp(headers[i].name, "Content-Disposition",
+                    headers[i].name_len) == 0) {
+      part->name =
+          headerParam(req, headers[i].value, headers[i].value_len, "name");
+      part->filename =
+          headerParam(req, headers[i].value, headers[i].value_len, "filename");
+    } else if (headers[i].name_len == strlen("Content-Type") &&
+               strncasecmp(headers[i].name, "Content-Type",
+                           headers[i].name_len) == 0) {
+      part->contentType = expressReqMalloc(req, headers[i].value_len + 1);
+      check_mem(part->contentType);
+      memcpy(part->contentType, headers[i].value, headers[i].value_len);
+      part->contentType[headers[i].value_len] = '\0';
+    }
+  }
+  check(part->name != NULL, "Multipart part without a name");
+
+  parser->part = part;
+  return 0;
+error:
+  return -1;
+}
+
+/* Collects a part's headers up to the blank line that ends them */
+static const char *readHeaders(multipart_parser_t *parser, const char *data,
+                               const char *end) {
+  while (data < end) {
+    check(parser->headersLength < MULTIPART_HEADERS_SIZE,
+          "Multipart headers too long");
+    char c = *data++;
+    parser->headers[parser->headersLength++] = c;
+    if (c != '\n')
+      continue;
+
+    size_t length = parser->headersLength;
+    if ((length == 2 && parser->headers[0] == '\r') ||
+        (length >= 4 &&
+         memcmp(parser->headers + length - 4, "\r\n\r\n", 4) == 0)) {
+      check(beginPart(parser) == 0, "Invalid multipart part");
+      parser->state = MULTIPART_DATA;
+      return data;
+    }
+  }
+  return data;
+error:
+  parser->state = MULTIPART_ERROR;
+  return end;
+}
+
+/*
+  Hands on data up to the next delimiter. Bytes at the end of a piece that
+  could be the start of one are held back in matched until the next piece
+  shows whether they are.
+*/
+static const char *scanData(multipart_parser_t *parser, const char *data,
+                            const char *end) {
+  const char *delimiter = parser->delimiter;
+  size_t delimiterLength = parser->delimiterLength;
+  while (data < end) {
+    /* A delimiter starts with the only CR it has, memchr is vectorised */
+    if (parser->matched == 0) {
+      const char *cr = memchr(data, '\r', end - data);
+      if (cr == NULL) {
+        emitData(parser, data, end - data);
+        return end;
+      }
+      emitData(parser, data, cr - data);
+      data = cr;
+    }
+
+    size_t compared =
+        min(delimiterLength - parser->matched, (size_t)(end - data));
+    if (memcmp(data, delimiter + parser->matched, compared) != 0) {
+      if (parser->matched > 0) {
+        /* What was held back was data, with no other CR to start a match */
+        emitData(parser, delimiter, parser->matched);
+        parser->matched = 0;
+      } else {
+        emitData(parser, data, 1);
+        data++;
+      }
+      continue;
+    }
+
+    parser->matched += compared;
+    data += compared;
+    if (parser->matched == delimiterLength) {
+      endPart(parser);
+      parser->matched = 0;
+      parser->state = MULTIPART_BOUNDARY;
+      return data;
+    }
+  }
+  return data;
+}
+
+/* Returns -1 once the body can no longer be parsed */
+int multipartParserExecute(multipart_parser_t *parser, const char *data,
+                           size_t length) {
+  const char *end = data + length;
+  while (data < end) {
+    switch (parser->state) {
+    case MULTIPART_PREAMBLE:
+    case MULTIPART_DATA:
+      data = scanData(parser, data, end);
+      break;
+    case MULTIPART_BOUNDARY:
+      /* Either another part or the closing delimiter, after any padding */
+      if (*data == '-')
+        parser->state = MULTIPART_BOUNDARY_DASH;
+      else if (*data == '\r')
+        parser->state = MULTIPART_BOUNDARY_CR;
+      else if (*data != ' ' && *data != '\t')
+        parser->state = MULTIPART_ERROR;
+      data++;
+      break;
+    case MULTIPART_BOUNDARY_DASH:
+      parser->state = *data == '-' ? MULTIPART_EPILOGUE : MULTIPART_ERROR;
+      data++;
+      break;
+    case MULTIPART_BOUNDARY_CR:
+      parser->state = *data == '\n' ? MULTIPART_HEADERS : MULTIPART_ERROR;
+      parser->headersLength = 0;
+      data++;
+      break;
+    case MULTIPART_HEADERS:
+      data = readHeaders(parser, data, end);
+      break;
+    case MULTIPART_EPILOGUE:
+      return 0;
+    case MULTIPART_ERROR:
+      return -1;
+    }
+  }
+  return parser->state == MULTIPART_ERROR ? -1 : 0;
+}
+
+static int createUpload(request_t *req, multipart_part_t *part) {
+  const char *tmpDir = getenv("TMPDIR");
+  char path[256];
+  snprintf(path, sizeof(path), "%s/express-upload-XXXXXX",
+           tmpDir != NULL ? tmpDir : "/tmp");
+
+  part->fd = mkstemp(path);
+  check(part->fd >= 0, "mkstemp() failed");
+  size_t pathLength = strlen(path) + 1;
+  part->path = expressReqMalloc(req, pathLength);
+  check_mem(part->path);
+  memcpy(part->path, path, pathLength);
+
+  mmCleanup(req->memoryManager, mmBlockCopy(req->memoryManager, ^{
+              if (part->fd >= 0)
+                close(part->fd);
+              unlink(part->path);
+            }));
+  return 0;
+error:
+  if (part->fd >= 0) {
+    close(part->fd);
+    unlink(path);
+  }
+  part->fd = -1;
+  return -1;
+}
+
+static int writeUpload(multipart_part_t *part, const char *data,
+                       size_t length) {
+  while (length > 0) {
+    ssize_t written = write(part->fd, data, length);
+    if (written < 0 && errno == EINTR)
+      continue;
+    check(written > 0, "Could not write upload");
+    data += written;
+    length -= written;
+  }
+  return 0;
+error:
+  return -1;
+}
+
+/*
+  Parses the whole body, keeping fields in the request's memory and writing
+  files straight from the body to temp files. Returns the parts in order, or
+  NULL when the body is not a multipart one or cannot be parsed.
+*/
+multipart_part_t *multipartParseBody(request_t *req) {
+  __block multipart_part_t *parts = NULL;
+  __block multipart_part_t **tail = &parts;
+  __block multipart_part_t **fileTail = NULL;
+  __block int failed = 0;
+  __block int invalid = 0;
+  multipart_parser_t *parser = expressReqMalloc(req, sizeof(*parser));
+  check_mem(parser);
+
+  multipartDataHandler storePart = ^(multipart_part_t *part, const char *data,
+                                     size_t length) {
+    if (failed)
+      return;
+    if (part->filename != NULL) {
+      if (part->path == NULL && createUpload(req, part) != 0)
+        failed = 1;
+      else if (writeUpload(part, data, length) != 0)
+        failed = 1;
+    } else if (length > 0 || part->value == NULL) {
+      /* A field rarely arrives in more than one piece */
+      char *value = expressReqMalloc(req, part->size + 1);
+      if (value == NULL) {
+        failed = 1;
+        return;
+      }
+      size_t valueLength = part->size - length;
+      if (valueLength > 0)
+        memcpy(value, part->value, valueLength);
+      if (length > 0)
+        memcpy(value + valueLength, data, length);
+      value[part->size] = '\0';
+      part->value = value;
+    }
+    if (length > 0 || failed)
+      return;
+
+    /* A length of 0 ends the part */
+    if (part->fd >= 0) {
+      close(part->fd);
+      part->fd = -1;
+    }
+    *tail = part;
+    tail = &part->next;
+    if (part->filename != NULL) {
+      if (fileTail != NULL)
+        *fileTail = part;
+      fileTail = &part->nextFile;
+    }
+  };
+  check_silent(multipartParserInit(parser, req, storePart) == 0,
+               "Not a multipart body");
+
+  expressReqOnData(req, ^(const char *chunk, size_t length) {
+    if (!invalid && multipartParserExecute(parser, chunk, length) < 0)
+      invalid = 1;
+  });
+  check(!invalid && parser->state == MULTIPART_EPILOGUE,
+        "Invalid multipart body");
+  check(!failed, "Could not store multipart body");
+  return parts;
+error:
+  return NULL;
+}
@@ -1,4 +1,7 @@
 #include "express.h"
+#include <sys/mman.h>
+
+#define REQUEST_BODY_CHUNK_SIZE 65536
 
 static _Thread_local memory_manager_t *threadLocalMemoryManager = NULL;
 
@@ -334,16 +337,10 @@ static void initReqBody(request_t *req) {
   if (strncmp(req->method, "POST", 4) == 0 ||
       strncmp(req->method, "PATCH", 5) == 0 ||
       strncmp(req->method, "PUT", 3) == 0) {
-    char *rawRequest = (char *)req->rawRequest;
-    char *body = strstr(rawRequest, "\r\n\r\n");
-    body += 4;
-
-    req->bodyString =
-        expressReqMalloc(req, sizeof(char) * req->contentLength + 1);
-    memcpy((char *)req->bodyString, body, req->contentLength);
-    req->bodyString[req->contentLength] = '\0';
-    if (req->bodyString && strlen(req->bodyString) > 0) {
-      char *contentType = expressReqGet(req, "Content-Type");
+    /* NUL terminated whether it is in the request arena or spilled */
+    req->bodyString = (char *)req->rawBody;
+    char *contentType = expressReqGet(req, "Content-Type");
+    if (req->contentLength > 0 && contentType != NULL) {
       if (strncmp(contentType, "application/x-www-form-urlencoded", 33) == 0) {
         size_t bodyStringLen = strlen(req->bodyString);
         parseQueryString(req->bodyString, req->bodyString + bodyStringLen,
@@ -352,15 +349,118 @@ static void initReqBody(request_t *req) {
                              sizeof(req->bodyKeyValues[0]));
       } else if (strncmp(contentType, "application/json", 16) == 0) {
         // printf("application/json: %s\n", req->bodyString);
-      } else if (strncmp(contentType, "multipart/form-data", 20) == 0) {
-        // printf("multipart/form-data: %s\n", req->bodyString);
       }
-    } else {
-      req->bodyString[0] = '\0';
     }
   }
 }
 
+/* Copies the next bytes of the body into buf, returns 0 once all are read */
+size_t expressReqReadBody(request_t *req, char *buf, size_t length) {
+  size_t readLength =
+      min(length, (size_t)req->contentLength - req->bodyReadOffset);
+  memcpy(buf, req->rawBody + req->bodyReadOffset, readLength);
+  req->bodyReadOffset += readLength;
+  return readLength;
+}
+
+static readBodyBlock reqReadBodyFactory(request_t *req) {
+  return Block_copy(^(char *buf, size_t length) {
+    return expressReqReadBody(req, buf, length);
+  });
+}
+
+/* Hands the rest of the body to handler a chunk at a time, without copying */
+void expressReqOnData(request_t *req, bodyDataHandler handler) {
+  while (req->bodyReadOffset < (size_t)req->contentLength) {
+    size_t chunkLength = min((size_t)REQUEST_BODY_CHUNK_SIZE,
+                             req->contentLength - req->bodyReadOffset);
+    handler(req->rawBody + req->bodyReadOffset, chunkLength);
+    req->bodyReadOffset += chunkLength;
+  }
+}
+
+static onDataBlock reqOnDataFactory(request_t *req) {
+  return Block_copy(^(bodyDataHandler handler) {
+    expressReqOnData(req, handler);
+  });
+}
+
+int multipartParserInit(multipart_parser_t *parser, request_t *req,
+                        multipartDataHandler handler);
+int multipartParserExecute(multipart_parser_t *parser, const char *data,
+                           size_t length);
+multipart_part_t *multipartParseBody(request_t *req);
+
+/* A multipart body is parsed the first time one of its parts is asked for */
+static multipart_part_t *multipartParts(request_t *req) {
+  if (!req->multipartParsed) {
+    req->multipartParsed = 1;
+    req->parts = multipartParseBody(req);
+  }
+  return req->parts;
+}
+
+multipart_part_t *expressReqPart(request_t *req, const char *name) {
+  for (multipart_part_t *part = multipartParts(req); part != NULL;
+       part = part->next) {
+    if (strcmp(part->name, name) == 0)
+      return part;
+  }
+  return NULL;
+}
+
+static partBlock reqPartFactory(request_t *req) {
+  return Block_copy(^(const char *name) {
+    return expressReqPart(req, name);
+  });
+}
+
+/* The first file part, the rest follow it through nextFile */
+multipart_part_t *expressReqFiles(request_t *req) {
+  for (multipart_part_t *part = multipartParts(req); part != NULL;
+       part = part->next) {
+    if (part->filename != NULL)
+      return part;
+  }
+  return NULL;
+}
+
+static filesBlock reqFilesFactory(request_t *req) {
+  return Block_copy(^(void) {
+    return expressReqFiles(req);
+  });
+}
+
+/*
+  Hands each part to handler as it is parsed instead of storing it. Like
+  onData it reads the body through, so it is not also available to part().
+  Returns -1 for a body that is not multipart or cannot be parsed, for the
+  route to answer with a 400, and hands over nothing past the error.
+*/
+int expressReqOnPart(request_t *req, multipartDataHandler handler) {
+  __block int invalid = 0;
+  multipart_parser_t *parser = expressReqMalloc(req, sizeof(*parser));
+  check_mem(parser);
+  check(multipartParserInit(parser, req, handler) == 0,
+        "Not a multipart body");
+  req->multipartParsed = 1;
+  expressReqOnData(req, ^(const char *chunk, size_t length) {
+    if (!invalid && multipartParserExecute(parser, chunk, length) < 0)
+      invalid = 1;
+  });
+  check(!invalid && parser->state == MULTIPART_EPILOGUE,
+        "Invalid multipart body");
+  return 0;
+error:
+  return -1;
+}
+
+static onPartBlock reqOnPartFactory(request_t *req) {
+  return Block_copy(^(multipartDataHandler handler) {
+    return expressReqOnPart(req, handler);
+  });
+}
+
 char *expressReqBody(request_t *req, const char *key) {
   for (size_t i = 0; i != req->bodyKeyValueCount; ++i) {
     size_t keyLen = strlen(key);
@@ -388,6 +488,11 @@ char *expressReqBody(request_t *req, const char *key) {
     }
     curl_free(decodedKey);
   }
+
+  /* The fields of a multipart body */
+  multipart_part_t *part = expressReqPart(req, key);
+  if (part != NULL && part->filename == NULL)
+    return part->value;
   return (char *)NULL;
 }
 
@@ -411,6 +516,11 @@ static copyBlock reqBlockCopyFactory(request_t *req) {
 
 void expressReqHelpers(request_t *req) {
   req->malloc = reqMallocFactory(req);
+  req->readBody = reqReadBodyFactory(req);
+  req->onData = reqOnDataFactory(req);
+  req->part = reqPartFactory(req);
+  req->files = reqFilesFactory(req);
+  req->onPart = reqOnPartFactory(req);
   req->blockCopy = reqBlockCopyFactory(req);
   req->get = reqGetFactory(req);
   req->params = reqParamsFactory(req);
@@ -433,9 +543,123 @@ middlewareHandler expressHelpersMiddleware() {
   };
 }
 
+static int headerHasToken(request_t *req, const char *headerKey,
+                          const char *token) {
+  size_t headerKeyLen = strlen(headerKey);
+  size_t tokenLen = strlen(token);
+  for (size_t i = 0; i != req->numHeaders; ++i) {
+    if (req->headers[i].name_len != headerKeyLen ||
+        strncasecmp(req->headers[i].name, headerKey, headerKeyLen) != 0)
+      continue;
+    const char *value = req->headers[i].value;
+    const char *valueEnd = value + req->headers[i].value_len;
+    while (value < valueEnd) {
+      while (value < valueEnd && (*value == ' ' || *value == ','))
+        value++;
+      const char *tokenEnd = value;
+      while (tokenEnd < valueEnd && *tokenEnd != ',' && *tokenEnd != ' ')
+        tokenEnd++;
+      if ((size_t)(tokenEnd - value) == tokenLen &&
+          strncasecmp(value, token, tokenLen) == 0)
+        return 1;
+      value = tokenEnd;
+    }
+  }
+  return 0;
+}
+
+static int reqKeepAlive(request_t *req, client_t client) {
+  if (!client.keepAlive)
+    return 0;
+  if (headerHasToken(req, "Connection", "close"))
+    return 0;
+  if (req->httpVersionMinor == 0)
+    return headerHasToken(req, "Connection", "keep-alive");
+  return 1;
+}
+
+/* Digits only, as a sign or trailing junk is read differently by proxies */
+static long long parseContentLength(const char *value, size_t length) {
+  long long contentLength = 0;
+  if (length == 0)
+    return -1;
+  for (size_t i = 0; i < length; i++) {
+    if (value[i] < '0' || value[i] > '9' ||
+        contentLength > (LLONG_MAX - (value[i] - '0')) / 10)
+      return -1;
+    contentLength = contentLength * 10 + (value[i] - '0');
+  }
+  return contentLength;
+}
+
+/*
+  Length of the head of the first request in buf, -2 while it is still
+  incomplete or -1 when it can never be parsed. lastLen is how much of buf an
+  earlier call already saw, so a partial head is not rescanned. chunked is 1
+  for a chunked body and -1 for any other Transfer-Encoding, which is not
+  supported. contentLength is -1 when it is not a number, or when two
+  Content-Length headers disagree.
+*/
+ssize_t parseRequestHead(const char *buf, size_t len, size_t lastLen,
+                         long long *contentLength, int *expectContinue,
+                         int *chunked) {
+  const char *method, *path;
+  size_t methodLen, pathLen;
+  int minorVersion;
+  struct phr_header headers[100];
+  size_t numHeaders = sizeof(headers) / sizeof(headers[0]);
+
+  int parseBytes =
+      phr_parse_request(buf, len, &method, &methodLen, &path, &pathLen,
+                        &minorVersion, headers, &numHeaders, lastLen);
+  if (parseBytes < 0)
+    return parseBytes;
+
+  *contentLength = 0;
+  *expectContinue = 0;
+  *chunked = 0;
+  int hasContentLength = 0;
+  for (size_t i = 0; i != numHeaders; ++i) {
+    if (headers[i].name_len == strlen("Content-Length") &&
+        strncasecmp(headers[i].name, "Content-Length", headers[i].name_len) ==
+            0) {
+      long long length =
+          parseContentLength(headers[i].value, headers[i].value_len);
+      *contentLength =
+          hasContentLength && length != *contentLength ? -1 : length;
+      hasContentLength = 1;
+    } else if (headers[i].name_len == strlen("Transfer-Encoding") &&
+               strncasecmp(headers[i].name, "Transfer-Encoding",
+                           headers[i].name_len) == 0)
+      *chunked = headers[i].value_len == strlen("chunked") &&
+                         strncasecmp(headers[i].value, "chunked",
+                                     headers[i].value_len) == 0
+                     ? 1
+                     : -1;
+    else if (headers[i].name_len == strlen("Expect") &&
+             strncasecmp(headers[i].name, "Expect", headers[i].name_len) == 0)
+      *expectContinue =
+          headers[i].value_len == strlen("100-continue") &&
+          strncasecmp(headers[i].value, "100-continue", headers[i].value_len) ==
+              0;
+  }
+
+  /* Both framings at once is how requests get smuggled past a proxy */
+  if (*chunked != 0 && hasContentLength)
+    *chunked = -1;
+
+  return parseBytes;
+}
+
+char *clientPipelineTake(client_pipeline_t *pipeline);
+
 void buildRequest(request_t *req, client_t client, router_t *baseRouter) {
-  memset(req->rawRequest, 0, sizeof(req->rawRequest));
+  req->rawRequest = NULL;
   req->rawRequestSize = 0;
+  req->rawBody = NULL;
+  req->bodyReadOffset = 0;
+  req->parts = NULL;
+  req->multipartParsed = 0;
 
   req->get = NULL;
   req->query = NULL;
@@ -445,6 +669,11 @@ void buildRequest(request_t *req, client_t client, router_t *baseRouter) {
   req->m = NULL;
   req->mSet = NULL;
   req->malloc = NULL;
+  req->readBody = NULL;
+  req->onData = NULL;
+  req->part = NULL;
+  req->files = NULL;
+  req->onPart = NULL;
   req->blockCopy = NULL;
 
   req->memoryManager = createMemoryManager();
@@ -455,47 +684,43 @@ void buildRequest(request_t *req, client_t client, router_t *baseRouter) {
 
   char *method, *originalUrl;
   int parseBytes = 0, minorVersion;
-  size_t prevBufferLen = 0, methodLen, originalUrlLen;
-  ssize_t readBytes;
-
-  time_t start;
-  time(&start);
-  time_t current;
-
-  while (1) {
-    while ((readBytes =
-                read(client.socket, req->rawRequest + req->rawRequestSize,
-                     sizeof(req->rawRequest) - req->rawRequestSize)) == -1) {
-      time(&current);
-      time_t difference = difftime(current, start);
-      check(difference < READ_TIMEOUT_SECS, "request timeout");
-    }
-    check_silent(readBytes > 0, "read() failed");
-    prevBufferLen = req->rawRequestSize;
-    req->rawRequestSize += readBytes;
-    req->numHeaders = sizeof(req->headers) / sizeof(req->headers[0]);
-    parseBytes = phr_parse_request(
-        req->rawRequest, req->rawRequestSize, (const char **)&method,
-        &methodLen, (const char **)&originalUrl, &originalUrlLen, &minorVersion,
-        req->headers, &req->numHeaders, prevBufferLen);
-    if (parseBytes > 0) {
-      char *contentLength = expressReqGet(req, "Content-Length");
-      req->contentLength =
-          contentLength != NULL ? strtoll(contentLength, NULL, 10) : 0;
-      if (req->contentLength != 0 && parseBytes == readBytes)
-        while ((read(client.socket, req->rawRequest + req->rawRequestSize,
-                     sizeof(req->rawRequest) - req->rawRequestSize)) == -1)
-          ;
-      break;
-    } else if (parseBytes == -1)
-      sentinel("Parse error");
-    assert(parseBytes == -2);
-    if (req->rawRequestSize == sizeof(req->rawRequest))
-      sentinel("Request is too long");
+  size_t methodLen, originalUrlLen;
+
+  /* The connection has framed a complete request in its pipeline */
+  client_pipeline_t *pipeline = client.pipeline;
+  check(pipeline != NULL && pipeline->headLength > 0,
+        "No request has been read");
+
+  /* The request takes the pipeline's buffer, a spilled body its mapping */
+  size_t headLength = pipeline->headLength;
+  char *spill = pipeline->spill;
+  size_t spillSize = pipeline->bodyLength + 1;
+  req->contentLength = pipeline->bodyLength;
+  req->rawRequestSize =
+      headLength + (spill == NULL ? pipeline->bodyLength : 0);
+  char *rawRequest = clientPipelineTake(pipeline);
+  check_mem(rawRequest);
+  req->rawRequest = rawRequest;
+  mmCleanup(req->memoryManager, mmBlockCopy(req->memoryManager, ^{
+              free(rawRequest);
+            }));
+
+  req->rawBody = req->rawRequest + headLength;
+  if (spill != NULL) {
+    req->rawBody = spill;
+    mmCleanup(req->memoryManager, mmBlockCopy(req->memoryManager, ^{
+                munmap(spill, spillSize);
+              }));
   }
 
-  long long maxBodyLen = (MAX_REQUEST_SIZE)-parseBytes;
-  check(req->contentLength <= maxBodyLen, "Request body too large");
+  req->numHeaders = sizeof(req->headers) / sizeof(req->headers[0]);
+  parseBytes = phr_parse_request(
+      req->rawRequest, headLength, (const char **)&method, &methodLen,
+      (const char **)&originalUrl, &originalUrlLen, &minorVersion, req->headers,
+      &req->numHeaders, 0);
+  if (parseBytes == -1)
+    sentinel("Parse error");
+  check(parseBytes > 0, "Request is incomplete");
 
   req->middlewareCleanupBlocks = malloc(sizeof(cleanupHandler *));
 
@@ -537,6 +762,8 @@ void buildRequest(request_t *req, client_t client, router_t *baseRouter) {
   req->hostname = expressReqGet(req, "Host");
   req->ip = client.ip;
   req->protocol = "http"; // TODO: TLS/SSL support
+  req->httpVersionMinor = minorVersion;
+  req->keepAlive = reqKeepAlive(req, client);
   req->secure = strcmp(req->protocol, "https") == 0;
   req->XRequestedWith = expressReqGet(req, "X-Requested-With");
   req->xhr =
@@ -599,6 +826,11 @@ void freeRequest(request_t *req) {
   Block_release(req->m);
   Block_release(req->mSet);
   Block_release(req->malloc);
+  Block_release(req->readBody);
+  Block_release(req->onData);
+  Block_release(req->part);
+  Block_release(req->files);
+  Block_release(req->onPart);
   Block_release(req->blockCopy);
   curl_easy_cleanup(req->curl);
   free((void *)req->queryString);
@@ -1,4 +1,7 @@
 #include "express.h"
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 char *getStatusMessage(int status);
 
@@ -14,14 +17,6 @@ error_t *error404(request_t *req) {
   return err;
 }
 
-static size_t getFileSize(UNUSED const char *filePath) {
-  struct stat st;
-  check(stat(filePath, &st) >= 0, "Could not stat file %s", filePath);
-  return st.st_size;
-error:
-  return 0;
-}
-
 static char *getFileName(const char *filePath) {
   char *fileName = strrchr(filePath, '/');
   if (fileName)
@@ -33,6 +28,7 @@ void expressResSet(response_t *res, const char *key, const char *value) {
   for (size_t i = 0; i < res->headersKeyValueCount; i++) {
     if (strcmp(res->headersKeyValues[i].key, key) == 0) {
       res->headersKeyValues[i].value = value;
+      res->headersKeyValues[i].valueLen = strlen(value);
       return;
     }
   }
@@ -64,53 +60,74 @@ static getBlock resGetFactory(response_t *res) {
   });
 }
 
-static char *buildResponseString(const char *body, response_t *res) {
+static void bufferAppend(client_buffer_t *buffer, const char *data,
+                         size_t length) {
+  if (buffer->length + length > buffer->size) {
+    buffer->size = max(buffer->size * 2, buffer->length + length);
+    buffer->data = realloc(buffer->data, buffer->size);
+  }
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+}
+
+/* A response to HEAD has the headers a GET would, but never a body */
+static int headOnly(response_t *res) {
+  return strcmp(res->req->method, "HEAD") == 0;
+}
+
+/*
+  Serialises the status line, headers and cookies into buffer. When bodyLen
+  is negative the length is not known up front, so the body is chunked, or
+  on HTTP/1.0 runs until the connection closes. An HTTP/2 stream ends the
+  body with its last frame, so it needs neither.
+*/
+static void buildResponseHeaders(response_t *res, ssize_t bodyLen,
+                                 client_buffer_t *buffer) {
   if (expressResGet(res, "Content-Type") == NULL)
     expressResSet(res, "Content-Type", "text/html; charset=utf-8");
 
-  size_t contentSize = sizeof(char) * 20;
-  char *contentLength = malloc(contentSize);
-  snprintf(contentLength, contentSize, "%zu", strlen(body));
-  expressResSet(res, "Content-Length", contentLength);
-
-  expressResSet(res, "Connection", "close");
+  /* A 204 or 304 never has a body, so it has no length either */
+  int bodyless = res->status == 204 || res->status == 304;
+  if (bodyLen >= 0 && !bodyless) {
+    size_t contentSize = sizeof(char) * 21;
+    char *contentLength = expressReqMalloc(res->req, contentSize);
+    snprintf(contentLength, contentSize, "%zd", bodyLen);
+    expressResSet(res, "Content-Length", contentLength);
+  } else if (!bodyless && !headOnly(res) && res->client.stream == NULL &&
+             expressResGet(res, "Content-Length") == NULL) {
+    if (res->req->httpVersionMinor >= 1) {
+      res->chunked = 1;
+      expressResSet(res, "Transfer-Encoding", "chunked");
+    } else {
+      res->req->keepAlive = 0;
+    }
+  }
 
-  char *statusMessage = getStatusMessage(res->status);
-  size_t statusSize = sizeof(char) * (strlen(statusMessage) + 5);
-  char *status = malloc(statusSize);
-  snprintf(status, statusSize, "%d %s", res->status, statusMessage);
+  char *connection = expressResGet(res, "Connection");
+  if (connection != NULL && strcasecmp(connection, "close") == 0)
+    res->req->keepAlive = 0;
+  expressResSet(res, "Connection",
+                res->req->keepAlive ? "keep-alive" : "close");
 
-  size_t headersLength = 0;
-  char headers[4096];
-  memset(headers, 0, 4096);
+  char status[64];
+  int statusLen = snprintf(status, sizeof(status), "HTTP/1.1 %d %s\r\n",
+                           res->status, getStatusMessage(res->status));
+  statusLen = min(statusLen, (int)sizeof(status) - 1);
 
+  buffer->length = 0;
+  bufferAppend(buffer, status, statusLen);
   for (size_t i = 0; i < res->headersKeyValueCount; i++) {
-    size_t headerLength =
-        res->headersKeyValues[i].keyLen + res->headersKeyValues[i].valueLen + 4;
-    if (headersLength + headerLength > 4096)
-      break;
-    snprintf(headers + headersLength, 4096, "%s: %s\r\n",
-             res->headersKeyValues[i].key, res->headersKeyValues[i].value);
-    headersLength += headerLength;
+    bufferAppend(buffer, res->headersKeyValues[i].key,
+                 res->headersKeyValues[i].keyLen);
+    bufferAppend(buffer, ": ", 2);
+    bufferAppend(buffer, res->headersKeyValues[i].value,
+                 res->headersKeyValues[i].valueLen);
+    bufferAppend(buffer, "\r\n", 2);
   }
-
-  size_t allHeaderSize =
-      sizeof(char) * (strlen("HTTP/1.1 \r\n\r\n") + strlen(status) +
-                      headersLength + res->cookieHeadersLength + 1);
-
-  char *allHeaders = malloc(allHeaderSize);
-  snprintf(allHeaders, allHeaderSize, "HTTP/1.1 %s\r\n%s%s\r\n", status,
-           headers, res->cookieHeaders);
-
-  size_t allHeadersLen = strlen(allHeaders) + 1;
-  size_t bodyLen = strlen(body);
-  char *responseString = malloc(sizeof(char) * (allHeadersLen + bodyLen));
-  strncpy(responseString, allHeaders, allHeadersLen);
-  strncat(responseString, body, bodyLen);
-  free(status);
-  free(allHeaders);
-  free(contentLength);
-  return responseString;
+  if (res->headerBlock != NULL)
+    bufferAppend(buffer, res->headerBlock, res->headerBlockLength);
+  bufferAppend(buffer, res->cookieHeaders, res->cookieHeadersLength);
+  bufferAppend(buffer, "\r\n", 2);
 }
 
 void expressResError(response_t *res, error_t *err) { res->err = err; }
@@ -121,13 +138,47 @@ static setError resErrorFactory(response_t *res) {
   });
 }
 
-void expressResSend(response_t *res, const char *body) {
-  if (res->didSend == 1)
+void clientOutputWrite(client_output_t *output, int socket, struct iovec *iov,
+                       int count);
+void clientOutputWriteFile(client_output_t *output, int socket, int fd,
+                           off_t offset, size_t length);
+
+static void writeToClient(response_t *res, struct iovec *iov, int count) {
+  if (res->client.output == NULL) {
+    writev(res->client.socket, iov, count);
+    return;
+  }
+  clientOutputWrite(res->client.output, res->client.socket, iov, count);
+}
+
+/*
+  Headers and body go out in one writev, without being copied together.
+  Clients without a header buffer of their own get a temporary one.
+*/
+static void sendResponse(response_t *res, const char *body, size_t bodyLen) {
+  if (res->didSend == 1 || res->headersSent == 1)
     return;
-  char *response = buildResponseString(body, res);
+  client_buffer_t localBuffer = {.data = NULL, .length = 0, .size = 0};
+  client_buffer_t *headers = res->client.headerBuffer != NULL
+                                 ? res->client.headerBuffer
+                                 : &localBuffer;
+  buildResponseHeaders(res, bodyLen, headers);
   res->didSend = 1;
-  write(res->client.socket, response, strlen(response));
-  free(response);
+  res->headersSent = 1;
+  struct iovec iov[2] = {
+      {.iov_base = headers->data, .iov_len = headers->length},
+      {.iov_base = (void *)body, .iov_len = bodyLen}};
+  writeToClient(res, iov, bodyLen > 0 && !headOnly(res) ? 2 : 1);
+  free(localBuffer.data);
+}
+
+void expressResSend(response_t *res, const char *body) {
+  sendResponse(res, body, strlen(body));
+}
+
+/* For bodies that are not strings, such as embedded files */
+void expressResSendBuffer(response_t *res, const char *body, size_t bodyLen) {
+  sendResponse(res, body, bodyLen);
 }
 
 static sendBlock resSendFactory(response_t *res) {
@@ -136,60 +187,296 @@ static sendBlock resSendFactory(response_t *res) {
   });
 }
 
+/* Formats into the stack buffer, or the heap when the body outgrows it */
+static void sendFormatted(response_t *res, const char *format, va_list args) {
+  char buffer[65536];
+  char *body = buffer;
+  va_list argsCopy;
+  va_copy(argsCopy, args);
+  int bodyLen = vsnprintf(buffer, sizeof(buffer), format, args);
+  if (bodyLen >= (int)sizeof(buffer)) {
+    body = malloc(bodyLen + 1);
+    if (body != NULL)
+      vsnprintf(body, bodyLen + 1, format, argsCopy);
+  }
+  va_end(argsCopy);
+  if (bodyLen >= 0 && body != NULL)
+    sendResponse(res, body, bodyLen);
+  if (body != buffer)
+    free(body);
+}
+
 void expressResSendf(response_t *res, const char *format, ...) {
-  char body[65536];
   va_list args;
   va_start(args, format);
-  vsnprintf(body, 65536, format, args);
-  expressResSend(res, body);
+  sendFormatted(res, format, args);
   va_end(args);
 }
 
 static sendfBlock resSendfFactory(response_t *res) {
   return Block_copy(^(const char *format, ...) {
-    char body[65536];
     va_list args;
     va_start(args, format);
-    vsnprintf(body, 65536, format, args);
-    expressResSend(res, body);
+    sendFormatted(res, format, args);
     va_end(args);
   });
 }
 
+/* Sends the headers on their own, ahead of a body that is sent in pieces */
+static void sendHeaders(response_t *res, size_t bodyLen) {
+  client_buffer_t localBuffer = {.data = NULL, .length = 0, .size = 0};
+  client_buffer_t *headers = res->client.headerBuffer != NULL
+                                 ? res->client.headerBuffer
+                                 : &localBuffer;
+  buildResponseHeaders(res, bodyLen, headers);
+  res->didSend = 1;
+  res->headersSent = 1;
+
+  struct iovec iov = {.iov_base = headers->data, .iov_len = headers->length};
+  writeToClient(res, &iov, 1);
+  free(localBuffer.data);
+}
+
+static void sendString(response_t *res, const char *data) {
+  if (headOnly(res))
+    return;
+  struct iovec iov = {.iov_base = (void *)data, .iov_len = strlen(data)};
+  writeToClient(res, &iov, 1);
+}
+
+/* Sends length bytes of fd from offset, leaving fd open for the caller */
+static void sendFileRange(response_t *res, int fd, size_t offset,
+                          size_t length) {
+  if (headOnly(res))
+    return;
+
+  /* Sent with sendfile() as the socket drains, the queue closes its copy */
+  if (res->client.output != NULL) {
+    int queuedFd = dup(fd);
+    check(queuedFd >= 0, "dup() failed");
+    clientOutputWriteFile(res->client.output, res->client.socket, queuedFd,
+                          offset, length);
+    return;
+  }
+
+  /* Without an output queue the socket blocks until it takes the lot */
+  off_t position = offset;
+  size_t end = offset + length;
+  while ((size_t)position < end) {
+#ifdef __linux__
+    ssize_t sent = sendfile(res->client.socket, fd, &position, end - position);
+    if (sent <= 0 && errno != EINTR)
+      break;
+#else
+    off_t sent = end - position;
+    int result = sendfile(fd, res->client.socket, position, &sent, NULL, 0);
+    position += sent;
+    if (result < 0 && errno != EINTR && errno != EAGAIN)
+      break;
+    if (result == 0 && sent == 0)
+      break;
+#endif
+  }
+error:
+  return;
+}
+
+static char *httpDate(response_t *res, time_t time) {
+  struct tm tm;
+  char *date = expressReqMalloc(res->req, 32);
+  gmtime_r(&time, &tm);
+  strftime(date, 32, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return date;
+}
+
+/*
+  The ranges of the Range header that fall within the file, 0 when none do
+  and -1 when the whole file should be sent instead, for a missing Range or
+  one that is stale by If-Range, cannot be parsed or asks for too much.
+*/
+static int requestedRanges(response_t *res, size_t fileSize,
+                           byte_range_t *ranges, const char *etag,
+                           const char *lastModified) {
+  char *range = expressReqGet(res->req, "Range");
+  if (range == NULL || strncmp(range, "bytes=", 6) != 0)
+    return -1;
+
+  /* Only a strong validator can say the ranges are of the same file */
+  char *ifRange = expressReqGet(res->req, "If-Range");
+  if (ifRange != NULL) {
+    int matches = (etag != NULL && strncmp(etag, "W/", 2) != 0 &&
+                   strcmp(ifRange, etag) == 0) ||
+                  (lastModified != NULL && strcmp(ifRange, lastModified) == 0);
+    if (!matches)
+      return -1;
+  }
+
+  int count = 0;
+  int specs = 0;
+  char *spec = range + strlen("bytes=");
+  while (1) {
+    while (*spec == ' ' || *spec == '\t' || *spec == ',')
+      spec++;
+    if (*spec == '\0')
+      break;
+    if (++specs > MAX_RANGES)
+      return -1;
+
+    char *end;
+    unsigned long long first, last;
+    if (*spec == '-') {
+      if (!isdigit((unsigned char)spec[1]))
+        return -1;
+      unsigned long long suffix = strtoull(spec + 1, &end, 10);
+      first = suffix == 0 ? fileSize : fileSize - min(suffix, fileSize);
+      last = ULLONG_MAX;
+    } else {
+      if (!isdigit((unsigned char)*spec))
+        return -1;
+      first = strtoull(spec, &end, 10);
+      if (*end++ != '-')
+        return -1;
+      last = ULLONG_MAX;
+      if (isdigit((unsigned char)*end))
+        last = strtoull(end, &end, 10);
+      if (last < first)
+        return -1;
+    }
+    while (*end == ' ' || *end == '\t')
+      end++;
+    if (*end != ',' && *end != '\0')
+      return -1;
+    spec = end;
+
+    /* A range that starts past the end is left out, not an error */
+    if (first >= fileSize)
+      continue;
+    last = min(last, (unsigned long long)fileSize - 1);
+    ranges[count++] = (byte_range_t){.start = first,
+                                     .length = last - first + 1};
+  }
+  return specs > 0 ? count : -1;
+}
+
+static void sendUnsatisfiable(response_t *res, size_t fileSize) {
+  char *contentRange = expressReqMalloc(res->req, 32);
+  snprintf(contentRange, 32, "bytes */%zu", fileSize);
+  expressResSet(res, "Content-Range", contentRange);
+  res->status = 416;
+  sendResponse(res, "", 0);
+}
+
+static char *contentRange(response_t *res, byte_range_t range,
+                          size_t fileSize) {
+  char *contentRange = expressReqMalloc(res->req, 72);
+  snprintf(contentRange, 72, "bytes %zu-%zu/%zu", range.start,
+           range.start + range.length - 1, fileSize);
+  return contentRange;
+}
+
+/* More than one range goes out as a multipart/byteranges body */
+static void sendRanges(response_t *res, int fd, size_t fileSize,
+                       byte_range_t *ranges, int count) {
+  uuid_t uuid;
+  char boundary[37];
+  uuid_generate(uuid);
+  uuid_unparse_lower(uuid, boundary);
+
+  char *contentType = expressResGet(res, "Content-Type");
+  if (contentType == NULL)
+    contentType = "application/octet-stream";
+  char *partHeaders[MAX_RANGES];
+  size_t bodyLen = strlen("\r\n--") + strlen(boundary) + strlen("--\r\n");
+  for (int i = 0; i < count; i++) {
+    size_t size = strlen(contentType) + strlen(boundary) + 160;
+    partHeaders[i] = expressReqMalloc(res->req, size);
+    snprintf(partHeaders[i], size,
+             "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: %s\r\n\r\n",
+             boundary, contentType, contentRange(res, ranges[i], fileSize));
+    bodyLen += strlen(partHeaders[i]) + ranges[i].length;
+  }
+
+  size_t typeSize = strlen("multipart/byteranges; boundary=") + 37;
+  char *multipartType = expressReqMalloc(res->req, typeSize);
+  snprintf(multipartType, typeSize, "multipart/byteranges; boundary=%s",
+           boundary);
+  expressResSet(res, "Content-Type", multipartType);
+  res->status = 206;
+  sendHeaders(res, bodyLen);
+
+  for (int i = 0; i < count; i++) {
+    sendString(res, partHeaders[i]);
+    sendFileRange(res, fd, ranges[i].start, ranges[i].length);
+  }
+  char closing[48];
+  snprintf(closing, sizeof(closing), "\r\n--%s--\r\n", boundary);
+  sendString(res, closing);
+}
+
+/* The validators are only needed to tell whether If-Range still holds */
+static void sendFileBody(response_t *res, int fd, size_t fileSize,
+                         const char *etag, const char *lastModified) {
+  byte_range_t ranges[MAX_RANGES];
+  int rangeCount =
+      res->status == 200
+          ? requestedRanges(res, fileSize, ranges, etag, lastModified)
+          : -1;
+  if (rangeCount == 0) {
+    sendUnsatisfiable(res, fileSize);
+  } else if (rangeCount == 1) {
+    expressResSet(res, "Content-Range",
+                  contentRange(res, ranges[0], fileSize));
+    res->status = 206;
+    sendHeaders(res, ranges[0].length);
+    sendFileRange(res, fd, ranges[0].start, ranges[0].length);
+  } else if (rangeCount > 1) {
+    sendRanges(res, fd, fileSize, ranges, rangeCount);
+  } else {
+    sendHeaders(res, fileSize);
+    sendFileRange(res, fd, 0, fileSize);
+  }
+}
+
+/* Sends an already open regular file, leaving fd open for the caller */
+void expressResSendFileDescriptor(response_t *res, int fd, size_t fileSize,
+                                  time_t modified) {
+  if (res->didSend == 1 || res->headersSent == 1)
+    return;
+  expressResSet(res, "Accept-Ranges", "bytes");
+  if (expressResGet(res, "Last-Modified") == NULL)
+    expressResSet(res, "Last-Modified", httpDate(res, modified));
+  sendFileBody(res, fd, fileSize, expressResGet(res, "ETag"),
+               expressResGet(res, "Last-Modified"));
+}
+
+/*
+  Like expressResSendFileDescriptor, for a file whose Accept-Ranges,
+  validators and the like are already laid out in res->headerBlock
+*/
+void expressResSendFileBlock(response_t *res, int fd, size_t fileSize,
+                             const char *etag, const char *lastModified) {
+  if (res->didSend == 1 || res->headersSent == 1)
+    return;
+  sendFileBody(res, fd, fileSize, etag, lastModified);
+}
+
 void expressResSendFile(response_t *res, const char *path) {
-  if (res->didSend == 1)
+  if (res->didSend == 1 || res->headersSent == 1)
     return;
-  FILE *file = fopen(path, "r");
-  if (file == NULL) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    if (fd >= 0)
+      close(fd);
     error_t *err = error404(res->req);
     expressResError(res, err);
     return;
   }
-  char *mimetype =
-      (char *)getMegaMimeType((const char *)path); // TODO: check for NULL
-  char *response =
-      malloc(sizeof(char) *
-             (strlen(mimetype) +
-              strlen("HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Type: "
-                     "\r\nContent-Length: \r\n\r\n") +
-              20));
-  // TODO: use res.set() and refactor header building
-  size_t fileSize = getFileSize(path);
-  snprintf(response, 4096,
-           "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Type: "
-           "%s\r\nContent-Length: %zu\r\n\r\n",
-           mimetype, fileSize);
-  res->didSend = 1;
-  write(res->client.socket, response, strlen(response));
-  // TODO: use sendfile
-  char *buffer = malloc(4096);
-  size_t read;
-  while ((read = fread(buffer, 1, 4096, file)) > 0) {
-    write(res->client.socket, buffer, read);
-  }
-  free(buffer);
-  free(response);
-  fclose(file);
+  const char *mimetype = expressMimeType(path);
+  if (mimetype != NULL && expressResGet(res, "Content-Type") == NULL)
+    expressResSet(res, "Content-Type", mimetype);
+  expressResSendFileDescriptor(res, fd, st.st_size, st.st_mtime);
+  close(fd);
 }
 
 static sendBlock resSendFileFactory(response_t *res) {
@@ -198,6 +485,89 @@ static sendBlock resSendFileFactory(response_t *res) {
   });
 }
 
+/* 0 once the client is far enough behind that the caller should hold off */
+static int clientWritable(response_t *res) {
+  client_output_t *output = res->client.output;
+  return output == NULL || output->length <= output->highWaterMark;
+}
+
+/*
+  Sends the headers along with the first chunk. Without a Content-Length
+  header the body is sent with chunked transfer encoding.
+*/
+int expressResWrite(response_t *res, const char *data, size_t length) {
+  if (res->didSend == 1)
+    return 0;
+
+  struct iovec iov[4];
+  int count = 0;
+  client_buffer_t localBuffer = {.data = NULL, .length = 0, .size = 0};
+  if (res->headersSent == 0) {
+    client_buffer_t *headers = res->client.headerBuffer != NULL
+                                   ? res->client.headerBuffer
+                                   : &localBuffer;
+    buildResponseHeaders(res, -1, headers);
+    res->headersSent = 1;
+    iov[count++] =
+        (struct iovec){.iov_base = headers->data, .iov_len = headers->length};
+  }
+
+  if (headOnly(res))
+    length = 0;
+
+  /* An empty chunk would end the body */
+  char chunkSize[20];
+  if (length > 0 && res->chunked) {
+    int chunkSizeLen =
+        snprintf(chunkSize, sizeof(chunkSize), "%zx\r\n", length);
+    iov[count++] =
+        (struct iovec){.iov_base = chunkSize, .iov_len = chunkSizeLen};
+  }
+  if (length > 0)
+    iov[count++] = (struct iovec){.iov_base = (void *)data, .iov_len = length};
+  if (length > 0 && res->chunked)
+    iov[count++] = (struct iovec){.iov_base = "\r\n", .iov_len = 2};
+
+  if (count > 0)
+    writeToClient(res, iov, count);
+  free(localBuffer.data);
+  return clientWritable(res);
+}
+
+static writeBlock resWriteFactory(response_t *res) {
+  return Block_copy(^(const char *data, size_t length) {
+    return expressResWrite(res, data, length);
+  });
+}
+
+void expressResFlushHeaders(response_t *res) { expressResWrite(res, NULL, 0); }
+
+static endBlock resFlushHeadersFactory(response_t *res) {
+  return Block_copy(^() {
+    expressResFlushHeaders(res);
+  });
+}
+
+void expressResEnd(response_t *res) {
+  if (res->didSend == 1)
+    return;
+  if (res->headersSent == 0) {
+    sendResponse(res, "", 0);
+    return;
+  }
+  res->didSend = 1;
+  if (res->chunked) {
+    struct iovec iov = {.iov_base = "0\r\n\r\n", .iov_len = 5};
+    writeToClient(res, &iov, 1);
+  }
+}
+
+static endBlock resEndFactory(response_t *res) {
+  return Block_copy(^() {
+    expressResEnd(res);
+  });
+}
+
 void expressResStatus(response_t *res, int status) {
   res->status = status;
   expressResSend(res, getStatusMessage(status));
@@ -210,7 +580,7 @@ static sendStatusBlock resSendStatusFactory(response_t *res) {
 }
 
 void expressResType(response_t *res, const char *type) {
-  const char *mimetype = getMegaMimeType(type);
+  const char *mimetype = expressMimeType(type);
   if (mimetype != NULL) {
     expressResSet(res, "Content-Type", mimetype);
   }
@@ -240,12 +610,11 @@ void expressResDownload(response_t *res, const char *filePath,
 
   size_t contentDispositionSize =
       sizeof(char) *
-      (strlen("Content-Disposition: attachment; filename=\"\"\r\n") +
-       strlen(fileName) + 1);
+      (strlen("attachment; filename=\"\"") + strlen(fileName) + 1);
 
   char *contentDisposition = expressReqMalloc(res->req, contentDispositionSize);
   snprintf(contentDisposition, contentDispositionSize,
-           "Content-Disposition: attachment; filename=\"%s\"\r\n", fileName);
+           "attachment; filename=\"%s\"", fileName);
 
   expressResSet(res, "Content-Disposition", contentDisposition);
   expressResSendFile(res, filePath);
@@ -419,6 +788,9 @@ static senderBlock resSenderFactory(response_t *res) {
 void freeResponse(response_t *res) {
   Block_release(res->send);
   Block_release(res->sendFile);
+  Block_release(res->write);
+  Block_release(res->flushHeaders);
+  Block_release(res->end);
   Block_release(res->sendf);
   Block_release(res->sendStatus);
   Block_release(res->set);
@@ -440,6 +812,9 @@ void expressResHelpers(response_t *res) {
   res->send = resSendFactory(res);
   res->sendf = resSendfFactory(res);
   res->sendFile = resSendFileFactory(res);
+  res->write = resWriteFactory(res);
+  res->flushHeaders = resFlushHeadersFactory(res);
+  res->end = resEndFactory(res);
   res->sendStatus = resSendStatusFactory(res);
   res->set = resSetFactory(res);
   res->get = resGetFactory(res);
@@ -460,11 +835,16 @@ void buildResponse(client_t client, request_t *req, response_t *res) {
   res->req = req;
   res->status = 200;
   res->didSend = 0;
+  res->headersSent = 0;
+  res->chunked = 0;
   res->sendersCount = 0;
 
   res->send = NULL;
   res->sendf = NULL;
   res->sendFile = NULL;
+  res->write = NULL;
+  res->flushHeaders = NULL;
+  res->end = NULL;
   res->sendStatus = NULL;
   res->set = NULL;
   res->get = NULL;
@@ -485,6 +865,8 @@ void buildResponse(client_t client, request_t *req, response_t *res) {
   // initResCookie
   memset(res->cookieHeaders, 0, sizeof(res->cookieHeaders));
   res->cookieHeadersLength = 0;
+  res->headerBlock = NULL;
+  res->headerBlockLength = 0;
 
   // initResSet
   res->headersKeyValueCount = 0;
@@ -1,6 +1,7 @@
 #include "express.h"
 
 error_t *error404(request_t *req);
+void websocketRoute(request_t *req, response_t *res, websocketHandler handler);
 
 null nullop = ^{
 };
@@ -295,6 +296,13 @@ router_t *expressRouter() {
     addRouteHandler("DELETE", path, handler);
   });
 
+  /* The handshake is a GET, so it goes through the middleware like one */
+  router->ws = Block_copy(^(const char *path, websocketHandler handler) {
+    addRouteHandler("GET", path, Block_copy(^(request_t *req, response_t *res) {
+                      websocketRoute(req, res, handler);
+                    }));
+  });
+
   router->error = Block_copy(^(errorHandler handler) {
     router->errorHandlers =
         realloc(router->errorHandlers,
@@ -447,6 +455,7 @@ router_t *expressRouter() {
     Block_release(router->patch);
     Block_release(router->delete);
     Block_release(router->all);
+    Block_release(router->ws);
     Block_release(router->use);
     Block_release(router->error);
     Block_release(router->mountTo);
@@ -1,56 +1,458 @@
 #include "express.h"
+#include <stddef.h>
+#include <sys/un.h>
+
+uint64_t timerWheelNow();
+
+/* "unix:/path", an IPv4 or IPv6 address, or either with a port after it */
+static int parseAddress(const char *text, int port,
+                        struct sockaddr_storage *address, socklen_t *length) {
+  memset(address, 0, sizeof(*address));
+  if (strncmp(text, "unix:", 5) == 0) {
+    struct sockaddr_un *unixAddress = (struct sockaddr_un *)address;
+    const char *path = text + 5;
+    check(*path != '\0' && strlen(path) < sizeof(unixAddress->sun_path),
+          "%s is not a Unix socket path", text);
+    unixAddress->sun_family = AF_UNIX;
+    strcpy(unixAddress->sun_path, path);
+    *length = sizeof(*unixAddress);
+    return 0;
+  }
+
+  const char *host = text;
+  size_t hostLength = strlen(text);
+  const char *portText = NULL;
+  if (text[0] == '[') {
+    const char *end = strchr(text, ']');
+    check(end != NULL && (end[1] == '\0' || end[1] == ':'),
+          "%s is not an address", text);
+    host = text + 1;
+    hostLength = end - host;
+    if (end[1] == ':')
+      portText = end + 2;
+  } else {
+    /* A bare IPv6 address has more than one colon */
+    const char *colon = strchr(text, ':');
+    if (colon != NULL && strchr(colon + 1, ':') == NULL) {
+      hostLength = colon - text;
+      portText = colon + 1;
+    }
+  }
+  if (portText != NULL) {
+    char *end;
+    long value = strtol(portText, &end, 10);
+    check(end != portText && *end == '\0' && value >= 0 && value <= 65535,
+          "%s has no valid port", text);
+    port = value;
+  }
+
+  char hostText[INET6_ADDRSTRLEN];
+  check(hostLength < sizeof(hostText), "%s is not an address", text);
+  memcpy(hostText, host, hostLength);
+  hostText[hostLength] = '\0';
+
+  struct sockaddr_in *inetAddress = (struct sockaddr_in *)address;
+  struct sockaddr_in6 *inet6Address = (struct sockaddr_in6 *)address;
+  if (inet_pton(AF_INET, hostText, &inetAddress->sin_addr) == 1) {
+    inetAddress->sin_family = AF_INET;
+    inetAddress->sin_port = htons(port);
+    *length = sizeof(*inetAddress);
+  } else if (inet_pton(AF_INET6, hostText, &inet6Address->sin6_addr) == 1) {
+    inet6Address->sin6_family = AF_INET6;
+    inet6Address->sin6_port = htons(port);
+    *length = sizeof(*inet6Address);
+  } else {
+    sentinel("%s is not an address", text);
+  }
+  return 0;
+error:
+  return -1;
+}
+
+static int sameAddress(const struct sockaddr_storage *a,
+                       const struct sockaddr_storage *b) {
+  if (a->ss_family != b->ss_family)
+    return 0;
+  if (a->ss_family == AF_INET) {
+    const struct sockaddr_in *x = (const struct sockaddr_in *)a;
+    const struct sockaddr_in *y = (const struct sockaddr_in *)b;
+    return x->sin_port == y->sin_port &&
+           x->sin_addr.s_addr == y->sin_addr.s_addr;
+  }
+  if (a->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 *y = (const struct sockaddr_in6 *)b;
+    return x->sin6_port == y->sin6_port &&
+           memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
+  }
+  if (a->ss_family == AF_UNIX)
+    return strcmp(((const struct sockaddr_un *)a)->sun_path,
+                  ((const struct sockaddr_un *)b)->sun_path) == 0;
+  return 0;
+}
+
+/* The socket the replaced process listened on at address, if it had one */
+static int takeInheritedSocket(server_t *server,
+                               const struct sockaddr_storage *address) {
+  for (int i = 0; i < server->inheritedCount; i++) {
+    int inherited = server->inheritedSockets[i];
+    struct sockaddr_storage bound;
+    socklen_t length = sizeof(bound);
+    if (inherited < 0 ||
+        getsockname(inherited, (struct sockaddr *)&bound, &length) < 0)
+      continue;
+    if (sameAddress(&bound, address)) {
+      server->inheritedSockets[i] = -1;
+      return inherited;
+    }
+  }
+  return -1;
+}
+
+/* Unlinks a Unix socket left behind by a process that is no longer there */
+static void removeStaleSocket(const struct sockaddr_un *address) {
+  struct stat st;
+  if (stat(address->sun_path, &st) < 0 || !S_ISSOCK(st.st_mode))
+    return;
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (probe < 0)
+    return;
+  if (connect(probe, (const struct sockaddr *)address, sizeof(*address)) < 0 &&
+      errno == ECONNREFUSED)
+    unlink(address->sun_path);
+  close(probe);
+  errno = 0;
+}
+
+/* -EAFNOSUPPORT when the kernel has no such family, IPv6 being optional */
+static int openListener(server_t *server,
+                        const struct sockaddr_storage *address,
+                        socklen_t length, int v6Only, int reusePort) {
+  int flag = 1;
+  int listener = takeInheritedSocket(server, address);
+  if (listener >= 0)
+    return listener;
+
+  int family = address->ss_family;
+  if ((listener = socket(family, SOCK_STREAM, 0)) < 0) {
+    if (errno == EAFNOSUPPORT)
+      return -EAFNOSUPPORT;
+    sentinel("socket() failed");
+  }
+  if (family == AF_UNIX) {
+    removeStaleSocket((const struct sockaddr_un *)address);
+  } else {
+    check(setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &flag,
+                     sizeof(flag)) >= 0,
+          "setsockopt() failed");
+    if (reusePort)
+      check(setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &flag,
+                       sizeof(flag)) >= 0,
+            "setsockopt() failed");
+  }
+  if (family == AF_INET6)
+    check(setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only,
+                     sizeof(v6Only)) >= 0,
+          "setsockopt() failed");
+  check(bind(listener, (const struct sockaddr *)address, length) >= 0,
+        "bind() failed");
+  check(fcntl(listener, F_SETFL, O_NONBLOCK) >= 0, "fcntl() failed");
+  check(listen(listener, 10000) >= 0, "listen() failed");
+
+  return listener;
+error:
+  if (listener >= 0)
+    close(listener);
+  return -1;
+}
+
+/* Every interface, with IPv4 mapped into IPv6 unless there is no IPv6 */
+static int listenEverywhere(server_t *server, int port) {
+  struct sockaddr_storage address;
+  memset(&address, 0, sizeof(address));
+  struct sockaddr_in6 *inet6Address = (struct sockaddr_in6 *)&address;
+  inet6Address->sin6_family = AF_INET6;
+  inet6Address->sin6_port = htons(port);
+  inet6Address->sin6_addr = in6addr_any;
+  int listener = openListener(server, &address, sizeof(*inet6Address), 0,
+                              server->reusePort);
+  if (listener != -EAFNOSUPPORT)
+    return listener;
+
+  errno = 0;
+  memset(&address, 0, sizeof(address));
+  struct sockaddr_in *inetAddress = (struct sockaddr_in *)&address;
+  inetAddress->sin_family = AF_INET;
+  inetAddress->sin_port = htons(port);
+  inetAddress->sin_addr.s_addr = htonl(INADDR_ANY);
+  return openListener(server, &address, sizeof(*inetAddress), 0,
+                      server->reusePort);
+}
+
+static int reusesPort(int listener) {
+  int reusePort = 0;
+  socklen_t length = sizeof(reusePort);
+  return getsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &reusePort,
+                    &length) == 0 &&
+         reusePort;
+}
+
+static void closeListener(int listener, int removePath) {
+  struct sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  if (removePath &&
+      getsockname(listener, (struct sockaddr *)&address, &length) == 0 &&
+      address.ss_family == AF_UNIX)
+    unlink(((struct sockaddr_un *)&address)->sun_path);
+  /* A pending io_uring accept holds a reference until the socket is shut */
+  shutdown(listener, SHUT_RDWR);
+  close(listener);
+}
+
+/* The client's address as text, an IPv4 client on a dual-stack socket too */
+void formatClientAddress(const struct sockaddr_storage *address,
+                         socklen_t length, char *text, size_t size) {
+  text[0] = '\0';
+  if (address->ss_family == AF_INET) {
+    const struct sockaddr_in *inetAddress =
+        (const struct sockaddr_in *)address;
+    inet_ntop(AF_INET, &inetAddress->sin_addr, text, size);
+  } else if (address->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *inet6Address =
+        (const struct sockaddr_in6 *)address;
+    if (IN6_IS_ADDR_V4MAPPED(&inet6Address->sin6_addr))
+      inet_ntop(AF_INET, &inet6Address->sin6_addr.s6_addr[12], text, size);
+    else
+      inet_ntop(AF_INET6, &inet6Address->sin6_addr, text, size);
+  } else if (address->ss_family == AF_UNIX) {
+    /* Connecting clients are rarely bound to a path, so it is often empty */
+    const struct sockaddr_un *unixAddress =
+        (const struct sockaddr_un *)address;
+    int pathLength = (int)length - (int)offsetof(struct sockaddr_un, sun_path);
+    snprintf(text, size, "unix:%.*s", max(pathLength, 0),
+             unixAddress->sun_path);
+  }
+}
+
+/*
+  Another process accepts from the same sockets now, so they are closed
+  without being shut down, once no worker here will accept from them again.
+*/
+static void releaseListeningSockets(server_t *server) {
+  while (__atomic_load_n(&server->accepting, __ATOMIC_ACQUIRE) > 0)
+    usleep(1000);
+  for (int i = 0; i < server->listenerCount; i++)
+    close(server->listeners[i]);
+  server->listenerCount = 0;
+  server->socket = -1;
+  for (int i = 0; i < server->shardCount; i++)
+    close(server->shardSockets[i]);
+  server->shardCount = 0;
+}
+
+/* Another socket on the first address, for a reuse-port shard */
+int initReusePortSocket(server_t *server) {
+  struct sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  int v6Only = 0;
+  socklen_t v6OnlyLength = sizeof(v6Only);
+  check(getsockname(server->socket, (struct sockaddr *)&address, &length) >= 0,
+        "getsockname() failed");
+  if (address.ss_family == AF_INET6)
+    check(getsockopt(server->socket, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only,
+                     &v6OnlyLength) >= 0,
+          "getsockopt() failed");
+  return openListener(server, &address, length, v6Only, 1);
+error:
+  return -1;
+}
+
+/* Closes whatever was taken over from the replaced process and not used */
+void releaseInheritedSockets(server_t *server) {
+  for (int i = 0; i < server->inheritedCount; i++)
+    if (server->inheritedSockets[i] >= 0)
+      close(server->inheritedSockets[i]);
+  free(server->inheritedSockets);
+  server->inheritedSockets = NULL;
+  server->inheritedCount = 0;
+}
 
 server_t *expressServer() {
   server_t *server = malloc(sizeof(server_t));
 
   server->socket = -1;
+  server->port = 0;
+  server->addresses = NULL;
+  server->listeners = NULL;
+  server->listenerCount = 0;
   server->serverQueue =
       dispatch_queue_create("serverQueue", DISPATCH_QUEUE_CONCURRENT);
 
   server->threadCount = 32;
   server->maxEvents = 4;
 
+  server->keepAlive = 1;
+  server->keepAliveTimeout = KEEP_ALIVE_TIMEOUT_SECS;
+  server->keepAliveMaxRequests = KEEP_ALIVE_MAX_REQUESTS;
+  server->maxPipelineDepth = MAX_PIPELINE_DEPTH;
+  server->outputHighWaterMark = OUTPUT_HIGH_WATER_MARK;
+  server->maxBodySize = MAX_BODY_SIZE;
+  server->bodySpillThreshold = BODY_SPILL_THRESHOLD;
+
+  server->acceptTimeout = ACCEPT_TIMEOUT_SECS;
+  server->headerTimeout = READ_TIMEOUT_SECS;
+  server->bodyTimeout = READ_TIMEOUT_SECS;
+  server->writeTimeout = WRITE_TIMEOUT_SECS;
+  server->websocketPingInterval = WEBSOCKET_PING_INTERVAL_SECS;
+  server->sseHeartbeatInterval = SSE_HEARTBEAT_INTERVAL_SECS;
+  server->drainTimeout = DRAIN_TIMEOUT_SECS;
+  server->draining = 0;
+  server->drainExpired = 0;
+  server->connections = 0;
+  server->workers = 0;
+  server->drainFd = -1;
+  server->accepting = 0;
+  server->pidFile = NULL;
+  server->handoffPath = NULL;
+  server->handoffSocket = -1;
+  server->handoffSource = NULL;
+  server->handoffPeer = -1;
+  server->inheritedSockets = NULL;
+  server->inheritedCount = 0;
+  server->handedOff = 0;
+
+  server->reusePort = 0;
+  server->ioUring = 0;
+  /* Cleartext HTTP/2 is only spoken to by apps that ask for it */
+  server->http2 = 0;
+  server->shardSockets = NULL;
+  server->shardCount = 0;
+
   server->close = Block_copy(^() {
-    close(server->socket);
+    for (int i = 0; i < server->listenerCount; i++)
+      closeListener(server->listeners[i], 1);
+    server->listenerCount = 0;
     server->socket = -1;
+    for (int i = 0; i < server->shardCount; i++) {
+      shutdown(server->shardSockets[i], SHUT_RDWR);
+      close(server->shardSockets[i]);
+    }
+    server->shardCount = 0;
+  });
+
+  /*
+    Stops accepting and waits for the workers to finish with their
+    connections, which they close as they go idle. Past drainTimeout the
+    workers close whatever is left. Returns -1 when that happened.
+  */
+  server->drain = Block_copy(^(drainProgressHandler progress) {
+    uint64_t start = timerWheelNow();
+    __atomic_store_n(&server->draining, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (server->drainFd >= 0 && write(server->drainFd, &one, sizeof(one)) < 0)
+      log_err("write() failed");
+    if (__atomic_load_n(&server->handedOff, __ATOMIC_ACQUIRE))
+      releaseListeningSockets(server);
+    else
+      server->close();
+
+    int connections = __atomic_load_n(&server->connections, __ATOMIC_ACQUIRE);
+    if (progress != NULL)
+      progress((drain_progress_t){.phase = DRAIN_STARTED,
+                                  .connections = connections,
+                                  .elapsedMs = 0});
+
+    int reported = connections;
+    while (__atomic_load_n(&server->workers, __ATOMIC_ACQUIRE) > 0) {
+      usleep(TIMER_WHEEL_TICK_MS * 1000);
+      uint64_t elapsedMs = timerWheelNow() - start;
+      connections = __atomic_load_n(&server->connections, __ATOMIC_ACQUIRE);
+      drain_phase_t phase = DRAIN_WAITING;
+      if (!server->drainExpired &&
+          elapsedMs >= (uint64_t)server->drainTimeout * 1000) {
+        __atomic_store_n(&server->drainExpired, 1, __ATOMIC_RELEASE);
+        phase = DRAIN_TIMED_OUT;
+      } else if (connections == reported) {
+        continue;
+      }
+      reported = connections;
+      if (progress != NULL)
+        progress((drain_progress_t){.phase = phase,
+                                    .connections = connections,
+                                    .elapsedMs = elapsedMs});
+    }
+
+    if (progress != NULL)
+      progress((drain_progress_t){.phase = DRAIN_COMPLETE,
+                                  .connections = 0,
+                                  .elapsedMs = timerWheelNow() - start});
+    return server->drainExpired ? -1 : 0;
   });
 
   server->listen = Block_copy(^(int port) {
-    struct sockaddr_in servAddr;
-    memset(&servAddr, 0, sizeof(servAddr));
-    servAddr.sin_family = AF_INET;
-    servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servAddr.sin_port = htons(port);
-
-    check(bind(server->socket, (struct sockaddr *)&servAddr,
-               sizeof(servAddr)) >= 0,
-          "bind() failed");
-    check(fcntl(server->socket, F_SETFL, O_NONBLOCK) >= 0, "fcntl() failed");
-    check(listen(server->socket, 10000) >= 0, "listen() failed");
+    server->port = port;
+    int count = 0;
+    while (server->addresses != NULL && server->addresses[count] != NULL)
+      count++;
+    server->listeners = malloc(sizeof(int) * max(count, 1));
+    check_mem(server->listeners);
+
+    if (count == 0) {
+      int listener = listenEverywhere(server, port);
+      check(listener >= 0, "Failed to listen on port %d", port);
+      server->listeners[server->listenerCount++] = listener;
+    }
+    for (int i = 0; i < count; i++) {
+      struct sockaddr_storage address;
+      socklen_t length;
+      check_silent(parseAddress(server->addresses[i], port, &address,
+                                &length) >= 0,
+                   "parseAddress() failed");
+      /* Only the first address is sharded, and a path cannot be */
+      if (i == 0 && server->reusePort && address.ss_family == AF_UNIX) {
+        log_warn("reusePort does not apply to %s", server->addresses[i]);
+        server->reusePort = 0;
+      }
+      int listener = openListener(server, &address, length, 1,
+                                  i == 0 && server->reusePort);
+      check(listener >= 0, "Failed to listen at %s", server->addresses[i]);
+      server->listeners[server->listenerCount++] = listener;
+    }
+    server->socket = server->listeners[0];
+    if (server->reusePort && !reusesPort(server->socket)) {
+      log_warn("The inherited socket cannot be sharded, sharing it");
+      server->reusePort = 0;
+    }
 
     return 0;
   error:
-    shutdown(server->socket, SHUT_RDWR);
-    close(server->socket);
+    for (int i = 0; i < server->listenerCount; i++)
+      closeListener(server->listeners[i], 1);
+    server->listenerCount = 0;
     return -1;
   });
 
+  /* The sockets themselves are opened by listen, one for each address */
   server->initSocket = Block_copy(^() {
-    int flag = 1;
-    check((server->socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) >= 0,
-          "socket() failed");
-    check(setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &flag,
-                     sizeof(flag)) >= 0,
-          "setsockopt() failed");
-
     return 0;
-  error:
-    return -1;
   });
 
   server->free = Block_copy(^() {
+    if (server->drainFd >= 0)
+      close(server->drainFd);
+    if (server->handoffSource != NULL) {
+      dispatch_source_cancel(server->handoffSource);
+      dispatch_release(server->handoffSource);
+      close(server->handoffSocket);
+    }
+    if (server->handoffPeer >= 0)
+      close(server->handoffPeer);
+    free(server->inheritedSockets);
+    free(server->listeners);
+    free(server->shardSockets);
     dispatch_release(server->serverQueue);
     Block_release(server->close);
+    Block_release(server->drain);
     Block_release(server->listen);
     Block_release(server->initSocket);
     Block_release(server->free);
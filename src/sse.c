@@ -0,0 +1,541 @@
+#include "express.h"
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+/*
+
+Server-Sent Events, as the HTML living standard has them.
+
+A subscribing response sends its headers and leaves the connection to its
+worker, which writes events to it from then on. Publishing never touches a
+subscriber. An event is formatted once, then a message for it is pushed on
+the lock-free inbox of every worker with subscribers to the channel, and
+the worker is woken through an eventfd in its epoll set. The wake is only
+written by whoever finds the worker asleep, so a burst of events costs the
+worker one wakeup, and the events that arrived meanwhile go out to each
+subscriber in a single write.
+
+Channels are kept in an open addressing table, which only grows, under the
+hub's lock, so finding one to publish to never takes a lock. Each channel
+has a list of the workers its subscribers are on, and each of those keeps
+its subscribers to itself.
+
+*/
+
+#define SSE_BATCH 64
+#define SSE_HEARTBEAT ": ping\n\n"
+
+typedef struct sse_event_t {
+  int references;
+  /* The chunk-size line ahead of the event, for a chunked response */
+  size_t chunkLength;
+  size_t length;
+  char data[];
+} sse_event_t;
+
+typedef struct sse_message_t {
+  struct sse_message_t *next;
+  struct sse_channel_worker_t *node;
+  sse_event_t *event;
+} sse_message_t;
+
+typedef struct sse_worker_t {
+  int wakeFd;
+  int woken;
+  sse_message_t *inbox;
+} sse_worker_t;
+
+/* A channel's subscribers on one worker, which only that worker changes */
+typedef struct sse_channel_worker_t {
+  struct sse_channel_worker_t *next;
+  sse_worker_t *worker;
+  int count;
+  struct sse_subscriber_t *subscribers;
+  /* What the worker has for them while handling a wake */
+  sse_message_t *batch;
+  sse_message_t *batchTail;
+  struct sse_channel_worker_t *readyNext;
+} sse_channel_worker_t;
+
+typedef struct sse_channel_t {
+  char *name;
+  sse_channel_worker_t *workers;
+} sse_channel_t;
+
+typedef struct sse_subscriber_t {
+  struct sse_subscriber_t *next;
+  struct sse_subscriber_t *prev;
+  sse_channel_t *channel;
+  sse_channel_worker_t *node;
+  int socket;
+  int epollFd;
+  void *event;
+  client_output_t *output;
+  client_pipeline_t *pipeline;
+  int chunked;
+  /* Written to since the last heartbeat, so it needs none */
+  int active;
+  /* Too far behind, or otherwise done with */
+  int gone;
+  /* How much the client had taken at the last heartbeat */
+  size_t written;
+  size_t takenAtHeartbeat;
+} sse_subscriber_t;
+
+void clientOutputWrite(client_output_t *output, int socket, struct iovec *iov,
+                       int count);
+
+static _Thread_local sse_worker_t *currentWorker = NULL;
+
+static size_t hashChannel(const char *name) {
+  uint32_t hash = 2166136261u;
+  while (*name != '\0')
+    hash = (hash ^ (unsigned char)*name++) * 16777619u;
+  return hash & (SSE_CHANNELS - 1);
+}
+
+/* The slot holding name, or the empty one it would go in */
+static sse_channel_t **findSlot(sse_hub_t *hub, const char *name) {
+  size_t slot = hashChannel(name);
+  for (size_t i = 0; i < SSE_CHANNELS; i++) {
+    sse_channel_t **entry = &hub->channels[(slot + i) & (SSE_CHANNELS - 1)];
+    sse_channel_t *channel = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+    if (channel == NULL || strcmp(channel->name, name) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+static sse_channel_t *findChannel(sse_hub_t *hub, const char *name) {
+  sse_channel_t **entry = findSlot(hub, name);
+  return entry != NULL ? __atomic_load_n(entry, __ATOMIC_ACQUIRE) : NULL;
+}
+
+static sse_channel_t *addChannel(sse_hub_t *hub, const char *name) {
+  pthread_mutex_lock(&hub->lock);
+  sse_channel_t *channel = NULL;
+  sse_channel_t **entry = findSlot(hub, name);
+  check(entry != NULL, "SSE channel table is full");
+  if (*entry == NULL) {
+    channel = calloc(1, sizeof(sse_channel_t));
+    check_mem(channel);
+    channel->name = strdup(name);
+    check_mem(channel->name);
+    __atomic_store_n(entry, channel, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&hub->lock);
+  return *entry;
+error:
+  free(channel);
+  pthread_mutex_unlock(&hub->lock);
+  return NULL;
+}
+
+sse_hub_t *expressSseHub() {
+  sse_hub_t *hub = calloc(1, sizeof(sse_hub_t));
+  check_mem(hub);
+  pthread_mutex_init(&hub->lock, NULL);
+  return hub;
+error:
+  return NULL;
+}
+
+/* Only once the server is gone, along with the subscribers */
+void expressSseHubFree(sse_hub_t *hub) {
+  if (hub == NULL)
+    return;
+  for (size_t i = 0; i < SSE_CHANNELS; i++) {
+    sse_channel_t *channel = hub->channels[i];
+    if (channel == NULL)
+      continue;
+    sse_channel_worker_t *node = channel->workers;
+    while (node != NULL) {
+      sse_channel_worker_t *next = node->next;
+      free(node);
+      node = next;
+    }
+    free(channel->name);
+    free(channel);
+  }
+  pthread_mutex_destroy(&hub->lock);
+  free(hub);
+}
+
+/* Lines may end in CRLF, CR or LF, and each becomes a data field */
+static size_t lineLength(const char *data) {
+  size_t length = 0;
+  while (data[length] != '\0' && data[length] != '\r' && data[length] != '\n')
+    length++;
+  return length;
+}
+
+/* Measures the event when buffer is NULL, and writes it out otherwise */
+static void append(char *buffer, size_t *length, const char *data,
+                   size_t dataLength) {
+  if (buffer != NULL)
+    memcpy(buffer + *length, data, dataLength);
+  *length += dataLength;
+}
+
+static size_t formatEvent(char *buffer, const char *event, const char *data) {
+  size_t length = 0;
+  if (event != NULL) {
+    append(buffer, &length, "event: ", 7);
+    append(buffer, &length, event, strlen(event));
+    append(buffer, &length, "\n", 1);
+  }
+  const char *line = data != NULL ? data : "";
+  for (;;) {
+    size_t lineEnd = lineLength(line);
+    append(buffer, &length, "data: ", 6);
+    append(buffer, &length, line, lineEnd);
+    append(buffer, &length, "\n", 1);
+    line += lineEnd;
+    if (*line == '\0')
+      break;
+    line += line[0] == '\r' && line[1] == '\n' ? 2 : 1;
+  }
+  append(buffer, &length, "\n", 1);
+  return length;
+}
+
+/* Laid out as a whole chunk, which a response that is not chunked skips */
+static sse_event_t *createEvent(const char *event, const char *data) {
+  size_t length = formatEvent(NULL, event, data);
+  char chunkSize[20];
+  int chunkLength = snprintf(chunkSize, sizeof(chunkSize), "%zx\r\n", length);
+  sse_event_t *sseEvent =
+      malloc(sizeof(sse_event_t) + chunkLength + length + 2);
+  check_mem(sseEvent);
+  sseEvent->references = 1;
+  sseEvent->chunkLength = chunkLength;
+  sseEvent->length = length;
+  memcpy(sseEvent->data, chunkSize, chunkLength);
+  formatEvent(sseEvent->data + chunkLength, event, data);
+  memcpy(sseEvent->data + chunkLength + length, "\r\n", 2);
+  return sseEvent;
+error:
+  return NULL;
+}
+
+static void releaseEvent(sse_event_t *event) {
+  if (__atomic_sub_fetch(&event->references, 1, __ATOMIC_ACQ_REL) == 0)
+    free(event);
+}
+
+static struct iovec eventIovec(sse_subscriber_t *sub, sse_event_t *event) {
+  if (sub->chunked)
+    return (struct iovec){.iov_base = event->data,
+                          .iov_len = event->chunkLength + event->length + 2};
+  return (struct iovec){.iov_base = event->data + event->chunkLength,
+                        .iov_len = event->length};
+}
+
+#ifdef __linux__
+/* Has the worker flush the socket, and close it once it is gone */
+static void armSubscriber(sse_subscriber_t *sub) {
+  struct epoll_event ev = {.events =
+                               EPOLLIN | EPOLLOUT | EPOLLET | EPOLLONESHOT,
+                           .data.ptr = sub->event};
+  if (sub->epollFd >= 0 &&
+      epoll_ctl(sub->epollFd, EPOLL_CTL_MOD, sub->socket, &ev) < 0)
+    log_err("epoll_ctl() failed");
+}
+
+/* The only one that writes the wake is the one that finds it unset */
+static void wakeWorker(sse_worker_t *worker) {
+  if (__atomic_exchange_n(&worker->woken, 1, __ATOMIC_SEQ_CST) != 0)
+    return;
+  uint64_t one = 1;
+  if (write(worker->wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    log_err("write() failed");
+}
+
+/* Lasts as long as the worker's thread, as its epoll set does */
+static sse_worker_t *workerFor(int epollFd) {
+  if (currentWorker != NULL)
+    return currentWorker;
+  sse_worker_t *worker = calloc(1, sizeof(sse_worker_t));
+  check_mem(worker);
+  worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  check(worker->wakeFd >= 0, "eventfd() failed");
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.ptr = worker};
+  check(epoll_ctl(epollFd, EPOLL_CTL_ADD, worker->wakeFd, &ev) >= 0,
+        "epoll_ctl() failed");
+  currentWorker = worker;
+  return worker;
+error:
+  if (worker != NULL && worker->wakeFd >= 0)
+    close(worker->wakeFd);
+  free(worker);
+  return NULL;
+}
+#else
+static void armSubscriber(UNUSED sse_subscriber_t *sub) {}
+static void wakeWorker(UNUSED sse_worker_t *worker) {}
+#endif
+
+/* Returns how many subscribers the event went out to */
+int expressSsePublish(sse_hub_t *hub, const char *channelName,
+                      const char *event, const char *data) {
+  check(event == NULL || lineLength(event) == strlen(event),
+        "SSE event names cannot span lines");
+  sse_channel_t *channel = findChannel(hub, channelName);
+  if (channel == NULL)
+    return 0;
+
+  sse_event_t *sseEvent = createEvent(event, data);
+  check(sseEvent != NULL, "createEvent() failed");
+
+  int reached = 0;
+  sse_channel_worker_t *node =
+      __atomic_load_n(&channel->workers, __ATOMIC_ACQUIRE);
+  for (; node != NULL; node = node->next) {
+    int count = __atomic_load_n(&node->count, __ATOMIC_ACQUIRE);
+    if (count == 0)
+      continue;
+    sse_message_t *message = malloc(sizeof(sse_message_t));
+    if (message == NULL) {
+      log_err("Out of memory.");
+      continue;
+    }
+    __atomic_add_fetch(&sseEvent->references, 1, __ATOMIC_RELAXED);
+    message->node = node;
+    message->event = sseEvent;
+    sse_worker_t *worker = node->worker;
+    message->next = __atomic_load_n(&worker->inbox, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&worker->inbox, &message->next,
+                                        message, 1, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_RELAXED))
+      ;
+    wakeWorker(worker);
+    reached += count;
+  }
+  releaseEvent(sseEvent);
+  return reached;
+error:
+  return -1;
+}
+
+/* Queues on the subscriber's output, asking for a flush if it was empty */
+static void writeSubscriber(sse_subscriber_t *sub, struct iovec *iov,
+                            int count) {
+  size_t queued = sub->output->length;
+  clientOutputWrite(sub->output, sub->socket, iov, count);
+  for (int i = 0; i < count; i++)
+    sub->written += iov[i].iov_len;
+  sub->active = 1;
+  if (sub->output->length > SSE_MAX_BACKLOG)
+    sub->gone = 1;
+  if ((queued == 0 && sub->output->length > 0) || sub->gone)
+    armSubscriber(sub);
+}
+
+/* The events batched for node go out a few at a time in a single write */
+static void writeBatch(sse_channel_worker_t *node) {
+  sse_message_t *message = node->batch;
+  while (message != NULL) {
+    sse_event_t *events[SSE_BATCH];
+    int count = 0;
+    for (; message != NULL && count < SSE_BATCH; message = message->next)
+      events[count++] = message->event;
+
+    struct iovec iov[SSE_BATCH];
+    for (sse_subscriber_t *sub = node->subscribers; sub != NULL;
+         sub = sub->next) {
+      if (sub->gone)
+        continue;
+      for (int i = 0; i < count; i++)
+        iov[i] = eventIovec(sub, events[i]);
+      writeSubscriber(sub, iov, count);
+    }
+  }
+
+  message = node->batch;
+  while (message != NULL) {
+    sse_message_t *next = message->next;
+    releaseEvent(message->event);
+    free(message);
+    message = next;
+  }
+  node->batch = NULL;
+  node->batchTail = NULL;
+}
+
+/*
+  For the worker, with an event's data.ptr, which may be its wake. Returns 1
+  when it was, once everything in the inbox has been written out.
+*/
+int sseWorkerWake(void *ptr) {
+  sse_worker_t *worker = currentWorker;
+  if (worker == NULL || ptr != worker)
+    return 0;
+
+#ifdef __linux__
+  __atomic_store_n(&worker->woken, 0, __ATOMIC_SEQ_CST);
+  uint64_t count;
+  if (read(worker->wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    log_err("read() failed");
+#endif
+  sse_message_t *message =
+      __atomic_exchange_n(&worker->inbox, NULL, __ATOMIC_SEQ_CST);
+
+  /* The inbox is a stack, so it is turned around to keep publish order */
+  sse_message_t *ordered = NULL;
+  while (message != NULL) {
+    sse_message_t *next = message->next;
+    message->next = ordered;
+    ordered = message;
+    message = next;
+  }
+
+  sse_channel_worker_t *ready = NULL;
+  while (ordered != NULL) {
+    sse_message_t *next = ordered->next;
+    sse_channel_worker_t *node = ordered->node;
+    ordered->next = NULL;
+    if (node->batch == NULL) {
+      node->batch = ordered;
+      node->readyNext = ready;
+      ready = node;
+    } else {
+      node->batchTail->next = ordered;
+    }
+    node->batchTail = ordered;
+    ordered = next;
+  }
+
+  for (; ready != NULL; ready = ready->readyNext)
+    writeBatch(ready);
+  return 1;
+}
+
+/*
+  Sends the headers and leaves the connection to subscribe to channel once
+  the request is done with. Content-Type and Cache-Control are set unless
+  res already has them, and the body is chunked where the request allows.
+*/
+void expressSseSubscribe(response_t *res, sse_hub_t *hub,
+                         const char *channelName) {
+  client_t client = res->client;
+  if (client.subscriber == NULL || client.output == NULL) {
+    expressResStatus(res, 501);
+    return;
+  }
+
+  sse_subscriber_t *sub = NULL;
+  sse_channel_t *channel = findChannel(hub, channelName);
+  if (channel == NULL)
+    channel = addChannel(hub, channelName);
+  check(channel != NULL, "addChannel() failed");
+  sub = calloc(1, sizeof(sse_subscriber_t));
+  check_mem(sub);
+
+  if (expressResGet(res, "Content-Type") == NULL)
+    expressResSet(res, "Content-Type", "text/event-stream");
+  if (expressResGet(res, "Cache-Control") == NULL)
+    expressResSet(res, "Cache-Control", "no-cache");
+  expressResFlushHeaders(res);
+  res->didSend = 1;
+
+  sub->channel = channel;
+  sub->socket = client.socket;
+  sub->epollFd = -1;
+  sub->output = client.output;
+  sub->pipeline = client.pipeline;
+  sub->chunked = res->chunked;
+  sub->written = client.output->length;
+  *client.subscriber = sub;
+  return;
+error:
+  free(sub);
+  expressResStatus(res, 500);
+}
+
+#ifdef __linux__
+/* For the worker, once the socket is in its epoll set as event */
+int sseAttach(sse_subscriber_t *sub, int epollFd, void *event) {
+  sse_worker_t *worker = workerFor(epollFd);
+  check(worker != NULL, "workerFor() failed");
+  sub->epollFd = epollFd;
+  sub->event = event;
+
+  /* Only this worker adds itself to the channel, so it is there or not */
+  sse_channel_t *channel = sub->channel;
+  sse_channel_worker_t *node =
+      __atomic_load_n(&channel->workers, __ATOMIC_ACQUIRE);
+  while (node != NULL && node->worker != worker)
+    node = node->next;
+  if (node == NULL) {
+    node = calloc(1, sizeof(sse_channel_worker_t));
+    check_mem(node);
+    node->worker = worker;
+    node->next = __atomic_load_n(&channel->workers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&channel->workers, &node->next, node,
+                                        1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+      ;
+  }
+
+  sub->node = node;
+  sub->next = node->subscribers;
+  if (node->subscribers != NULL)
+    node->subscribers->prev = sub;
+  node->subscribers = sub;
+  __atomic_add_fetch(&node->count, 1, __ATOMIC_RELEASE);
+  return 0;
+error:
+  sub->gone = 1;
+  return -1;
+}
+#endif
+
+/* For the worker, as the connection closes */
+void sseDetach(sse_subscriber_t *sub) {
+  sse_channel_worker_t *node = sub->node;
+  if (node != NULL) {
+    __atomic_sub_fetch(&node->count, 1, __ATOMIC_RELEASE);
+    if (sub->prev != NULL)
+      sub->prev->next = sub->next;
+    else
+      node->subscribers = sub->next;
+    if (sub->next != NULL)
+      sub->next->prev = sub->prev;
+  }
+  free(sub);
+}
+
+/* Anything the client sends is ignored. Returns -1 once it is gone */
+int sseServe(sse_subscriber_t *sub) {
+  sub->pipeline->length = 0;
+  return sub->gone ? -1 : 0;
+}
+
+/*
+  A subscriber nothing was written to since the last heartbeat gets a
+  comment, to keep proxies from timing it out. Returns -1 for one that has
+  taken nothing in all that time while it had something to take.
+*/
+int sseHeartbeat(sse_subscriber_t *sub) {
+  size_t taken = sub->written - sub->output->length;
+  if (sub->gone || (sub->output->length > 0 && taken == sub->takenAtHeartbeat))
+    return -1;
+  sub->takenAtHeartbeat = taken;
+
+  if (!sub->active) {
+    char chunk[20];
+    size_t length = sizeof(SSE_HEARTBEAT) - 1;
+    int chunkLength = snprintf(chunk, sizeof(chunk), "%zx\r\n", length);
+    struct iovec iov[3] = {
+        {.iov_base = chunk, .iov_len = chunkLength},
+        {.iov_base = SSE_HEARTBEAT, .iov_len = length},
+        {.iov_base = "\r\n", .iov_len = 2}};
+    if (sub->chunked)
+      writeSubscriber(sub, iov, 3);
+    else
+      writeSubscriber(sub, &iov[1], 1);
+  }
+  sub->active = 0;
+  return 0;
+}
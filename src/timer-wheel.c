@@ -0,0 +1,147 @@
+#include "express.h"
+#include <time.h>
+
+/*
+
+A hierarchical timing wheel.
+
+Level 0 has a slot per tick and each level above it spans TIMER_WHEEL_SLOTS
+times the level below, so adding or cancelling a timer is O(1) whatever its
+timeout. When a level wraps around, the slot of the level above that has
+come due is cascaded down into the finer levels.
+
+A wheel belongs to one thread and is never locked.
+
+*/
+
+uint64_t timerWheelNow() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static void unlinkTimer(wheel_timer_t *timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = NULL;
+  timer->prev = NULL;
+}
+
+static void placeTimer(timer_wheel_t *wheel, wheel_timer_t *timer) {
+  uint64_t maxDelta =
+      ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+  if (timer->expires - wheel->tick > maxDelta)
+    timer->expires = wheel->tick + maxDelta;
+
+  uint64_t delta = timer->expires - wheel->tick;
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1)))
+    level++;
+
+  size_t slot = (timer->expires >> (TIMER_WHEEL_BITS * level)) &
+                (TIMER_WHEEL_SLOTS - 1);
+  wheel_timer_t *head = &wheel->slots[level][slot];
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+static void cascade(timer_wheel_t *wheel, int level) {
+  size_t slot =
+      (wheel->tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  wheel_timer_t *head = &wheel->slots[level][slot];
+  wheel_timer_t *timer = head->next;
+  head->next = head;
+  head->prev = head;
+  while (timer != head) {
+    wheel_timer_t *next = timer->next;
+    placeTimer(wheel, timer);
+    timer = next;
+  }
+}
+
+void timerWheelInit(timer_wheel_t *wheel, uint64_t nowMs) {
+  wheel->tick = nowMs / TIMER_WHEEL_TICK_MS;
+  wheel->count = 0;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      wheel->slots[level][slot].next = &wheel->slots[level][slot];
+      wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+    }
+  }
+}
+
+void wheelTimerInit(wheel_timer_t *timer, void (*expire)(wheel_timer_t *),
+                    void *data) {
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->expires = 0;
+  timer->expire = expire;
+  timer->data = data;
+}
+
+void timerWheelCancel(timer_wheel_t *wheel, wheel_timer_t *timer) {
+  if (timer->next == NULL)
+    return;
+  unlinkTimer(timer);
+  wheel->count--;
+}
+
+/* Re-adding a pending timer moves it */
+void timerWheelAdd(timer_wheel_t *wheel, wheel_timer_t *timer,
+                   uint64_t timeoutMs) {
+  timerWheelCancel(wheel, timer);
+  uint64_t ticks = (timeoutMs + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+  timer->expires = wheel->tick + max(ticks, (uint64_t)1);
+  placeTimer(wheel, timer);
+  wheel->count++;
+}
+
+/* Runs the expire callback of every timer that is due by nowMs */
+void timerWheelAdvance(timer_wheel_t *wheel, uint64_t nowMs) {
+  uint64_t target = nowMs / TIMER_WHEEL_TICK_MS;
+  while (wheel->tick < target) {
+    if (wheel->count == 0) {
+      wheel->tick = target;
+      break;
+    }
+
+    wheel->tick++;
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+      uint64_t levelMask = ((uint64_t)1 << (TIMER_WHEEL_BITS * level)) - 1;
+      if ((wheel->tick & levelMask) != 0)
+        break;
+      cascade(wheel, level);
+    }
+
+    wheel_timer_t *head =
+        &wheel->slots[0][wheel->tick & (TIMER_WHEEL_SLOTS - 1)];
+    while (head->next != head) {
+      wheel_timer_t *timer = head->next;
+      unlinkTimer(timer);
+      wheel->count--;
+      timer->expire(timer);
+    }
+  }
+}
+
+/* Milliseconds until the wheel next has work to do, -1 when it is empty */
+int timerWheelTimeout(timer_wheel_t *wheel, uint64_t nowMs) {
+  if (wheel->count == 0)
+    return -1;
+
+  /* Sleep through empty slots, but wake up for the next cascade */
+  uint64_t ticks = 1;
+  while (ticks < TIMER_WHEEL_SLOTS) {
+    uint64_t tick = wheel->tick + ticks;
+    wheel_timer_t *head = &wheel->slots[0][tick & (TIMER_WHEEL_SLOTS - 1)];
+    if ((tick & (TIMER_WHEEL_SLOTS - 1)) == 0 || head->next != head)
+      break;
+    ticks++;
+  }
+
+  uint64_t wakeMs = (wheel->tick + ticks) * TIMER_WHEEL_TICK_MS;
+  return wakeMs > nowMs ? (int)(wakeMs - nowMs) : 0;
+}
@@ -0,0 +1,675 @@
+#include "express.h"
+
+/*
+
+WebSockets, as RFC 6455 has them, without extensions.
+
+A WebSocket route answers the handshake itself and leaves the socket where
+the connection's worker picks it up, after which the connection no longer
+has requests. Its frames are read into the same pipeline requests were, and
+unmasked in place, sixteen bytes at a time, so a message that came in one
+frame is handed to onMessage without being copied. Fragmented messages are
+put back together in a buffer of the socket's own.
+
+The worker writes to the connection's output queue directly. Any other
+thread queues its frames on the socket's pending queue, under its lock, and
+arms EPOLLOUT so the worker wakes up and moves them across.
+
+*/
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC11B65"
+#define WEBSOCKET_KEY_LENGTH 24
+#define WEBSOCKET_MAX_CONTROL_LENGTH 125
+#define WEBSOCKET_FIN 0x80
+#define WEBSOCKET_RSV 0x70
+#define WEBSOCKET_MASK 0x80
+
+typedef enum websocket_close_code_t {
+  WEBSOCKET_NORMAL_CLOSURE = 1000,
+  WEBSOCKET_PROTOCOL_ERROR = 1002,
+  WEBSOCKET_NO_STATUS = 1005,
+  WEBSOCKET_ABNORMAL_CLOSURE = 1006,
+  WEBSOCKET_INVALID_PAYLOAD = 1007,
+  WEBSOCKET_MESSAGE_TOO_BIG = 1009
+} websocket_close_code_t;
+
+void clientOutputAppend(client_output_t *output, const char *data,
+                        size_t length);
+void clientOutputInit(client_output_t *output, int deferred,
+                      size_t highWaterMark);
+void clientOutputFree(client_output_t *output);
+int clientOutputFlush(client_output_t *output, int socket);
+void clientOutputWrite(client_output_t *output, int socket, struct iovec *iov,
+                       int count);
+
+static uint32_t rotateLeft(uint32_t value, int bits) {
+  return value << bits | value >> (32 - bits);
+}
+
+static void sha1Block(uint32_t state[5], const unsigned char *block) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+           (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+  for (int i = 16; i < 80; i++)
+    w[i] = rotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+           e = state[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f = i < 20   ? (b & c) | (~b & d)
+                 : i < 40 ? b ^ c ^ d
+                 : i < 60 ? (b & c) | (b & d) | (c & d)
+                          : b ^ c ^ d;
+    uint32_t k = i < 20   ? 0x5a827999
+                 : i < 40 ? 0x6ed9eba1
+                 : i < 60 ? 0x8f1bbcdc
+                          : 0xca62c1d6;
+    uint32_t t = rotateLeft(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotateLeft(b, 30);
+    b = a;
+    a = t;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+/* Only ever hashes a handshake key, so it is not worth a dependency */
+static void sha1(const unsigned char *data, size_t length,
+                 unsigned char digest[20]) {
+  uint32_t state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                       0xc3d2e1f0};
+  size_t offset = 0;
+  for (; offset + 64 <= length; offset += 64)
+    sha1Block(state, data + offset);
+
+  unsigned char block[64] = {0};
+  size_t rest = length - offset;
+  memcpy(block, data + offset, rest);
+  block[rest] = 0x80;
+  if (rest >= 56) {
+    sha1Block(state, block);
+    memset(block, 0, sizeof(block));
+  }
+  uint64_t bits = (uint64_t)length * 8;
+  for (int i = 0; i < 8; i++)
+    block[63 - i] = bits >> (i * 8);
+  sha1Block(state, block);
+
+  for (int i = 0; i < 20; i++)
+    digest[i] = state[i / 4] >> (24 - (i % 4) * 8);
+}
+
+static const char base64Alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* out has room for 4 bytes for every 3 of data, and a NUL */
+static void encodeBase64(const unsigned char *data, size_t length,
+                         char *out) {
+  for (size_t i = 0; i < length; i += 3) {
+    uint32_t bits = (uint32_t)data[i] << 16;
+    if (i + 1 < length)
+      bits |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < length)
+      bits |= data[i + 2];
+    *out++ = base64Alphabet[bits >> 18 & 63];
+    *out++ = base64Alphabet[bits >> 12 & 63];
+    *out++ = i + 1 < length ? base64Alphabet[bits >> 6 & 63] : '=';
+    *out++ = i + 2 < length ? base64Alphabet[bits & 63] : '=';
+  }
+  *out = '\0';
+}
+
+/* The key is 16 random bytes in base64, which is always 24 characters */
+static int validKey(const char *key) {
+  if (key == NULL || strlen(key) != WEBSOCKET_KEY_LENGTH ||
+      strcmp(key + WEBSOCKET_KEY_LENGTH - 2, "==") != 0)
+    return 0;
+  for (int i = 0; i < WEBSOCKET_KEY_LENGTH - 2; i++) {
+    if (strchr(base64Alphabet, key[i]) == NULL)
+      return 0;
+  }
+  return 1;
+}
+
+static void acceptKey(const char *key, char *accept) {
+  unsigned char digest[20];
+  char keyGuid[WEBSOCKET_KEY_LENGTH + sizeof(WEBSOCKET_GUID)];
+  snprintf(keyGuid, sizeof(keyGuid), "%s%s", key, WEBSOCKET_GUID);
+  sha1((unsigned char *)keyGuid, strlen(keyGuid), digest);
+  encodeBase64(digest, sizeof(digest), accept);
+}
+
+static int hasToken(const char *value, const char *token) {
+  size_t tokenLength = strlen(token);
+  while (value != NULL && *value != '\0') {
+    value += strspn(value, " \t,");
+    size_t length = strcspn(value, " \t,");
+    if (length == tokenLength && strncasecmp(value, token, length) == 0)
+      return 1;
+    value += length;
+  }
+  return 0;
+}
+
+/* Overlong forms, surrogates and anything past U+10FFFF are all invalid */
+static int validUtf8(const unsigned char *data, size_t length) {
+  static const uint32_t minimum[] = {0, 0x80, 0x800, 0x10000};
+  size_t i = 0;
+  while (i < length) {
+    /* Runs of ASCII are checked a word at a time */
+    uint64_t word;
+    if (i + 8 <= length &&
+        (memcpy(&word, data + i, 8), (word & 0x8080808080808080ULL) == 0)) {
+      i += 8;
+      continue;
+    }
+
+    unsigned char c = data[i];
+    if (c < 0x80) {
+      i++;
+      continue;
+    }
+    size_t continuation = (c & 0xe0) == 0xc0   ? 1
+                          : (c & 0xf0) == 0xe0 ? 2
+                          : (c & 0xf8) == 0xf0 ? 3
+                                               : 0;
+    if (continuation == 0 || length - i <= continuation)
+      return 0;
+    uint32_t codePoint = c & (0x3f >> continuation);
+    for (size_t j = 1; j <= continuation; j++) {
+      if ((data[i + j] & 0xc0) != 0x80)
+        return 0;
+      codePoint = codePoint << 6 | (data[i + j] & 0x3f);
+    }
+    if (codePoint < minimum[continuation] || codePoint > 0x10ffff ||
+        (codePoint >= 0xd800 && codePoint <= 0xdfff))
+      return 0;
+    i += continuation + 1;
+  }
+  return 1;
+}
+
+static int validCloseCode(int code) {
+  return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) ||
+         (code >= 3000 && code <= 4999);
+}
+
+typedef unsigned char mask_vector_t __attribute__((vector_size(16)));
+
+/*
+  XORs the payload with the masking key in place. The key repeats every four
+  bytes, so sixteen of them go at a time with the key laid out four times.
+*/
+static void unmask(unsigned char *data, size_t length,
+                   const unsigned char key[4]) {
+  mask_vector_t mask;
+  for (int i = 0; i < 16; i++)
+    mask[i] = key[i & 3];
+
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    mask_vector_t block;
+    memcpy(&block, data + i, sizeof(block));
+    block ^= mask;
+    memcpy(data + i, &block, sizeof(block));
+  }
+  for (; i < length; i++)
+    data[i] ^= key[i & 3];
+}
+
+#ifdef __linux__
+/* Rearms the socket, for EPOLLOUT too while frames are pending */
+int websocketArm(websocket_t *ws, uint32_t events) {
+  pthread_mutex_lock(&ws->lock);
+  if (ws->pending.length > 0)
+    events |= EPOLLOUT;
+  struct epoll_event ev = {.events = events, .data.ptr = ws->event};
+  int result = ws->epollFd >= 0
+                   ? epoll_ctl(ws->epollFd, EPOLL_CTL_MOD, ws->socket, &ev)
+                   : 0;
+  pthread_mutex_unlock(&ws->lock);
+  return result;
+}
+
+static void wakeWorker(websocket_t *ws) {
+  struct epoll_event ev = {.events =
+                               EPOLLIN | EPOLLOUT | EPOLLET | EPOLLONESHOT,
+                           .data.ptr = ws->event};
+  if (ws->epollFd >= 0 &&
+      epoll_ctl(ws->epollFd, EPOLL_CTL_MOD, ws->socket, &ev) < 0)
+    log_err("epoll_ctl() failed");
+}
+#else
+static void wakeWorker(UNUSED websocket_t *ws) {}
+#endif
+
+/* Returns 1 while the output is below its high water mark, -1 once closed */
+static int writeFrame(websocket_t *ws, websocket_opcode_t opcode,
+                      const char *data, size_t length) {
+  unsigned char header[10];
+  size_t headerLength = 2;
+  header[0] = WEBSOCKET_FIN | opcode;
+  if (length < 126) {
+    header[1] = length;
+  } else if (length <= UINT16_MAX) {
+    header[1] = 126;
+    header[2] = length >> 8;
+    header[3] = length;
+    headerLength = 4;
+  } else {
+    header[1] = 127;
+    for (int i = 0; i < 8; i++)
+      header[9 - i] = (uint64_t)length >> (i * 8);
+    headerLength = 10;
+  }
+
+  if (pthread_equal(ws->worker, pthread_self())) {
+    if (ws->output == NULL)
+      return -1;
+    size_t queued = ws->output->length;
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = headerLength},
+        {.iov_base = (void *)data, .iov_len = length}};
+    clientOutputWrite(ws->output, ws->socket, iov, length > 0 ? 2 : 1);
+    /* Another socket's handler may be the one writing, so it is woken up */
+    if (queued == 0 && ws->output->length > 0)
+      wakeWorker(ws);
+    return ws->output->length <= ws->output->highWaterMark;
+  }
+
+  pthread_mutex_lock(&ws->lock);
+  int writable = -1;
+  if (ws->output != NULL) {
+    if (ws->pending.length == 0)
+      wakeWorker(ws);
+    clientOutputAppend(&ws->pending, (char *)header, headerLength);
+    clientOutputAppend(&ws->pending, data, length);
+    writable = ws->pending.length <= ws->pending.highWaterMark;
+  }
+  pthread_mutex_unlock(&ws->lock);
+  return writable;
+}
+
+/* Once a close has gone out, nothing else is sent after it */
+static int closing(websocket_t *ws) {
+  return __atomic_load_n(&ws->closeSent, __ATOMIC_ACQUIRE);
+}
+
+static void writeClose(websocket_t *ws, int code, const char *reason,
+                       size_t reasonLength) {
+  pthread_mutex_lock(&ws->lock);
+  int closeSent = ws->closeSent;
+  __atomic_store_n(&ws->closeSent, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&ws->lock);
+  if (closeSent)
+    return;
+
+  char payload[WEBSOCKET_MAX_CONTROL_LENGTH];
+  size_t length = 0;
+  if (code > 0) {
+    payload[0] = code >> 8;
+    payload[1] = code;
+    length = 2 + min(reasonLength, sizeof(payload) - 2);
+    memcpy(payload + 2, reason, length - 2);
+  }
+  writeFrame(ws, WEBSOCKET_CLOSE, payload, length);
+}
+
+/* onClose runs once, whichever way the connection ends */
+static void notifyClose(websocket_t *ws, int code) {
+  if (ws->closed)
+    return;
+  ws->closed = 1;
+  if (ws->onClose != NULL)
+    ws->onClose(ws, code);
+}
+
+static int failConnection(websocket_t *ws, int code) {
+  writeClose(ws, code, NULL, 0);
+  notifyClose(ws, code);
+  return -1;
+}
+
+int expressWebSocketSend(websocket_t *ws, websocket_opcode_t opcode,
+                         const char *data, size_t length) {
+  int control = opcode & 0x8;
+  if (opcode == WEBSOCKET_CONTINUATION || opcode == WEBSOCKET_CLOSE ||
+      (control && length > WEBSOCKET_MAX_CONTROL_LENGTH) || closing(ws))
+    return -1;
+  return writeFrame(ws, opcode, data, length);
+}
+
+/* Starts the closing handshake, the connection ends once the peer answers */
+void expressWebSocketClose(websocket_t *ws, int code, const char *reason) {
+  if (!validCloseCode(code))
+    code = WEBSOCKET_NORMAL_CLOSURE;
+  writeClose(ws, code, reason, reason != NULL ? strlen(reason) : 0);
+}
+
+void expressWebSocketRetain(websocket_t *ws) {
+  __atomic_add_fetch(&ws->references, 1, __ATOMIC_RELAXED);
+}
+
+void expressWebSocketRelease(websocket_t *ws) {
+  if (__atomic_sub_fetch(&ws->references, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+  if (ws->onMessage != NULL)
+    Block_release(ws->onMessage);
+  if (ws->onClose != NULL)
+    Block_release(ws->onClose);
+  Block_release(ws->send);
+  Block_release(ws->sendBinary);
+  Block_release(ws->close);
+  clientOutputFree(&ws->pending);
+  pthread_mutex_destroy(&ws->lock);
+  free(ws->message);
+  free(ws);
+}
+
+static websocket_t *createWebSocket(client_t client) {
+  websocket_t *ws = calloc(1, sizeof(websocket_t));
+  check_mem(ws);
+  ws->socket = client.socket;
+  ws->epollFd = -1;
+  ws->worker = pthread_self();
+  pthread_mutex_init(&ws->lock, NULL);
+  ws->references = 1;
+  ws->output = client.output;
+  clientOutputInit(&ws->pending, 1, client.output->highWaterMark);
+  ws->pipeline = client.pipeline;
+  ws->maxMessageSize = client.pipeline->maxBodySize;
+
+  ws->send = Block_copy(^(const char *text) {
+    return expressWebSocketSend(ws, WEBSOCKET_TEXT, text, strlen(text));
+  });
+  ws->sendBinary = Block_copy(^(const char *data, size_t length) {
+    return expressWebSocketSend(ws, WEBSOCKET_BINARY, data, length);
+  });
+  ws->close = Block_copy(^(int code, const char *reason) {
+    expressWebSocketClose(ws, code, reason);
+  });
+  return ws;
+error:
+  return NULL;
+}
+
+/*
+  Answers the handshake and hands the socket to handler, for it to set its
+  handlers on. Only cookies are sent with the 101, the other headers set on
+  res are for a body it does not have.
+*/
+void websocketRoute(request_t *req, response_t *res, websocketHandler handler) {
+  client_t client = res->client;
+  if (client.websocket == NULL || client.output == NULL) {
+    expressResStatus(res, 501);
+    return;
+  }
+
+  if (req->httpVersionMinor < 1 ||
+      !hasToken(expressReqGet(req, "Upgrade"), "websocket") ||
+      !hasToken(expressReqGet(req, "Connection"), "upgrade")) {
+    expressResSet(res, "Upgrade", "websocket");
+    expressResStatus(res, 426);
+    return;
+  }
+
+  char *version = expressReqGet(req, "Sec-WebSocket-Version");
+  if (version == NULL || strcmp(version, "13") != 0) {
+    expressResSet(res, "Sec-WebSocket-Version", "13");
+    expressResStatus(res, 426);
+    return;
+  }
+
+  char *key = expressReqGet(req, "Sec-WebSocket-Key");
+  if (!validKey(key)) {
+    expressResStatus(res, 400);
+    return;
+  }
+
+  websocket_t *ws = createWebSocket(client);
+  if (ws == NULL) {
+    expressResStatus(res, 500);
+    return;
+  }
+
+  char accept[29];
+  acceptKey(key, accept);
+  char head[160];
+  int headLength = snprintf(head, sizeof(head),
+                            "HTTP/1.1 101 Switching Protocols\r\n"
+                            "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                            "Sec-WebSocket-Accept: %s\r\n",
+                            accept);
+  struct iovec iov[3] = {
+      {.iov_base = head, .iov_len = headLength},
+      {.iov_base = res->cookieHeaders, .iov_len = res->cookieHeadersLength},
+      {.iov_base = "\r\n", .iov_len = 2}};
+  clientOutputWrite(client.output, client.socket, iov, 3);
+  res->status = 101;
+  res->didSend = 1;
+  res->headersSent = 1;
+
+  *client.websocket = ws;
+  handler(ws, req);
+}
+
+/* For the worker, once the socket is in its epoll set as event */
+void websocketAttach(websocket_t *ws, int epollFd, void *event) {
+  pthread_mutex_lock(&ws->lock);
+  ws->epollFd = epollFd;
+  ws->event = event;
+  pthread_mutex_unlock(&ws->lock);
+}
+
+/* For the worker, as the connection closes, whether or not it was clean */
+void websocketDetach(websocket_t *ws) {
+  notifyClose(ws, WEBSOCKET_ABNORMAL_CLOSURE);
+  pthread_mutex_lock(&ws->lock);
+  ws->socket = -1;
+  ws->epollFd = -1;
+  ws->output = NULL;
+  ws->pipeline = NULL;
+  clientOutputFree(&ws->pending);
+  pthread_mutex_unlock(&ws->lock);
+  expressWebSocketRelease(ws);
+}
+
+/*
+  An idle socket is pinged, and one that has not answered since the last
+  ping is given up on. Returns -1 when the connection is to be closed.
+*/
+int websocketIdle(websocket_t *ws) {
+  if (ws->pingSent || closing(ws))
+    return -1;
+  ws->pingSent = 1;
+  writeFrame(ws, WEBSOCKET_PING, NULL, 0);
+  return 0;
+}
+
+static void deliverMessage(websocket_t *ws, websocket_opcode_t opcode,
+                           const char *data, size_t length) {
+  if (ws->onMessage != NULL && !closing(ws))
+    ws->onMessage(ws, opcode, data, length);
+}
+
+static int receiveClose(websocket_t *ws, const unsigned char *payload,
+                        size_t length) {
+  int code = WEBSOCKET_NO_STATUS;
+  if (length == 1)
+    return failConnection(ws, WEBSOCKET_PROTOCOL_ERROR);
+  if (length >= 2) {
+    code = payload[0] << 8 | payload[1];
+    if (!validCloseCode(code))
+      return failConnection(ws, WEBSOCKET_PROTOCOL_ERROR);
+    if (!validUtf8(payload + 2, length - 2))
+      return failConnection(ws, WEBSOCKET_INVALID_PAYLOAD);
+  }
+
+  /* The peer's code is echoed back, or none when it sent none */
+  ws->closeReceived = 1;
+  writeClose(ws, length >= 2 ? code : 0, NULL, 0);
+  notifyClose(ws, code);
+  return 0;
+}
+
+static int appendMessage(websocket_t *ws, const unsigned char *data,
+                         size_t length) {
+  if (ws->messageLength + length > ws->messageSize) {
+    size_t size = max(ws->messageSize * 2, ws->messageLength + length);
+    size = min(size, ws->maxMessageSize);
+    char *message = realloc(ws->message, size);
+    check_mem(message);
+    ws->message = message;
+    ws->messageSize = size;
+  }
+  memcpy(ws->message + ws->messageLength, data, length);
+  ws->messageLength += length;
+  return 0;
+error:
+  return -1;
+}
+
+/* Returns 0, or -1 once the connection has failed */
+static int receiveFrame(websocket_t *ws, websocket_opcode_t opcode, int fin,
+                        unsigned char *payload, size_t length) {
+  switch (opcode) {
+  case WEBSOCKET_PING:
+    if (!closing(ws))
+      writeFrame(ws, WEBSOCKET_PONG, (char *)payload, length);
+    return 0;
+  case WEBSOCKET_PONG:
+    return 0;
+  case WEBSOCKET_CLOSE:
+    return receiveClose(ws, payload, length);
+  case WEBSOCKET_TEXT:
+  case WEBSOCKET_BINARY:
+    if (ws->messageOpcode != WEBSOCKET_CONTINUATION)
+      return failConnection(ws, WEBSOCKET_PROTOCOL_ERROR);
+    /* A message in one frame is handed over from where it was read */
+    if (fin) {
+      if (opcode == WEBSOCKET_TEXT && !validUtf8(payload, length))
+        return failConnection(ws, WEBSOCKET_INVALID_PAYLOAD);
+      deliverMessage(ws, opcode, (char *)payload, length);
+      return 0;
+    }
+    ws->messageOpcode = opcode;
+    ws->messageLength = 0;
+    break;
+  case WEBSOCKET_CONTINUATION:
+    if (ws->messageOpcode == WEBSOCKET_CONTINUATION)
+      return failConnection(ws, WEBSOCKET_PROTOCOL_ERROR);
+    break;
+  }
+
+  if (appendMessage(ws, payload, length) != 0)
+    return failConnection(ws, WEBSOCKET_MESSAGE_TOO_BIG);
+  if (!fin)
+    return 0;
+
+  websocket_opcode_t messageOpcode = ws->messageOpcode;
+  ws->messageOpcode = WEBSOCKET_CONTINUATION;
+  if (messageOpcode == WEBSOCKET_TEXT &&
+      !validUtf8((unsigned char *)ws->message, ws->messageLength))
+    return failConnection(ws, WEBSOCKET_INVALID_PAYLOAD);
+  deliverMessage(ws, messageOpcode, ws->message, ws->messageLength);
+  return 0;
+}
+
+/* Moves what other threads queued onto the output, behind what is there */
+static void takePending(websocket_t *ws) {
+  pthread_mutex_lock(&ws->lock);
+  client_output_t *pending = &ws->pending;
+  if (pending->head != NULL) {
+    if (ws->output->tail != NULL)
+      ws->output->tail->next = pending->head;
+    else
+      ws->output->head = pending->head;
+    ws->output->tail = pending->tail;
+    ws->output->length += pending->length;
+    pending->head = NULL;
+    pending->tail = NULL;
+    pending->length = 0;
+  }
+  pthread_mutex_unlock(&ws->lock);
+}
+
+/*
+  Sends what other threads queued and handles the complete frames in the
+  pipeline. Returns how many frames it handled, or -1 once the connection is
+  to be closed.
+*/
+int websocketServe(websocket_t *ws) {
+  client_pipeline_t *pipeline = ws->pipeline;
+  size_t offset = 0;
+  int frames = 0;
+  int failed = 0;
+
+  takePending(ws);
+  if (ws->output->length > 0 && clientOutputFlush(ws->output, ws->socket) < 0)
+    return -1;
+
+  pipeline->frameLength = 0;
+  while (!failed && !ws->closeReceived && pipeline->length - offset >= 2) {
+    unsigned char *frame = (unsigned char *)pipeline->data + offset;
+    size_t available = pipeline->length - offset;
+    websocket_opcode_t opcode = frame[0] & 0x0f;
+    int fin = frame[0] & WEBSOCKET_FIN;
+    uint64_t length = frame[1] & 0x7f;
+    size_t headerLength = length == 127 ? 14 : length == 126 ? 8 : 6;
+
+    /* Nothing was negotiated that would set a reserved bit */
+    int control = opcode & 0x8;
+    if ((frame[0] & WEBSOCKET_RSV) || !(frame[1] & WEBSOCKET_MASK) ||
+        (opcode > WEBSOCKET_BINARY && opcode < WEBSOCKET_CLOSE) ||
+        opcode > WEBSOCKET_PONG ||
+        (control && (!fin || length > WEBSOCKET_MAX_CONTROL_LENGTH))) {
+      failed = failConnection(ws, WEBSOCKET_PROTOCOL_ERROR);
+      break;
+    }
+    if (available < headerLength)
+      break;
+    if (length == 126) {
+      length = frame[2] << 8 | frame[3];
+    } else if (length == 127) {
+      length = 0;
+      for (int i = 2; i < 10; i++)
+        length = length << 8 | frame[i];
+    }
+
+    size_t messageLength = control ? 0 : ws->messageLength;
+    if (length > ws->maxMessageSize - min(messageLength, ws->maxMessageSize)) {
+      failed = failConnection(ws, WEBSOCKET_MESSAGE_TOO_BIG);
+      break;
+    }
+    if (available - headerLength < length) {
+      pipeline->frameLength = headerLength + length;
+      break;
+    }
+
+    unsigned char *payload = frame + headerLength;
+    unmask(payload, length, payload - 4);
+    failed = receiveFrame(ws, opcode, fin, payload, length);
+    offset += headerLength + length;
+    frames++;
+  }
+
+  if (offset > 0)
+    memmove(pipeline->data, pipeline->data + offset,
+            pipeline->length - offset);
+  pipeline->length -= offset;
+
+  /* Any frame shows the peer is still there, not only a pong */
+  if (frames > 0)
+    ws->pingSent = 0;
+
+  /* Both sides have sent a close, so the connection goes once flushed */
+  if (failed || (ws->closeReceived && closing(ws)))
+    return -1;
+  return frames;
+}
@@ -13,6 +13,7 @@ static void shutdownBrokenApp(app_t *app) {
   usleep(1000);
   Block_release(app->listen);
   Block_release(app->closeServer);
+  Block_release(app->drain);
   Block_release(app->free);
   usleep(1000);
   free(app->server);
@@ -29,6 +29,19 @@ void expressTests(tape_t *t) {
       t->ok("bogus file", bogus == NULL);
     });
 
+    t->test("expressMimeType", ^(tape_t *t) {
+      t->strEqual("extension", t->string((char *)expressMimeType("a/b.css")),
+                  "text/css");
+      t->strEqual("uppercase", t->string((char *)expressMimeType("B.JSON")),
+                  "application/json");
+      t->ok("directory dot", expressMimeType("a.b/c") == NULL);
+      t->ok("unknown", expressMimeType("file.unknownext") == NULL);
+      expressMimeTypeSet("unknownext", "application/x-unknown");
+      t->strEqual("override",
+                  t->string((char *)expressMimeType("file.unknownext")),
+                  "application/x-unknown");
+    });
+
     t->test("writePid", ^(tape_t *t) {
       char *pidFile = "test.pid";
       writePid(pidFile);
@@ -49,6 +62,7 @@ void expressTests(tape_t *t) {
           "query string", t->get("/qs\?value1=123\\&value2=34%205"),
           "<h1>Query String</h1><p>Value 1: 123</p><p>Value 2: 34 5</p>");
       t->strEqual("send file", t->get("/file"), "hello, world!\n");
+      t->strEqual("client address", t->get("/ip"), "127.0.0.1");
     });
 
     t->test("POST", ^(tape_t *t) {
@@ -99,6 +113,162 @@ void expressTests(tape_t *t) {
                   "No super-nested-router");
     });
 
+    t->test("Static file cache", ^(tape_t *t) {
+      t->strEqual("cached", t->get("/test/files/test2.txt"),
+                  "this is a test!!!");
+      string_t *cached = t->sendRequest(
+          "GET /test/files/test2.txt HTTP/1.1\r\nHost: localhost\r\n\r\n");
+      t->ok("etag", cached->contains("ETag: \""));
+      t->ok("last modified", cached->contains("Last-Modified: "));
+      t->ok("cache control",
+            cached->contains("Cache-Control: public, max-age=0\r\n"));
+      t->ok("range",
+            t->sendRequest("GET /test/files/test2.txt HTTP/1.1\r\n"
+                           "Host: localhost\r\nRange: bytes=0-3\r\n\r\n")
+                ->contains("206 Partial Content"));
+      t->ok("stale if-range",
+            t->sendRequest("GET /test/files/test2.txt HTTP/1.1\r\n"
+                           "Host: localhost\r\nRange: bytes=0-3\r\n"
+                           "If-Range: \"0\"\r\n\r\n")
+                ->contains("200 OK"));
+      t->ok("if-none-match",
+            t->sendRequest("GET /test/files/test2.txt HTTP/1.1\r\n"
+                           "Host: localhost\r\nIf-None-Match: *\r\n\r\n")
+                ->contains("304 Not Modified"));
+      t->ok("stale etag",
+            t->sendRequest("GET /test/files/test2.txt HTTP/1.1\r\n"
+                           "Host: localhost\r\nIf-None-Match: \"0\"\r\n\r\n")
+                ->contains("200 OK"));
+
+      FILE *file = fopen("test/files/cached.txt", "w");
+      fputs("before", file);
+      fclose(file);
+      t->strEqual("new file", t->get("/test/files/cached.txt"), "before");
+      file = fopen("test/files/cached.txt", "w");
+      fputs("after!", file);
+      fclose(file);
+      usleep(100000);
+      t->strEqual("changed file", t->get("/test/files/cached.txt"), "after!");
+      unlink("test/files/cached.txt");
+    });
+
+    t->test("Precompressed static files", ^(tape_t *t) {
+      FILE *file = fopen("test/files/encoded.txt", "w");
+      fputs("plain", file);
+      fclose(file);
+      file = fopen("test/files/encoded.txt.gz", "w");
+      fputs("gzipped", file);
+      fclose(file);
+      /* Out of the root, where the file itself could not lead */
+      symlink("../../README.md", "test/files/encoded.txt.br");
+
+      string_t *gzipped = t->sendRequest(
+          "GET /test/files/encoded.txt HTTP/1.1\r\n"
+          "Host: localhost\r\nAccept-Encoding: gzip, br\r\n\r\n");
+      t->ok("gzip variant", gzipped->contains("gzipped"));
+      t->ok("content encoding", gzipped->contains("Content-Encoding: gzip"));
+      t->ok("original type", gzipped->contains("Content-Type: text/plain"));
+      t->ok("vary", gzipped->contains("Vary: Accept-Encoding"));
+      t->ok("refused encoding",
+            t->sendRequest("GET /test/files/encoded.txt HTTP/1.1\r\n"
+                           "Host: localhost\r\nAccept-Encoding: gzip;q=0\r\n"
+                           "\r\n")
+                ->contains("plain"));
+      t->strEqual("identity", t->get("/test/files/encoded.txt"), "plain");
+      string_t *linked =
+          t->sendRequest("GET /test/files/encoded.txt HTTP/1.1\r\n"
+                         "Host: localhost\r\nAccept-Encoding: br\r\n\r\n");
+      t->ok("linked variant", linked->contains("plain") &&
+                                  !linked->contains("Content-Encoding: br"));
+      unlink("test/files/encoded.txt.br");
+      unlink("test/files/encoded.txt.gz");
+      unlink("test/files/encoded.txt");
+    });
+
+    t->test("Embedded static files", ^(tape_t *t) {
+      t->strEqual("embedded", t->get("/test/embedded/page.txt"),
+                  "embedded page");
+      string_t *gzipped =
+          t->sendRequest("GET /test/embedded/page.txt HTTP/1.1\r\n"
+                         "Host: localhost\r\nAccept-Encoding: gzip\r\n\r\n");
+      t->ok("gzip variant", gzipped->contains("gzipped page") &&
+                                gzipped->contains("Content-Encoding: gzip"));
+      t->ok("content type", gzipped->contains("Content-Type: text/plain"));
+      t->ok("etag", gzipped->contains("ETag: \""));
+      t->ok("if-none-match",
+            t->sendRequest("GET /test/embedded/page.txt HTTP/1.1\r\n"
+                           "Host: localhost\r\nIf-None-Match: *\r\n\r\n")
+                ->contains("304 Not Modified"));
+      t->strEqual("falls through", t->get("/test"), "Testing, testing!");
+    });
+
+    t->test("Compression", ^(tape_t *t) {
+      string_t *compressed =
+          t->sendRequest("GET /compressed HTTP/1.1\r\nHost: localhost\r\n"
+                         "Accept-Encoding: gzip, deflate\r\n\r\n");
+      t->ok("gzip", compressed->contains("Content-Encoding: gzip"));
+      t->ok("vary", compressed->contains("Vary: Accept-Encoding"));
+      t->ok("length", compressed->contains("Content-Length: "));
+      t->ok("deflate",
+            t->sendRequest("GET /compressed HTTP/1.1\r\nHost: localhost\r\n"
+                           "Accept-Encoding: deflate\r\n\r\n")
+                ->contains("Content-Encoding: deflate"));
+      t->ok("under threshold",
+            !t->sendRequest("GET /compressed/short HTTP/1.1\r\n"
+                            "Host: localhost\r\nAccept-Encoding: gzip\r\n"
+                            "\r\n")
+                 ->contains("Content-Encoding"));
+      string_t *streamed =
+          t->sendRequest("GET /compressed/stream HTTP/1.1\r\n"
+                         "Host: localhost\r\nAccept-Encoding: gzip\r\n\r\n");
+      t->ok("streamed", streamed->contains("Content-Encoding: gzip") &&
+                            streamed->contains("Transfer-Encoding: chunked"));
+      t->strEqual("not accepted", t->get("/compressed/stream"),
+                  "hello, hello, hello, world!");
+    });
+
+    t->test("HTTP/2 upgrade", ^(tape_t *t) {
+      string_t *upgraded = t->sendRequest(
+          "GET / HTTP/1.1\r\nHost: localhost\r\n"
+          "Connection: Upgrade, HTTP2-Settings\r\nUpgrade: h2c\r\n"
+          "HTTP2-Settings: AAMAAABkAARAAAAA\r\n\r\n");
+      t->ok("switching", upgraded->contains("101 Switching Protocols"));
+      t->ok("upgrade", upgraded->contains("Upgrade: h2c"));
+      t->ok("without settings",
+            t->sendRequest("GET / HTTP/1.1\r\nHost: localhost\r\n"
+                           "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n")
+                ->contains("Hello World!"));
+    });
+
+    t->test("WebSocket", ^(tape_t *t) {
+      /* The masked "Hello" and close frames from RFC 6455 */
+      string_t *echoed = t->sendRequest(
+          "GET /ws HTTP/1.1\r\nHost: localhost\r\n"
+          "Connection: Upgrade\r\nUpgrade: websocket\r\n"
+          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+          "Sec-WebSocket-Version: 13\r\n\r\n"
+          "\x81\x85\x37\xfa\x21\x3d\x7f\x9f\x4d\x51\x58"
+          "\x88\x82\x37\xfa\x34\x12");
+      t->ok("switching", echoed->contains("101 Switching Protocols"));
+      t->ok("accept",
+            echoed->contains("Sec-WebSocket-Accept: "
+                             "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="));
+      t->ok("echo", echoed->contains("\x81\x05Hello"));
+      t->ok("close", echoed->contains("\x88\x02\x03\xe8"));
+      t->ok("not upgraded",
+            t->sendRequest("GET /ws HTTP/1.1\r\nHost: localhost\r\n\r\n")
+                ->contains("426 Upgrade Required"));
+    });
+
+    t->test("Server-Sent Events", ^(tape_t *t) {
+      string_t *events =
+          t->sendRequest("GET /events HTTP/1.1\r\nHost: localhost\r\n\r\n");
+      t->ok("event stream",
+            events->contains("Content-Type: text/event-stream"));
+      t->ok("not cached", events->contains("Cache-Control: no-cache"));
+      t->ok("chunked", events->contains("Transfer-Encoding: chunked"));
+    });
+
     t->test("File", ^(tape_t *t) {
       t->strEqual("file", t->get("/file"), "hello, world!\n");
       char error[1024];
@@ -110,6 +280,56 @@ void expressTests(tape_t *t) {
       // free(missingFile);
     });
 
+    t->test("Range", ^(tape_t *t) {
+      t->ok("single range",
+            t->sendRequest("GET /file HTTP/1.1\r\nHost: localhost\r\n"
+                           "Range: bytes=0-4\r\n\r\n")
+                ->contains("Content-Range: bytes 0-4/14"));
+      t->ok("suffix range",
+            t->sendRequest("GET /file HTTP/1.1\r\nHost: localhost\r\n"
+                           "Range: bytes=-7\r\n\r\n")
+                ->contains("206 Partial Content"));
+      string_t *multiple =
+          t->sendRequest("GET /file HTTP/1.1\r\nHost: localhost\r\n"
+                         "Range: bytes=0-4, 7-\r\n\r\n");
+      t->ok("multiple ranges", multiple->contains("multipart/byteranges"));
+      t->ok("each part",
+            multiple->contains("bytes 0-4/14\r\n\r\nhello\r\n--") &&
+                multiple->contains("bytes 7-13/14\r\n\r\nworld!\n\r\n--"));
+      t->ok("unsatisfiable",
+            t->sendRequest("GET /file HTTP/1.1\r\nHost: localhost\r\n"
+                           "Range: bytes=14-\r\n\r\n")
+                ->contains("Content-Range: bytes */14"));
+      t->ok("stale If-Range",
+            t->sendRequest("GET /file HTTP/1.1\r\nHost: localhost\r\n"
+                           "Range: bytes=0-4\r\nIf-Range: \"stale\"\r\n\r\n")
+                ->contains("200 OK"));
+      t->ok("non-ASCII range ignored",
+            t->sendRequest("GET /file HTTP/1.1\r\nHost: localhost\r\n"
+                           "Range: bytes=\xb9-4\r\n\r\n")
+                ->contains("200 OK"));
+
+      /* Larger than one sendfile() call moves, numbered so a gap shows */
+      size_t lines = 256 * 1024;
+      char *contents = malloc(lines * 16 + 1);
+      for (size_t i = 0; i < lines; i++)
+        snprintf(contents + i * 16, 17, "%015zu\n", i);
+      FILE *file = fopen("test/files/large.txt", "w");
+      fwrite(contents, 1, lines * 16, file);
+      fclose(file);
+      string_t *large =
+          t->sendRequest("GET /test/files/large.txt HTTP/1.1\r\n"
+                         "Host: localhost\r\nConnection: close\r\n"
+                         "Range: bytes=1000-3000999\r\n\r\n");
+      char *body = strstr(large->value, "\r\n\r\n");
+      contents[3001000] = '\0';
+      t->ok("large file range byte-exact",
+            large->contains("Content-Range: bytes 1000-3000999/4194304") &&
+                body != NULL && strcmp(body + 4, contents + 1000) == 0);
+      free(contents);
+      unlink("test/files/large.txt");
+    });
+
     t->test("Session", ^(tape_t *t) {
       t->strEqual("session set", t->post("/session", "param1=session-data"),
                   "ok");
@@ -125,6 +345,216 @@ void expressTests(tape_t *t) {
       t->strEqual("set header", t->get("/set_header"), "test1");
     });
 
+    t->test("Keep-Alive", ^(tape_t *t) {
+      t->ok("http/1.1 keep-alive",
+            t->sendRequest("GET / HTTP/1.1\r\nHost: localhost\r\n\r\n")
+                ->contains("Connection: keep-alive"));
+      t->ok("http/1.1 connection close",
+            t->sendRequest("GET / HTTP/1.1\r\nHost: localhost\r\n"
+                           "Connection: close\r\n\r\n")
+                ->contains("Connection: close"));
+      t->ok("http/1.0 close",
+            t->sendRequest("GET / HTTP/1.0\r\n\r\n")
+                ->contains("Connection: close"));
+      t->ok("http/1.0 keep-alive",
+            t->sendRequest("GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n")
+                ->contains("Connection: keep-alive"));
+      t->ok("send file keep-alive",
+            t->sendRequest("GET /file HTTP/1.1\r\nHost: localhost\r\n\r\n")
+                ->contains("Connection: keep-alive"));
+
+      /* The body a HEAD leaves out would be read as the next response */
+      string_t *head =
+          t->sendRequest("HEAD /test/files/test2.txt HTTP/1.1\r\n"
+                         "Host: localhost\r\n\r\n"
+                         "HEAD /missing HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                         "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n");
+      t->ok("head keeps the length", head->contains("Content-Length: 17"));
+      t->ok("head sends no body", !head->contains("this is a test") &&
+                                      !head->contains("Cannot HEAD"));
+      t->ok("next head", head->contains("\r\n\r\nHTTP/1.1 404 Not Found"));
+      t->ok("get after head", head->contains("\r\n\r\nHello World!"));
+    });
+
+    t->test("Pipelining", ^(tape_t *t) {
+      string_t *pipelined =
+          t->sendRequest("GET /test HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                         "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                         "POST /post/form123 HTTP/1.1\r\nHost: localhost\r\n"
+                         "Content-Type: application/x-www-form-urlencoded\r\n"
+                         "Content-Length: 17\r\n\r\nparam1=1&param2=2");
+      int first = pipelined->indexOf("Testing, testing!");
+      int second = pipelined->indexOf("Hello World!");
+      int third = pipelined->indexOf("<p>Param 1: 1</p><p>Param 2: 2</p>");
+      t->ok("all responses", first >= 0 && second >= 0 && third >= 0);
+      t->ok("in request order", first < second && second < third);
+
+      /* A body framed by a lowercase header is not taken for a request */
+      string_t *lowercase =
+          t->sendRequest("POST /body-size HTTP/1.1\r\nHost: localhost\r\n"
+                         "content-length: 39\r\n\r\n"
+                         "GET /test HTTP/1.1\r\nHost: localhost\r\n\r\n");
+      t->ok("lowercase content-length", lowercase->contains("39 of 39") &&
+                                            !lowercase->contains("Testing"));
+      t->strEqual("negative content-length",
+                  t->sendRequest("POST /body-size HTTP/1.1\r\n"
+                                 "Host: localhost\r\nContent-Length: -1\r\n"
+                                 "\r\n"),
+                  "");
+      t->strEqual("content-length that is not a number",
+                  t->sendRequest("POST /body-size HTTP/1.1\r\n"
+                                 "Host: localhost\r\nContent-Length: 5x\r\n"
+                                 "\r\nhello"),
+                  "");
+    });
+
+    t->test("Partial requests", ^(tape_t *t) {
+      char *headers[] = {"GET /test HTTP/1.1\r\nHo", "st: localhost\r\n",
+                         "\r\n"};
+      t->ok("split headers",
+            t->sendRequestParts(headers, 3)->contains("Testing, testing!"));
+
+      char *body[] = {"POST /post/form123 HTTP/1.1\r\nHost: localhost\r\n"
+                      "Content-Type: application/x-www-form-urlencoded\r\n"
+                      "Content-Length: 17\r\n\r\nparam1=1",
+                      "&param2=2"};
+      t->ok("split body", t->sendRequestParts(body, 2)->contains(
+                              "<p>Param 1: 1</p><p>Param 2: 2</p>"));
+
+      char *truncated[] = {"GET /test HTTP/1.1\r\nHost: localhost\r\n"};
+      t->strEqual("closed before the headers end",
+                  t->sendRequestParts(truncated, 1), "");
+    });
+
+    t->test("Large request body", ^(tape_t *t) {
+      size_t size = 2 * 1024 * 1024;
+      char *body = malloc(size + 1);
+      memset(body, 'a', size);
+      body[size] = '\0';
+      t->strEqual("spilled to a temp file", t->post("/body-size", body),
+                  "2097152 of 2097152");
+      body[65536] = '\0';
+      t->strEqual("in memory", t->post("/body-size", body),
+                  "65536 of 65536");
+      free(body);
+    });
+
+    t->test("Chunked request body", ^(tape_t *t) {
+      char *form[] = {"POST /post/form123 HTTP/1.1\r\nHost: localhost\r\n"
+                      "Content-Type: application/x-www-form-urlencoded\r\n"
+                      "Transfer-Encoding: chunked\r\n\r\n8\r\nparam1=1\r\n",
+                      "9\r\n&param2=2\r\n0\r\n\r\n"};
+      t->ok("decoded across reads", t->sendRequestParts(form, 2)->contains(
+                                        "<p>Param 1: 1</p><p>Param 2: 2</p>"));
+
+      t->ok("next request follows",
+            t->sendRequest("POST /body-size HTTP/1.1\r\nHost: localhost\r\n"
+                           "Transfer-Encoding: chunked\r\n\r\n"
+                           "5\r\nhello\r\n0\r\n\r\n"
+                           "GET /test HTTP/1.1\r\nHost: localhost\r\n\r\n")
+                ->contains("Testing, testing!"));
+
+      t->strEqual("with a Content-Length too",
+                  t->sendRequest("POST /body-size HTTP/1.1\r\n"
+                                 "Host: localhost\r\nContent-Length: 5\r\n"
+                                 "Transfer-Encoding: chunked\r\n\r\n"
+                                 "0\r\n\r\n"),
+                  "");
+
+      /* Three chunks of 1 MB, past the spill threshold */
+      char *head = "POST /body-size HTTP/1.1\r\nHost: localhost\r\n"
+                   "Transfer-Encoding: chunked\r\n\r\n";
+      char *next = "0\r\n\r\nGET /test HTTP/1.1\r\nHost: localhost\r\n\r\n";
+      size_t chunkSize = 1024 * 1024;
+      size_t size = strlen(head) + 3 * (chunkSize + 12) + strlen(next) + 1;
+      char *large = malloc(size);
+      size_t length = strlen(head);
+      memcpy(large, head, length);
+      for (int i = 0; i < 3; i++) {
+        length += sprintf(large + length, "%zx\r\n", chunkSize);
+        memset(large + length, 'a', chunkSize);
+        length += chunkSize;
+        length += sprintf(large + length, "\r\n");
+      }
+      strcpy(large + length, next);
+      string_t *spilled = t->sendRequest(large);
+      t->ok("spilled to a temp file",
+            spilled->contains("3145728 of 3145728") &&
+                spilled->contains("Testing, testing!"));
+      free(large);
+    });
+
+    t->test("Multipart body", ^(tape_t *t) {
+      char *upload = "POST /upload HTTP/1.1\r\nHost: localhost\r\n"
+                     "Content-Type: multipart/form-data; boundary=XyZ\r\n"
+                     "Content-Length: 195\r\n\r\n"
+                     "--XyZ\r\n"
+                     "Content-Disposition: form-data; name=\"title\"\r\n\r\n"
+                     "Hello\r\n"
+                     "--XyZ\r\n"
+                     "Content-Disposition: form-data; name=\"upload\"; "
+                     "filename=\"a.txt\"\r\n"
+                     "Content-Type: text/plain\r\n\r\n"
+                     "line\r\n--Xy not the end\r\n"
+                     "--XyZ--\r\n";
+      t->ok("fields and files", t->sendRequest(upload)->contains(
+                                    "Hello|a.txt|text/plain|22|line\r\n--Xy "
+                                    "not the end"));
+
+      char *parts = "POST /upload-parts HTTP/1.1\r\nHost: localhost\r\n"
+                    "Content-Type: multipart/form-data; boundary=\"XyZ\"\r\n"
+                    "Content-Length: 63\r\n\r\n"
+                    "--XyZ\r\n"
+                    "Content-Disposition: form-data; name=a\r\n\r\n"
+                    "123\r\n"
+                    "--XyZ--\r\n";
+      t->ok("streamed to a handler",
+            t->sendRequest(parts)->contains("0 2 3"));
+
+      char *invalid = "POST /upload-parts HTTP/1.1\r\nHost: localhost\r\n"
+                      "Content-Type: multipart/form-data; boundary=XyZ\r\n"
+                      "Content-Length: 62\r\n\r\n"
+                      "--XyZ\r\n"
+                      "Content-Disposition: form-data; name=a\r\n\r\n"
+                      "123\r\n"
+                      "--XyZ!\r\n";
+      t->ok("invalid body", t->sendRequest(invalid)->contains(
+                                "HTTP/1.1 400 Bad Request"));
+    });
+
+    t->test("Streaming response", ^(tape_t *t) {
+      t->strEqual("chunks in order", t->get("/stream"), "hello, world!");
+      t->ok("chunked",
+            t->sendRequest("GET /stream HTTP/1.1\r\nHost: localhost\r\n\r\n")
+                ->contains("Transfer-Encoding: chunked"));
+      t->ok("http/1.0 closes",
+            t->sendRequest("GET /stream HTTP/1.0\r\n\r\n")
+                ->contains("Connection: close"));
+    });
+
+    t->test("Large response", ^(tape_t *t) {
+      t->ok("larger than the socket buffer",
+            t->get("/large")->size == 4 * 1024 * 1024);
+
+      char header[8193];
+      for (size_t i = 0; i < sizeof(header) - 1; i++)
+        header[i] = 'a' + i % 26;
+      header[sizeof(header) - 1] = '\0';
+      size_t lines = 32 * 1024;
+      char *body = malloc(lines * 16 + 1);
+      for (size_t i = 0; i < lines; i++)
+        snprintf(body + i * 16, 17, "%015zu\n", i);
+      string_t *segments =
+          t->sendRequest("GET /segments HTTP/1.1\r\nHost: localhost\r\n"
+                         "Connection: close\r\n\r\n");
+      char *separator = strstr(segments->value, "\r\n\r\n");
+      t->ok("headers and body intact and in order",
+            separator != NULL && strstr(segments->value, header) != NULL &&
+                strstr(segments->value, header) < separator &&
+                strcmp(separator + 4, body) == 0);
+      free(body);
+    });
+
     t->test("Cookies", ^(tape_t *t) {
       t->strEqual("set cookie", t->get("/set_cookie\?session=123\\&user=test"),
                   "ok");
@@ -213,6 +643,20 @@ void expressTests(tape_t *t) {
     void statusMessageTests(tape_t * t);
     statusMessageTests(t);
 
+    /* Timer wheel */
+    void timerWheelTests(tape_t * t);
+    timerWheelTests(t);
+
+#ifdef __linux__
+    /* Hot restart */
+    void hotRestartTests(tape_t * t);
+    hotRestartTests(t);
+
+    /* Drain, io_uring and sharding, each in a server of its own */
+    void serverSettingsTests(tape_t * t);
+    serverSettingsTests(t);
+#endif
+
 /* Middleware */
 #if defined(__linux__) || defined(DEV_ENV)
     void postgresMiddlewareTests(tape_t * t);
@@ -0,0 +1,150 @@
+#ifdef __linux__
+
+#include "../src/express.h"
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <tape/tape.h>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wshadow"
+
+/* Where test/test.c serves the test app from an inherited socket */
+#define HOT_RESTART_PORT 3033
+
+/* Bound like the server binds by default, IPv6 with IPv4 mapped into it */
+static int listenForChild() {
+  int flag = 1;
+  int v6Only = 0;
+  struct sockaddr_in6 address = {.sin6_family = AF_INET6,
+                                 .sin6_port = htons(HOT_RESTART_PORT),
+                                 .sin6_addr = IN6ADDR_ANY_INIT};
+  int listener = socket(AF_INET6, SOCK_STREAM, 0);
+  if (listener < 0)
+    return -1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+  setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(v6Only));
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listener, 16) < 0) {
+    close(listener);
+    return -1;
+  }
+  return listener;
+}
+
+static void requestChild(char *request, char *response, size_t size) {
+  struct sockaddr_in address = {.sin_family = AF_INET,
+                                .sin_port = htons(HOT_RESTART_PORT)};
+  inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  connect(sock, (struct sockaddr *)&address, sizeof(address));
+  send(sock, request, strlen(request), 0);
+  size_t responseLen = 0;
+  ssize_t readBytes;
+  while (responseLen < size - 1 &&
+         (readBytes = recv(sock, response + responseLen,
+                           size - responseLen - 1, 0)) > 0)
+    responseLen += readBytes;
+  response[responseLen] = '\0';
+  close(sock);
+}
+
+/* As a server listening at handoffPath would, and then waits for the ack */
+static int handOverTo(int handoff, int listener) {
+  int connection = accept(handoff, NULL, NULL);
+  if (connection < 0)
+    return -1;
+  struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
+  setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  char byte = 0;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr message = {.msg_iov = &iov,
+                           .msg_iovlen = 1,
+                           .msg_control = control,
+                           .msg_controllen = sizeof(control)};
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(header), &listener, sizeof(int));
+  int acknowledged = sendmsg(connection, &message, 0) == 1 &&
+                     recv(connection, &byte, 1, 0) == 1;
+  close(connection);
+  return acknowledged ? 0 : -1;
+}
+
+void hotRestartTests(tape_t *t) {
+  t->test("hot restart", ^(tape_t *t) {
+    int listener = listenForChild();
+    t->ok("listening", listener >= 0);
+    if (listener < 0)
+      return;
+
+    char fds[16];
+    snprintf(fds, sizeof(fds), "%d", listener);
+    pid_t child = fork();
+    if (child == 0) {
+      /* A fresh process, as libdispatch is not to be used after fork() */
+      setenv("EXPRESS_LISTEN_FDS", fds, 1);
+      execl("/proc/self/exe", "test", NULL);
+      _exit(1);
+    }
+    /* The connection waits in the accept queue until the child takes it */
+    close(listener);
+    char response[4096];
+    requestChild("GET / HTTP/1.1\r\nHost: localhost\r\n"
+                 "Connection: close\r\n\r\n",
+                 response, sizeof(response));
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+
+    t->ok("forked", child > 0);
+    t->ok("served on the inherited socket",
+          t->string(response)->contains("Hello World!"));
+  });
+
+  t->test("hot restart at handoffPath", ^(tape_t *t) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/express-test-%d.sock", (int)getpid());
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strcpy(address.sun_path, path);
+    unlink(path);
+    int handoff = socket(AF_UNIX, SOCK_STREAM, 0);
+    int listener = listenForChild();
+    t->ok("listening",
+          handoff >= 0 && listener >= 0 &&
+              bind(handoff, (struct sockaddr *)&address, sizeof(address)) ==
+                  0 &&
+              listen(handoff, 1) == 0);
+    struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
+    setsockopt(handoff, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    pid_t child = fork();
+    if (child == 0) {
+      setenv("EXPRESS_TEST_SERVER", "handoff", 1);
+      setenv("EXPRESS_HANDOFF_PATH", path, 1);
+      execl("/proc/self/exe", "test", NULL);
+      _exit(1);
+    }
+    t->ok("acknowledged once accepting", handOverTo(handoff, listener) == 0);
+    close(handoff);
+    close(listener);
+    char response[4096];
+    requestChild("GET / HTTP/1.1\r\nHost: localhost\r\n"
+                 "Connection: close\r\n\r\n",
+                 response, sizeof(response));
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+    unlink(path);
+
+    t->ok("served on the handed over socket",
+          t->string(response)->contains("Hello World!"));
+  });
+}
+
+#pragma clang diagnostic pop
+
+#endif
@@ -0,0 +1,291 @@
+#ifdef __linux__
+
+#include "../src/express.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <tape/tape.h>
+
+uint64_t timerWheelNow();
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wshadow"
+
+/* Where test/test.c serves the test app from an inherited socket */
+#define TEST_SERVER_PORT 3033
+
+/*
+  Called by test/test.c in the server started below, before it listens.
+  SIGUSR1 drains it, and the exit status tells if that finished in time.
+*/
+void testServerSettings(app_t *app, const char *settings) {
+  server_t *server = app->server;
+  server->threadCount = 2;
+  server->keepAliveTimeout = 1;
+  server->ioUring = strstr(settings, "io-uring") != NULL;
+  server->reusePort = strstr(settings, "reuse-port") != NULL;
+  if (strstr(settings, "handoff") != NULL)
+    server->handoffPath = getenv("EXPRESS_HANDOFF_PATH");
+
+  signal(SIGUSR1, SIG_IGN);
+  dispatch_source_t source = dispatch_source_create(
+      DISPATCH_SOURCE_TYPE_SIGNAL, SIGUSR1, 0,
+      dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+  dispatch_source_set_event_handler(source, ^{
+    exit(app->drain(NULL) == 0 ? 0 : 2);
+  });
+  dispatch_resume(source);
+}
+
+static int ioUringAvailable() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(SYS_io_uring_setup, 4, &params);
+  if (fd < 0)
+    return 0;
+  close(fd);
+  return 1;
+}
+
+/* Bound like the server binds by default, IPv6 with IPv4 mapped into it */
+static int listenForChild(int reusePort) {
+  int flag = 1;
+  int v6Only = 0;
+  struct sockaddr_in6 address = {.sin6_family = AF_INET6,
+                                 .sin6_port = htons(TEST_SERVER_PORT),
+                                 .sin6_addr = IN6ADDR_ANY_INIT};
+  int listener = socket(AF_INET6, SOCK_STREAM, 0);
+  if (listener < 0)
+    return -1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+  if (reusePort)
+    setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
+  setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(v6Only));
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listener, 64) < 0) {
+    close(listener);
+    return -1;
+  }
+  return listener;
+}
+
+static int connectToTestServer() {
+  struct sockaddr_in address = {.sin_family = AF_INET,
+                                .sin_port = htons(TEST_SERVER_PORT)};
+  inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0)
+    return -1;
+  struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  if (connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/* Until the server closes the connection, or five seconds pass without data */
+static size_t readUntilClosed(int sock, char *response, size_t size) {
+  size_t responseLen = 0;
+  ssize_t readBytes;
+  while (responseLen < size - 1 &&
+         (readBytes = recv(sock, response + responseLen,
+                           size - responseLen - 1, 0)) > 0)
+    responseLen += readBytes;
+  response[responseLen] = '\0';
+  return responseLen;
+}
+
+static void requestTestServer(char *request, char *response, size_t size) {
+  response[0] = '\0';
+  int sock = connectToTestServer();
+  if (sock < 0)
+    return;
+  send(sock, request, strlen(request), 0);
+  readUntilClosed(sock, response, size);
+  close(sock);
+}
+
+/*
+  Serves the test app from a fresh process, as libdispatch is not to be used
+  after fork(). Returns once it answered a first request.
+*/
+static pid_t startTestServer(const char *settings, int reusePort) {
+  int listener = listenForChild(reusePort);
+  if (listener < 0)
+    return -1;
+
+  char fds[16];
+  snprintf(fds, sizeof(fds), "%d", listener);
+  pid_t child = fork();
+  if (child == 0) {
+    setenv("EXPRESS_LISTEN_FDS", fds, 1);
+    setenv("EXPRESS_TEST_SERVER", settings, 1);
+    execl("/proc/self/exe", "test", NULL);
+    _exit(1);
+  }
+  /* The connection waits in the accept queue until the child takes it */
+  close(listener);
+  if (child < 0)
+    return -1;
+  char response[4096];
+  requestTestServer("GET / HTTP/1.1\r\nHost: localhost\r\n"
+                    "Connection: close\r\n\r\n",
+                    response, sizeof(response));
+  if (strstr(response, "Hello World!") == NULL) {
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    return -1;
+  }
+  return child;
+}
+
+static void drainTest(tape_t *t, const char *settings) {
+  pid_t child = startTestServer(settings, 0);
+  t->ok("started", child > 0);
+  if (child <= 0)
+    return;
+
+  int sock = connectToTestServer();
+  char *request = "GET /slow HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  send(sock, request, strlen(request), 0);
+  /* The handler is running by now, and still is when the drain starts */
+  usleep(200 * 1000);
+  kill(child, SIGUSR1);
+  usleep(200 * 1000);
+
+  int late = connectToTestServer();
+  t->ok("refuses new connections", late < 0);
+  if (late >= 0)
+    close(late);
+
+  char response[4096];
+  readUntilClosed(sock, response, sizeof(response));
+  close(sock);
+  int status = -1;
+  waitpid(child, &status, 0);
+
+  t->ok("finishes the request in flight",
+        t->string(response)->contains("slow"));
+  t->ok("exits within drainTimeout",
+        WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/* Until the response has ended with end, the connection is kept */
+static void readUntil(int sock, char *response, size_t size, const char *end) {
+  size_t responseLen = 0;
+  ssize_t readBytes;
+  response[0] = '\0';
+  while (strstr(response, end) == NULL && responseLen < size - 1 &&
+         (readBytes = recv(sock, response + responseLen,
+                           size - responseLen - 1, 0)) > 0) {
+    responseLen += readBytes;
+    response[responseLen] = '\0';
+  }
+}
+
+static void ioUringTest(tape_t *t) {
+  pid_t child = startTestServer("io-uring", 0);
+  t->ok("GET", child > 0);
+  if (child <= 0)
+    return;
+
+  int sock = connectToTestServer();
+  char response[4096];
+  char *request = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  send(sock, request, strlen(request), 0);
+  readUntil(sock, response, sizeof(response), "Hello World!");
+  t->ok("keep-alive", t->string(response)->contains("Hello World!") &&
+                          t->string(response)->contains("keep-alive"));
+
+  /* Too large for one send, so it goes out in several */
+  size_t length = 4 * 1024 * 1024;
+  size_t size = length + 4096;
+  char *large = malloc(size);
+  request = "GET /large HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  send(sock, request, strlen(request), 0);
+  size_t largeLen = 0;
+  size_t headersLen = 0;
+  ssize_t readBytes;
+  while ((headersLen == 0 || largeLen < headersLen + length) &&
+         largeLen < size - 1 &&
+         (readBytes = recv(sock, large + largeLen, size - largeLen - 1, 0)) >
+             0) {
+    largeLen += readBytes;
+    large[largeLen] = '\0';
+    char *body = headersLen == 0 ? strstr(large, "\r\n\r\n") : NULL;
+    if (body != NULL)
+      headersLen = body + 4 - large;
+  }
+  size_t bodyLen = headersLen > 0 ? largeLen - headersLen : 0;
+  size_t intact = 0;
+  while (intact < bodyLen && large[headersLen + intact] == 'a')
+    intact++;
+  t->ok("second request on the connection, sent in full",
+        bodyLen == length && intact == length);
+  free(large);
+
+  /* keepAliveTimeout is 1 second in the test server */
+  uint64_t start = timerWheelNow();
+  t->ok("closed when idle", recv(sock, response, sizeof(response), 0) == 0 &&
+                                timerWheelNow() - start < 3000);
+  close(sock);
+
+  kill(child, SIGTERM);
+  waitpid(child, NULL, 0);
+}
+
+/* Each connection is hashed to a shard, so a few dozen reach more than one */
+static void reusePortTest(tape_t *t) {
+  pid_t child = startTestServer("reuse-port", 1);
+  t->ok("started", child > 0);
+  if (child <= 0)
+    return;
+
+  char threads[32][64];
+  int threadCount = 0;
+  for (int i = 0; i < 32; i++) {
+    char response[4096];
+    requestTestServer("GET /thread HTTP/1.1\r\nHost: localhost\r\n"
+                      "Connection: close\r\n\r\n",
+                      response, sizeof(response));
+    char *body = strstr(response, "\r\n\r\n");
+    if (body == NULL)
+      continue;
+    int seen = 0;
+    for (int j = 0; j < threadCount; j++)
+      seen = seen || strcmp(threads[j], body + 4) == 0;
+    if (!seen)
+      snprintf(threads[threadCount++], sizeof(threads[0]), "%s", body + 4);
+  }
+  t->ok("both shards accept", threadCount >= 2);
+
+  kill(child, SIGTERM);
+  waitpid(child, NULL, 0);
+}
+
+void serverSettingsTests(tape_t *t) {
+  t->test("drain", ^(tape_t *t) {
+    drainTest(t, "");
+  });
+
+  t->test("reusePort", ^(tape_t *t) {
+    reusePortTest(t);
+  });
+
+  /* Skipped where io_uring cannot be set up, the server would use epoll */
+  if (ioUringAvailable()) {
+    t->test("io_uring", ^(tape_t *t) {
+      ioUringTest(t);
+    });
+
+    t->test("drain with io_uring", ^(tape_t *t) {
+      drainTest(t, "io-uring");
+    });
+  }
+}
+
+#pragma clang diagnostic pop
+
+#endif
@@ -11,6 +11,15 @@ router_t *cookieSessionRouter();
 router_t *jwtRouter();
 router_t *resourceRouter(char *, int);
 
+/* As scripts/embed.sh would generate them for test/embedded */
+static unsigned char test_embedded_page_txt[] = "embedded page";
+static unsigned char test_embedded_page_txt_gz[] = "gzipped page";
+static unsigned char *embeddedFilesData[] = {test_embedded_page_txt,
+                                             test_embedded_page_txt_gz};
+static int embeddedFilesLengths[] = {13, 12};
+static char *embeddedFilesNames[] = {"test_embedded_page_txt",
+                                     "test_embedded_page_txt_gz"};
+
 app_t *testApp() {
 
   env_load(".", false);
@@ -19,12 +28,18 @@ app_t *testApp() {
   char *TEST_DATABASE_URL = getenv("TEST_DATABASE_URL");
 
   __block app_t *app = express();
+  app->server->http2 = 1;
 
   app->use(expressHelpersMiddleware());
 
   char *staticFilesPath = cwdFullPath("test/files");
   embedded_files_data_t embeddedFiles = {0};
+  app->use(expressStaticCache("test/files", staticFilesPath,
+                               "public, max-age=0", 0));
   app->use(expressStatic("test/files", staticFilesPath, embeddedFiles));
+  embedded_files_data_t testEmbeddedFiles = {
+      embeddedFilesData, embeddedFilesLengths, embeddedFilesNames, 2};
+  app->use(expressStatic("test/embedded", NULL, testEmbeddedFiles));
 
   mem_session_t *memSession = malloc(sizeof(mem_session_t));
   memSession->stores = malloc(sizeof(mem_store_t *) * 1000);
@@ -96,6 +111,10 @@ app_t *testApp() {
         subdomains[2], req->ipsCount, ips[0], ips[1], ips[2]);
   });
 
+  app->get("/ip", ^(request_t *req, response_t *res) {
+    res->send(req->ip);
+  });
+
   app->get("/file", ^(UNUSED request_t *req, response_t *res) {
     res->sendFile("./test/files/test.txt");
   });
@@ -108,6 +127,83 @@ app_t *testApp() {
     res->download("test_missing.txt", NULL);
   });
 
+  app->post("/body-size", ^(request_t *req, response_t *res) {
+    __block size_t received = 0;
+    req->onData(^(UNUSED const char *chunk, size_t length) {
+      received += length;
+    });
+    res->sendf("%zu of %lld", received, req->contentLength);
+  });
+
+  app->post("/upload", ^(request_t *req, response_t *res) {
+    multipart_part_t *file = req->files();
+    char contents[64] = "";
+    if (file != NULL) {
+      FILE *upload = fopen(file->path, "r");
+      contents[fread(contents, 1, sizeof(contents) - 1, upload)] = '\0';
+      fclose(upload);
+    }
+    res->sendf("%s|%s|%s|%zu|%s", req->body("title"),
+               file ? file->filename : "", file ? file->contentType : "",
+               file ? file->size : 0, contents);
+  });
+
+  app->post("/upload-parts", ^(request_t *req, response_t *res) {
+    __block size_t pieces = 0;
+    __block size_t total = 0;
+    int result = req->onPart(
+        ^(UNUSED multipart_part_t *part, UNUSED const char *data,
+          size_t length) {
+          pieces++;
+          total += length;
+        });
+    if (result < 0)
+      res->status = 400;
+    res->sendf("%d %zu %zu", result, pieces, total);
+  });
+
+  app->get("/stream", ^(UNUSED request_t *req, response_t *res) {
+    res->flushHeaders();
+    res->write("hello", 5);
+    res->write(", ", 2);
+    res->write("world!", 6);
+    res->end();
+  });
+
+  app->get("/large", ^(UNUSED request_t *req, response_t *res) {
+    size_t size = 4 * 1024 * 1024;
+    char *body = malloc(size + 1);
+    memset(body, 'a', size);
+    body[size] = '\0';
+    res->send(body);
+    free(body);
+  });
+
+  /* Headers past 4KB and a body past the socket buffer, numbered in order */
+  app->get("/segments", ^(UNUSED request_t *req, response_t *res) {
+    char header[8193];
+    for (size_t i = 0; i < sizeof(header) - 1; i++)
+      header[i] = 'a' + i % 26;
+    header[sizeof(header) - 1] = '\0';
+    res->set("X-Segments", header);
+    size_t lines = 32 * 1024;
+    char *body = malloc(lines * 16 + 1);
+    for (size_t i = 0; i < lines; i++)
+      snprintf(body + i * 16, 17, "%015zu\n", i);
+    res->send(body);
+    free(body);
+  });
+
+  app->get("/slow", ^(UNUSED request_t *req, response_t *res) {
+    usleep(1000 * 1000);
+    res->send("slow");
+  });
+
+  /* Which worker answered, so sharding can be seen from outside */
+  app->get("/thread", ^(UNUSED request_t *req, response_t *res) {
+    res->sendf("%lu", (unsigned long)pthread_self());
+  });
+
   app->get("/one/:one/two/:two/:three.jpg", ^(request_t *req, response_t *res) {
     char *one = req->params("one");
     char *two = req->params("two");
@@ -412,6 +508,40 @@ app_t *testApp() {
     }
   });
 
+  router_t *compressedRouter = expressRouter();
+
+  compressedRouter->use(expressCompression(16));
+
+  compressedRouter->get("/", ^(UNUSED request_t *req, response_t *res) {
+    res->json("{\"data\":[{\"type\":\"notes\"},{\"type\":\"notes\"},"
+              "{\"type\":\"notes\"},{\"type\":\"notes\"}]}");
+  });
+
+  compressedRouter->get("/short", ^(UNUSED request_t *req, response_t *res) {
+    res->send("short");
+  });
+
+  compressedRouter->get("/stream", ^(UNUSED request_t *req, response_t *res) {
+    res->write("hello, hello, ", 14);
+    res->write("hello, world!", 13);
+    res->end();
+  });
+
+  app->ws("/ws", ^(websocket_t *ws, UNUSED request_t *req) {
+    ws->onMessage =
+        Block_copy(^(websocket_t *socket, websocket_opcode_t opcode,
+                     const char *data, size_t length) {
+          expressWebSocketSend(socket, opcode, data, length);
+        });
+  });
+
+  sse_hub_t *sseHub = expressSseHub();
+
+  app->get("/events", ^(UNUSED request_t *req, response_t *res) {
+    expressSseSubscribe(res, sseHub, "test");
+  });
+
+  app->useRouter("/compressed", compressedRouter);
   app->useRouter("/", rootRouter);
   router->useRouter("/params/:id", paramsRouter);
   app->useRouter("/base", router);
@@ -427,6 +557,7 @@ app_t *testApp() {
     }
     free(memSession->stores);
     free(memSession);
+    expressSseHubFree(sseHub);
   }));
 
   return app;
@@ -1,6 +1,7 @@
 #include "../src/express.h"
 #include <Block.h>
 #include <dotenv-c/dotenv.h>
+#include <signal.h>
 #include <middleware/postgres-middleware.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -59,6 +60,22 @@ void runTests(int runAndExit, test_harness_t *testHarness,
 
 int main() {
   env_load(".", false);
+  /* The requests below write to connections the server may have closed */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* Started by test/hot-restart.c or test/server-settings.c */
+  if (getenv("EXPRESS_LISTEN_FDS") != NULL ||
+      getenv("EXPRESS_TEST_SERVER") != NULL) {
+    app_t *app = testApp();
+#ifdef __linux__
+    void testServerSettings(app_t * app, const char *settings);
+    if (getenv("EXPRESS_TEST_SERVER") != NULL)
+      testServerSettings(app, getenv("EXPRESS_TEST_SERVER"));
+#endif
+    app->listen(3033, ^{
+                });
+    return 1;
+  }
 
   int runXTimes = getenv("RUN_X_TIMES") ? atoi(getenv("RUN_X_TIMES")) : 1;
   int sleepTime = getenv("SLEEP_TIME") ? atoi(getenv("SLEEP_TIME")) : 0;
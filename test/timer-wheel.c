@@ -0,0 +1,69 @@
+#include "../src/express.h"
+#include <tape/tape.h>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wshadow"
+
+void timerWheelInit(timer_wheel_t *wheel, uint64_t nowMs);
+void wheelTimerInit(wheel_timer_t *timer, void (*expire)(wheel_timer_t *),
+                    void *data);
+void timerWheelAdd(timer_wheel_t *wheel, wheel_timer_t *timer,
+                   uint64_t timeoutMs);
+void timerWheelCancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+void timerWheelAdvance(timer_wheel_t *wheel, uint64_t nowMs);
+int timerWheelTimeout(timer_wheel_t *wheel, uint64_t nowMs);
+
+static void countExpired(wheel_timer_t *timer) { (*(int *)timer->data)++; }
+
+void timerWheelTests(tape_t *t) {
+  t->test("timerWheel", ^(tape_t *t) {
+    timer_wheel_t *wheel = malloc(sizeof(timer_wheel_t));
+    timerWheelInit(wheel, 0);
+    t->ok("empty wheel waits forever", timerWheelTimeout(wheel, 0) == -1);
+
+    int shortExpired = 0, longExpired = 0, cancelled = 0, moved = 0;
+    wheel_timer_t shortTimer, longTimer, cancelTimer, moveTimer;
+    wheelTimerInit(&shortTimer, countExpired, &shortExpired);
+    wheelTimerInit(&longTimer, countExpired, &longExpired);
+    wheelTimerInit(&cancelTimer, countExpired, &cancelled);
+    wheelTimerInit(&moveTimer, countExpired, &moved);
+
+    timerWheelAdd(wheel, &shortTimer, 500);
+    timerWheelAdd(wheel, &longTimer, 30000);
+    timerWheelAdd(wheel, &cancelTimer, 1000);
+    timerWheelAdd(wheel, &moveTimer, 1000);
+    t->ok("wakes for the first timer", timerWheelTimeout(wheel, 0) == 500);
+
+    timerWheelCancel(wheel, &cancelTimer);
+    timerWheelAdd(wheel, &moveTimer, 5000);
+
+    timerWheelAdvance(wheel, 400);
+    t->ok("short timer pending", shortExpired == 0);
+    timerWheelAdvance(wheel, 500);
+    t->ok("short timer expired", shortExpired == 1);
+
+    timerWheelAdvance(wheel, 1000);
+    t->ok("cancelled timer", cancelled == 0);
+    t->ok("moved timer pending", moved == 0);
+    timerWheelAdvance(wheel, 5000);
+    t->ok("moved timer expired", moved == 1);
+
+    timerWheelAdvance(wheel, 29900);
+    t->ok("long timer pending", longExpired == 0);
+    timerWheelAdvance(wheel, 30000);
+    t->ok("long timer cascaded and expired", longExpired == 1);
+
+    int farExpired = 0;
+    wheel_timer_t farTimer;
+    wheelTimerInit(&farTimer, countExpired, &farExpired);
+    timerWheelAdd(wheel, &farTimer, 2 * 60 * 60 * 1000);
+    timerWheelAdvance(wheel, 30000 + 2 * 60 * 60 * 1000 - 100);
+    t->ok("far timer pending", farExpired == 0);
+    timerWheelAdvance(wheel, 30000 + 2 * 60 * 60 * 1000);
+    t->ok("far timer expired", farExpired == 1);
+    t->ok("wheel is empty", timerWheelTimeout(wheel, 0) == -1);
+
+    free(wheel);
+  });
+}
+#pragma clang diagnostic pop